@@ -8,6 +8,36 @@
 #include <vector>
 #include <math.h>
 #include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <filesystem>
+#include <new>
+#include <stdarg.h>
+#include <time.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <immintrin.h>
+#define SIMD_SSE2
+#ifdef __GNUC__
+#define TARGET_AVX __attribute__((target("avx")))
+#else
+#define TARGET_AVX
+#endif
+#endif
 #include "Engine.h"
 
 const int screen_width = 1280;
@@ -23,6 +53,149 @@ SDL_Color black = { 0, 0, 0 };
 
 SDL_Color white = { 255,255,255 };
 
+Replay gReplay;
+
+AssetPack gPack;
+
+TextureCache gTextureCache;
+
+Perf gPerf;
+
+FrameArena gFrame;
+
+//zero initialised before any constructor runs, so allocations made during static init are counted too
+Memory gMemory;
+
+static thread_local int memory_tag = MEMORY_OTHER;
+
+//every hooked block carries its size and tag in front of it
+struct MemoryHeader
+{
+    Uint64 size;
+    int tag;
+    int reserved;
+};
+
+#ifdef _DEBUG
+//counts this thread's global heap allocations, read and cleared once per presented frame
+static thread_local int heap_allocations = 0;
+#endif
+
+//C++ allocations are always tagged in _DEBUG builds and from --memory on in the others, blocks made before that carry tag -1
+void* operator new(size_t size)
+{
+#ifdef _DEBUG
+    heap_allocations++;
+    bool tagged = true;
+#else
+    bool tagged = gMemory.hooked;
+#endif
+    MemoryHeader* header = (MemoryHeader*)malloc(sizeof(MemoryHeader) + size);
+    if (header == NULL)
+        throw std::bad_alloc();
+    header->size = size;
+    header->tag = tagged ? memory_tag : -1;
+    if (tagged)
+        gMemory.add(header->tag, (int)size);
+    return header + 1;
+}
+
+void operator delete(void* memory) noexcept
+{
+    if (memory != NULL)
+    {
+        MemoryHeader* header = (MemoryHeader*)memory - 1;
+        if (header->tag >= 0)
+            gMemory.remove(header->tag, (int)header->size);
+        free(header);
+    }
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+    operator delete(memory);
+}
+
+static SDL_malloc_func sdl_malloc;
+static SDL_calloc_func sdl_calloc;
+static SDL_realloc_func sdl_realloc;
+static SDL_free_func sdl_free;
+
+static void* SDLCALL hookMalloc(size_t size)
+{
+    MemoryHeader* header = (MemoryHeader*)sdl_malloc(sizeof(MemoryHeader) + size);
+    if (header == NULL)
+        return NULL;
+    header->size = size;
+    header->tag = memory_tag;
+    gMemory.add(header->tag, (int)size);
+    return header + 1;
+}
+
+static void* SDLCALL hookCalloc(size_t count, size_t size)
+{
+    void* memory = hookMalloc(count * size);
+    if (memory != NULL)
+        SDL_memset(memory, 0, count * size);
+    return memory;
+}
+
+static void SDLCALL hookFree(void* memory)
+{
+    if (memory != NULL)
+    {
+        MemoryHeader* header = (MemoryHeader*)memory - 1;
+        gMemory.remove(header->tag, (int)header->size);
+        sdl_free(header);
+    }
+}
+
+static void* SDLCALL hookRealloc(void* memory, size_t size)
+{
+    if (memory == NULL)
+        return hookMalloc(size);
+
+    MemoryHeader* header = (MemoryHeader*)memory - 1;
+    int tag = header->tag;
+    size_t old = header->size;
+
+    MemoryHeader* moved = (MemoryHeader*)sdl_realloc(header, sizeof(MemoryHeader) + size);
+    if (moved == NULL)
+        return NULL;
+
+    gMemory.remove(tag, (int)old);
+    moved->size = size;
+    gMemory.add(tag, (int)size);
+    return moved + 1;
+}
+
+bool gHud = false;
+
+Texture hud_lines[MEMORY_TAGS + 2];
+
+Uint32 hud_updated = 0;
+
+Audio gAudio;
+
+Scheduler gScheduler;
+
+Uint64 gInputArrival = 0;
+
+bool gLowLatency = false;
+
+//--lighting turns the light map on for levels that are not dark themselves
+bool gLighting = false;
+
+//set while --raster runs, textures then keep a CPU copy of their pixels
+SoftRaster* gRaster = NULL;
+
+Capture gCapture;
+
+int gAiBudget = 300;
+
+//set by --connect, port 0 plays offline
+NetAddress gConnect = { 0, 0 };
+
 bool checkCollision(SDL_Rect& a, SDL_Rect& b)
 {
     int leftA, leftB;
@@ -67,1540 +240,9315 @@ bool checkCollision(SDL_Rect& a, SDL_Rect& b)
 
 }
 
-bool init()
+bool parseOptions(int argc, char* argv[])
 {
-    bool success = true;
+    bool run = true;
 
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0)
+    int battles = 0;
+    Uint64 seed = 1;
+    int spread = 25;
+    int server = -1;
+    int bots = 1;
+    int seconds = 0;
+    NetAddress bot_target = { 0, 0 };
+    int instances = 0;
+    int workers = 0;
+    int instance_players = 2;
+    std::string raster, golden;
+    int raster_frames = 100;
+    int raster_threads = 0;
+    int particles = 0;
+    int particle_frames = 300;
+    bool memory_check = false;
+    bool blend_check = false;
+    bool layer_check = false;
+
+    for (int i = 1; i < argc; i++)
     {
-        printf("SDL could not initialize! SDL_ERROR: %s\n", SDL_GetError());
+        if (std::string(argv[i]) == "--memory" || std::string(argv[i]) == "--memory-check")
+        {
+            gMemory.hook();
+        }
     }
-    else
+
+    for (int i = 1; i < argc; i++)
     {
+        std::string arg = argv[i];
 
-        if (!SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1"))
+        if (arg == "--pack")
         {
-            printf("Warning: Linear texture filtering not enabled!");
+            buildPack("Assets", "Assets.pack");
+            run = false;
         }
-
-        gWindow = SDL_CreateWindow("SIMPLE RPG", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, screen_width, screen_height, SDL_WINDOW_SHOWN);
-        if (gWindow == NULL)
+        else if (arg == "--cook")
         {
-            printf("Window could not be created SDL_ERROR: %s\n", SDL_GetError());
-            success = false;
+            gPack.open("Assets.pack");
+            gTextureCache.cook("Assets", "Assets.cook");
+            gPack.close();
+            run = false;
         }
-        else
+        else if (arg == "--scripts")
         {
-            gRenderer = SDL_CreateRenderer(gWindow, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-            if (gRenderer == NULL)
+            compileScripts("Assets/scripts");
+            run = false;
+        }
+        else if (arg == "--simulate" && i + 1 < argc)
+        {
+            battles = atoi(argv[++i]);
+            run = false;
+        }
+        else if (arg == "--seed" && i + 1 < argc)
+        {
+            seed = strtoull(argv[++i], NULL, 10);
+        }
+        else if (arg == "--ai-budget" && i + 1 < argc)
+        {
+            gAiBudget = atoi(argv[++i]);
+        }
+        else if (arg == "--spread" && i + 1 < argc)
+        {
+            spread = atoi(argv[++i]);
+        }
+        else if (arg == "--record" && i + 1 < argc)
+        {
+            if (!gReplay.record(argv[++i]))
             {
-                printf("Renderer could not be created! SDL Error: %s\n", SDL_GetError());
-                success = false;
+                printf("Cannot open replay file %s for writing\n", argv[i]);
             }
-            else
+        }
+        else if (arg == "--replay" && i + 1 < argc)
+        {
+            if (!gReplay.play(argv[++i]))
             {
-                SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
-                int imgFlags = IMG_INIT_PNG;
-                if ((!IMG_Init(imgFlags) & imgFlags))
-                {
-                    printf("SDL_image could not initialize! SDL_image Error: %s\n", IMG_GetError());
-                    success = false;
-                }
-
-                if (TTF_Init() == -1)
-                {
-                    printf("SDL_ttf could not initialize! SDL_ttf Error: %s\n", TTF_GetError());
-                    success = false;
-                }
-
-                if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048) < 0)
-                {
-                    printf("SDL_mixer could not initialize! SDL_mixer Error: %s\n", Mix_GetError());
-                    success = false;
-                }
-
+                printf("Cannot open replay file %s\n", argv[i]);
             }
-
         }
-
+        else if (arg == "--headless")
+        {
+            gReplay.headless = true;
+        }
+        else if (arg == "--low-latency")
+        {
+            gLowLatency = true;
+        }
+        else if (arg == "--lighting")
+        {
+            gLighting = true;
+        }
+        else if (arg == "--capture-dir" && i + 1 < argc)
+        {
+            gCapture.directory = argv[++i];
+        }
+        else if (arg == "--capture")
+        {
+            gCapture.recording = true;
+        }
+        else if (arg == "--audio-buffer" && i + 1 < argc)
+        {
+            gAudio.buffer = atoi(argv[++i]);
+        }
+        else if (arg == "--audio-voices" && i + 1 < argc)
+        {
+            gAudio.voices = atoi(argv[++i]);
+        }
+        else if (arg == "--server" && i + 1 < argc)
+        {
+            server = atoi(argv[++i]);
+            run = false;
+        }
+        else if (arg == "--connect" && i + 1 < argc)
+        {
+            if (!UdpSocket::resolve(argv[++i], gConnect))
+            {
+                printf("Cannot resolve server address %s\n", argv[i]);
+            }
+        }
+        else if (arg == "--bot" && i + 1 < argc)
+        {
+            if (!UdpSocket::resolve(argv[++i], bot_target))
+            {
+                printf("Cannot resolve server address %s\n", argv[i]);
+            }
+            run = false;
+        }
+        else if (arg == "--bots" && i + 1 < argc)
+        {
+            bots = atoi(argv[++i]);
+        }
+        else if (arg == "--net-seconds" && i + 1 < argc)
+        {
+            seconds = atoi(argv[++i]);
+        }
+        else if (arg == "--instances" && i + 1 < argc)
+        {
+            instances = atoi(argv[++i]);
+            run = false;
+        }
+        else if (arg == "--workers" && i + 1 < argc)
+        {
+            workers = atoi(argv[++i]);
+        }
+        else if (arg == "--instance-players" && i + 1 < argc)
+        {
+            instance_players = atoi(argv[++i]);
+        }
+        else if (arg == "--raster" && i + 1 < argc)
+        {
+            raster = argv[++i];
+            run = false;
+        }
+        else if (arg == "--golden" && i + 1 < argc)
+        {
+            golden = argv[++i];
+        }
+        else if (arg == "--raster-frames" && i + 1 < argc)
+        {
+            raster_frames = atoi(argv[++i]);
+        }
+        else if (arg == "--raster-threads" && i + 1 < argc)
+        {
+            raster_threads = atoi(argv[++i]);
+        }
+        else if (arg == "--memory-check")
+        {
+            memory_check = true;
+            run = false;
+        }
+        else if (arg == "--blend-check")
+        {
+            blend_check = true;
+            run = false;
+        }
+        else if (arg == "--layer-check")
+        {
+            layer_check = true;
+            run = false;
+        }
+        else if (arg == "--particles" && i + 1 < argc)
+        {
+            particles = atoi(argv[++i]);
+            run = false;
+        }
+        else if (arg == "--particle-frames" && i + 1 < argc)
+        {
+            particle_frames = atoi(argv[++i]);
+        }
     }
 
-    return success;
-}
-
-int loadMedia(Tilemap* t)
-{
-    int success = 1;
+    if (battles > 0)
+    {
+        simulateCombat(battles, seed, spread);
+    }
 
-    gFont = TTF_OpenFont("Assets/Fonts/DroidSansMono.ttf", 28);
+    if (server >= 0)
+    {
+        runServer((Uint16)server, seconds);
+    }
 
-    if (gFont == NULL)
+    if (bot_target.port != 0)
     {
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search font file. Please reinstall game :)", NULL);
-        printf("Failed to load lazy font! SDL_ttf Error: %s\n", TTF_GetError());
-        success = 0;
+        runBots(bot_target, bots, seconds);
     }
 
-    if (t->load() == false)
+    if (instances > 0)
     {
-        success = 0;
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search tilemap file. Please reinstall game :)", NULL);
-        printf("Failed to load tilemap\n");
+        runInstances(instances, workers, instance_players, seconds);
     }
 
-    return success;
-}
+    if (raster != "" && !runRaster(raster, golden, raster_frames, raster_threads))
+    {
+        exit(1);
+    }
 
-void close(Tilemap* t, Player* p)
-{
-    t->free();
-    p->~Player();
+    if (particles > 0)
+    {
+        runParticles(particles, particle_frames);
+    }
 
-    TTF_CloseFont(gFont);
-    gFont = NULL;
+    if (memory_check && !checkMemory())
+    {
+        exit(1);
+    }
 
-    SDL_DestroyRenderer(gRenderer);
-    SDL_DestroyWindow(gWindow);
-    gWindow = NULL;
-    gRenderer = NULL;
+    if (blend_check && !checkBlend())
+    {
+        exit(1);
+    }
 
-    TTF_Quit();
-    IMG_Quit();
-    SDL_Quit();
+    if (layer_check && !checkLayers())
+    {
+        exit(1);
+    }
+    return run;
 }
 
-Timer::Timer()
+int pollEvent(SDL_Event* e)
 {
-    startedticks = 0;
-    ticks = 0;
-    started = false;
-    seconds = 0;
-}
+    int result = gReplay.poll(e);
 
-Timer::Timer(float s)
-{
-    startedticks = 0;
-    ticks = 0;
-    started = false;
-    seconds = s;
-}
-void Timer::set_seconds(float s)
-{
-    seconds = s;
-}
-void Timer::start()
-{
-    startedticks = SDL_GetTicks();
-    started = true;
-}
-bool Timer::morethanseconds()
-{
-    bool more = false;
+    if (result != 0 && e->type == SDL_KEYDOWN && e->key.keysym.sym == SDLK_F3 && e->key.repeat == 0)
+    {
+        gHud = !gHud;
+    }
+
+    if (result != 0 && e->type == SDL_KEYDOWN && e->key.repeat == 0)
+    {
+        if (e->key.keysym.sym == SDLK_F12)
+            gCapture.screenshot();
+        else if (e->key.keysym.sym == SDLK_F11)
+            gCapture.toggle();
+    }
 
-    if (started)
+    if (result != 0 && (e->type == SDL_KEYDOWN || e->type == SDL_TEXTINPUT || e->type == SDL_MOUSEBUTTONDOWN))
     {
-        ticks = SDL_GetTicks() - startedticks;
+        Uint64 arrival = SDL_GetPerformanceCounter();
+        Uint32 now = SDL_GetTicks();
 
-        if (ticks / 1000.f >= seconds)
+        if (e->common.timestamp != 0 && e->common.timestamp <= now)
         {
-            more = true;
+            arrival -= (Uint64)(now - e->common.timestamp) * SDL_GetPerformanceFrequency() / 1000;
         }
+
+        markInput(arrival);
     }
 
-    return more;
+    return result;
 }
 
-Texture::Texture()
+void markInput(Uint64 when)
 {
-    mTexture = NULL;
-    mWidth = 0;
-    mHeight = 0;
+    if (gInputArrival == 0 || when < gInputArrival)
+    {
+        gInputArrival = when;
+    }
 }
-Texture::~Texture()
+
+//hands the input marked since the last present to a pipelined frame, which marks it again when the list built from it is presented
+Uint64 takeInput()
 {
-    free();
+    Uint64 when = gInputArrival;
+    gInputArrival = 0;
+    return when;
 }
 
-bool Texture::loadFromFile(std::string path)
+void present()
 {
-    free();
+    if (gHud)
+    {
+        drawHud();
+    }
 
-    SDL_Texture* newTexture = NULL;
+    gCapture.grab();
 
-    SDL_Surface* loadedSurface = IMG_Load(path.c_str());
+    SDL_RenderPresent(gRenderer);
 
-    if (loadedSurface == NULL)
+    if (gLowLatency)
     {
-        printf("Unable to load image %s! SDL_image Error: %s\n", path.c_str(), IMG_GetError());
-
+        //reading a pixel back waits for the GPU, so the CPU cannot queue frames ahead of the display
+        Uint32 pixel;
+        SDL_Rect one = { 0, 0, 1, 1 };
+        SDL_RenderReadPixels(gRenderer, &one, SDL_PIXELFORMAT_ARGB8888, &pixel, 4);
     }
-    else
+
+    if (gInputArrival != 0)
     {
-        newTexture = SDL_CreateTextureFromSurface(gRenderer, loadedSurface);
-        if (newTexture == NULL)
-        {
-            printf("Unable to create texture %s! SDL Error: %s\n", path.c_str(), SDL_GetError());
-        }
-        else
-        {
-            mWidth = loadedSurface->w;
-            mHeight = loadedSurface->h;
-        }
-        SDL_FreeSurface(loadedSurface);
+        gPerf.add(PERF_INPUT_LATENCY, gInputArrival);
+        gInputArrival = 0;
     }
 
-    mTexture = newTexture;
-    return mTexture != NULL;
+    gFrame.reset();
+
+    gMemory.frame();
 }
-bool Texture::loadFromRenderedText(std::string textureText, SDL_Color textColor)
+
+//this thread's operator new count since the last call, always 0 outside _DEBUG builds
+int takeAllocations()
 {
-    free();
+#ifdef _DEBUG
+    int count = heap_allocations;
+    heap_allocations = 0;
+    return count;
+#else
+    return 0;
+#endif
+}
 
-    SDL_Surface* textSurface = TTF_RenderText_Solid(gFont, textureText.c_str(), textColor);
+const char* memory_names[MEMORY_TAGS] = { "other", "tilemap", "ui", "dialog", "fight", "audio" };
 
-    if (textSurface == NULL)
-    {
-        printf("Unable to render text surface! SDL_ttf Error: %s\n", TTF_GetError());
+//F3 overlay, the text is rebuilt twice a second so the overlay itself stays cheap
+void drawHud()
+{
+    MemoryScope scope(MEMORY_UI);
 
-    }
-    else
+    if (getTicks() - hud_updated >= 500 || hud_updated == 0)
     {
-        mTexture = SDL_CreateTextureFromSurface(gRenderer, textSurface);
+        hud_updated = getTicks();
 
-        if (mTexture == NULL)
+        for (int i = 0; i < MEMORY_TAGS; i++)
         {
-            printf("Unable to create texture from rendered text! SDL Error: %s\n", SDL_GetError());
+            hud_lines[i].loadFromRenderedText(gFrame.format("%s: %.1f KB live (%.1f KB textures), %.1f KB peak, %d allocs/frame", memory_names[i],
+                SDL_AtomicGet(&gMemory.live[i]) / 1024.0, SDL_AtomicGet(&gMemory.textures[i]) / 1024.0, SDL_AtomicGet(&gMemory.peak[i]) / 1024.0, gMemory.per_frame[i]), white);
         }
-        else
-        {
-            mWidth = textSurface->w;
-            mHeight = textSurface->h;
-        }
-        SDL_FreeSurface(textSurface);
+        hud_lines[MEMORY_TAGS].loadFromRenderedText(gFrame.format("input to present %.0f us, scripts %.1f us, lighting %.1f us, particles %.1f us, mixer %.1f us",
+            gPerf.average(PERF_INPUT_LATENCY), gPerf.average(PERF_SCRIPTS), gPerf.average(PERF_LIGHTING), gPerf.average(PERF_PARTICLES), gPerf.average(PERF_MIXER)), white);
+        hud_lines[MEMORY_TAGS + 1].loadFromRenderedText(gFrame.format("frame arena %d/%d bytes peak%s", (int)gFrame.peak, (int)gFrame.capacity,
+            gMemory.hooked ? ", SDL allocations hooked" : ""), white);
     }
 
-    return mTexture != NULL;
+    SDL_Rect panel = { 0, 0, 0, 0 };
+    for (int i = 0; i < MEMORY_TAGS + 2; i++)
+    {
+        if (hud_lines[i].getWidth() + 10 > panel.w)
+            panel.w = hud_lines[i].getWidth() + 10;
+        panel.h += hud_lines[i].getHeight();
+    }
+
+    SDL_SetRenderDrawBlendMode(gRenderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(gRenderer, 0, 0, 0, 0xC0);
+    SDL_RenderFillRect(gRenderer, &panel);
+    SDL_SetRenderDrawBlendMode(gRenderer, SDL_BLENDMODE_NONE);
+
+    int y = 0;
+    for (int i = 0; i < MEMORY_TAGS + 2; i++)
+    {
+        hud_lines[i].render(5, y);
+        y += hud_lines[i].getHeight();
+    }
 }
-void Texture::SetColor(Uint8 red, Uint8 green, Uint8 blue)
+
+void Memory::add(int tag, int bytes)
 {
-    SDL_SetTextureColorMod(mTexture, red, green, blue);
+    SDL_AtomicAdd(&allocs[tag], 1);
+    SDL_AtomicAdd(&frame_allocs[tag], 1);
+
+    int now = SDL_AtomicAdd(&live[tag], bytes) + bytes;
+    int old = SDL_AtomicGet(&peak[tag]);
+    while (now > old && !SDL_AtomicCAS(&peak[tag], old, now))
+    {
+        old = SDL_AtomicGet(&peak[tag]);
+    }
 }
-void Texture::setBlendMode(SDL_BlendMode blending)
+
+void Memory::remove(int tag, int bytes)
 {
-    SDL_SetTextureBlendMode(mTexture, blending);
+    SDL_AtomicAdd(&live[tag], -bytes);
 }
-void Texture::setAlpha(Uint8 alpha)
+
+void Memory::addTexture(int tag, int bytes)
 {
-    SDL_SetTextureAlphaMod(mTexture, alpha);
+    SDL_AtomicAdd(&textures[tag], bytes);
+    add(tag, bytes);
 }
-void Texture::free()
+
+void Memory::removeTexture(int tag, int bytes)
 {
-    if (mTexture != NULL)
+    SDL_AtomicAdd(&textures[tag], -bytes);
+    remove(tag, bytes);
+}
+
+//must run before SDL allocates anything, blocks from the old allocator would have no header
+void Memory::hook()
+{
+    SDL_GetMemoryFunctions(&sdl_malloc, &sdl_calloc, &sdl_realloc, &sdl_free);
+    if (SDL_GetNumAllocations() != 0)
     {
-        SDL_DestroyTexture(mTexture);
-        mTexture = NULL;
-        mWidth = 0;
-        mHeight = 0;
+        printf("SDL has already allocated memory, allocation hooks not installed\n");
+        return;
     }
+    hooked = SDL_SetMemoryFunctions(hookMalloc, hookCalloc, hookRealloc, hookFree) == 0;
 }
-void Texture::render(int x, int y, SDL_Rect* clip)
+
+void Memory::frame()
 {
-    SDL_Rect renderQuad = { x,y,mWidth,mHeight };
+    for (int i = 0; i < MEMORY_TAGS; i++)
+    {
+        per_frame[i] = SDL_AtomicSet(&frame_allocs[i], 0);
+    }
+}
 
-    if (clip != NULL)
+void Memory::report()
+{
+#ifndef _DEBUG
+    if (!hooked)
     {
-        renderQuad.w = clip->w;
-        renderQuad.h = clip->h;
+        printf("Memory: textures only, build with _DEBUG or run with --memory for heap allocations\n");
+    }
+#endif
+    for (int i = 0; i < MEMORY_TAGS; i++)
+    {
+        printf("Memory %s: %.1f KB live, %.1f KB textures, %.1f KB peak, %d allocations\n", memory_names[i],
+            SDL_AtomicGet(&live[i]) / 1024.0, SDL_AtomicGet(&textures[i]) / 1024.0, SDL_AtomicGet(&peak[i]) / 1024.0, SDL_AtomicGet(&allocs[i]));
     }
+}
 
-    SDL_RenderCopy(gRenderer, mTexture, clip, &renderQuad);
+int Memory::tag()
+{
+    return memory_tag;
 }
-int Texture::getWidth()
+
+MemoryScope::MemoryScope(MemoryTag tag)
 {
-    return mWidth;
+    previous = memory_tag;
+    memory_tag = tag;
 }
-int Texture::getHeight()
+
+MemoryScope::~MemoryScope()
 {
-    return mHeight;
+    memory_tag = previous;
 }
 
-void Texture::to_input(SDL_Rect& col)
+//plain malloc, the global arena is built before --memory can hook SDL's allocator
+FrameArena::FrameArena(size_t bytes)
 {
-    SDL_QueryTexture(mTexture, NULL, NULL, &col.w, &col.h);
+    memory = (Uint8*)malloc(bytes);
+    capacity = memory != NULL ? bytes : 0;
+    used = 0;
+    peak = 0;
+    overflows = 0;
 }
 
+FrameArena::~FrameArena()
+{
+    free(memory);
+}
 
-Tilemap::Tilemap()
+void* FrameArena::alloc(size_t size, size_t align)
 {
-    for (int i = 0; i < 40; i++)
+    size_t start = (used + align - 1) & ~(align - 1);
+    if (start + size > capacity)
     {
-        for (int j = 0; j < 24; j++)
-        {
-            ground[i][j] = 0;
-            objects[i][j] = 0;
-        }
+        overflows++;
+        return NULL;
     }
 
-    set();
+    used = start + size;
+    if (used > peak)
+        peak = used;
+    return memory + start;
 }
 
-bool Tilemap::load()
+//printf into the arena; the text lives until the end of the frame
+const char* FrameArena::format(const char* fmt, ...)
 {
-    bool succes = true;
+    if (used >= capacity)
+    {
+        overflows++;
+        return "";
+    }
+
+    char* text = (char*)memory + used;
+    size_t room = capacity - used;
 
-    for (int i = 0; i < 1064; i++)
+    va_list args;
+    va_start(args, fmt);
+    int length = SDL_vsnprintf(text, room, fmt, args);
+    va_end(args);
+
+    if (length < 0)
     {
-        std::string do_zmiany = std::to_string(i + 1);
-        if (elements[i].loadFromFile("Assets/Tilemap/" + do_zmiany + ".png") == false)
-        {
-            succes = false;
-        }
+        text[0] = 0;
+        length = 0;
     }
-    return succes;
+    else if ((size_t)length >= room)
+    {
+        overflows++;
+        length = (int)room - 1;
+    }
+
+    used += length + 1;
+    if (used > peak)
+        peak = used;
+    return text;
 }
 
-void Tilemap::set()
+void FrameArena::reset()
 {
-    for (int i = 0; i < 40; i++)
-    {
-        for (int j = 0; j < 24; j++)
-        {
-            ground[i][j] = 1;
-            collider[i][j].x = i * 32;
-            collider[i][j].y = j * 32;
-            collider[i][j].h = collider[i][j].w = 32;
-        }
-    }
+    used = 0;
+}
 
+void waitForEvent(int timeout)
+{
+    gReplay.wait(timeout);
 }
 
-void Tilemap::show(int id)
+Uint32 getTicks()
 {
-    for (int i = 0; i < 40; i++)
-    {
-        for (int j = 0; j < 24; j++)
-        {
+    return gReplay.ticks();
+}
 
-            if (id == 0)
-            {
-                elements[ground[i][j] - 1].render(i * 32, j * 32);
-            }
-            else
-            {
-                if (objects[i][j] != 0)
-                {
-                    elements[objects[i][j] - 1].render(i * 32, j * 32);
-                }
-            }
+static thread_local const Uint8* keyboard_snapshot = NULL;
 
-        }
+const Uint8* getKeyboardState()
+{
+    if (keyboard_snapshot != NULL)
+    {
+        return keyboard_snapshot;
     }
+    return gReplay.keyboard();
 }
 
-void Tilemap::free()
+//the simulation thread reads the keys the main thread sampled for its tick
+void useKeyboard(const Uint8* keys)
+{
+    keyboard_snapshot = keys;
+}
+
+Perf::Perf()
 {
-    for (int i = 0; i < 1064; i++)
+    lock = 0;
+    for (int i = 0; i < PERF_COUNTERS; i++)
     {
-        elements[i].free();
+        time[i] = 0;
+        samples[i] = 0;
+        peak[i] = 0;
     }
 }
 
-bool Tilemap::loadFromfile(std::string path, int l)
+//64 bit totals under a spinlock, a 32 bit microsecond sum wraps after about 36 minutes
+void Perf::add(PerfCounter counter, Uint64 start)
 {
-    bool loaded = true;
-    std::fstream mapa;
-    mapa.open(path, std::ios::in);
-    if (!mapa.good())
+    record(counter, (SDL_GetPerformanceCounter() - start) * 1000000 / SDL_GetPerformanceFrequency());
+}
+
+void Perf::record(PerfCounter counter, Uint64 us)
+{
+    SDL_AtomicLock(&lock);
+    time[counter] += us;
+    samples[counter]++;
+    if (us > peak[counter])
+        peak[counter] = us;
+    SDL_AtomicUnlock(&lock);
+}
+
+double Perf::average(PerfCounter counter)
+{
+    SDL_AtomicLock(&lock);
+    Uint64 total = time[counter];
+    Uint64 count = samples[counter];
+    SDL_AtomicUnlock(&lock);
+
+    if (count == 0)
     {
-        printf("Something wrong with map level isn't working");
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search map level file. Please reinstall game :)", NULL);
-        loaded = false;
+        return 0;
     }
-    else
+
+    return (double)total / count;
+}
+
+void Perf::report()
+{
+    const char* names[PERF_COUNTERS] = { "mixer", "input to present", "scripts", "lighting", "particles" };
+
+    for (int i = 0; i < PERF_COUNTERS; i++)
     {
-        int a = 0;
-        int i = 0, j = 0;
-        while (mapa >> a)
+        SDL_AtomicLock(&lock);
+        Uint64 total = time[i];
+        Uint64 count = samples[i];
+        Uint64 worst = peak[i];
+        SDL_AtomicUnlock(&lock);
+
+        if (count > 0)
         {
-            if (i > 39)
-            {
-                i = 0;
-                j++;
-            }
-            switch (l)
-            {
-            case 0:
-                ground[i][j] = a;
-                break;
-            case 1:
-                objects[i][j] = a;
-                break;
-            }
-            
-            i++;
+            printf("Perf %s: %llu samples, %.1f us average, %llu us peak, %.1f ms total\n", names[i], (unsigned long long)count, (double)total / count, (unsigned long long)worst, total / 1000.0);
         }
     }
-    return loaded;
 }
-Player::Player(int pozx, int pozy)
+
+const char* sound_files[SOUND_COUNT] =
 {
-    frame = 0;
-    lastx = 0;
-    lasty = -1;
-    velocity = 5;
-    ismoving = false;
-    Collider.w = 21;
-    Collider.h = 32;
-    Collider.x = pozx;
-    Collider.y = pozy;
-    nick = "NICKNAME";
-    id = "0";
-    map = 1;
-    save = "0";
-    keyboard_active = true;
-}
+    "Assets/Sounds/click.wav",
+    "Assets/Sounds/hit.wav",
+    "Assets/Sounds/blip.wav"
+};
 
-bool Player::load()
+//cpu time used by the calling thread, nanoseconds or on windows cycles
+static Uint64 threadTime()
 {
-    bool succes = true;
+#ifdef _WIN32
+    ULONG64 cycles = 0;
+    QueryThreadCycleTime(GetCurrentThread(), &cycles);
+    return cycles;
+#else
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (Uint64)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
 
-    if (!player_texture.loadFromFile("Assets/Player/p" + id + ".png"))
+//threadTime units per microsecond, cycles are calibrated against the performance counter by spinning 10 ms
+static double threadTimeRate()
+{
+#ifdef _WIN32
+    Uint64 cycles = threadTime();
+    Uint64 start = SDL_GetPerformanceCounter();
+    Uint64 elapsed = 0;
+    while (elapsed < SDL_GetPerformanceFrequency() / 100)
     {
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search player texture file. Please reinstall game :)", NULL);
-        succes = false;
+        elapsed = SDL_GetPerformanceCounter() - start;
     }
-    else
+    return (threadTime() - cycles) / (elapsed * 1000000.0 / SDL_GetPerformanceFrequency());
+#else
+    return 1000;
+#endif
+}
+
+Audio::Audio()
+{
+    frequency = 44100;
+    buffer = 2048;
+    voices = 8;
+    music = NULL;
+    mixing = 0;
+    mix_rate = 1;
+    opened = false;
+    for (int i = 0; i < SOUND_COUNT; i++)
     {
-        down[0].x = 0;
-        down[0].y = 0;
-        down[0].w = 32;
-        down[0].h = 32;
+        sounds[i] = NULL;
+    }
+}
 
-        down[1].x = 32;
-        down[1].y = 0;
-        down[1].w = 32;
-        down[1].h = 32;
+bool Audio::open()
+{
+    MemoryScope scope(MEMORY_AUDIO);
 
-        down[2].x = 64;
-        down[2].y = 0;
-        down[2].w = 32;
-        down[2].h = 32;
+    Mix_Init(MIX_INIT_OGG | MIX_INIT_MP3 | MIX_INIT_FLAC | MIX_INIT_OPUS);
 
-        left[0].x = 0;
-        left[0].y = 32;
-        left[0].w = 32;
-        left[0].h = 32;
+    if (Mix_OpenAudio(frequency, MIX_DEFAULT_FORMAT, 2, buffer) < 0)
+    {
+        return false;
+    }
 
-        left[1].x = 32;
-        left[1].y = 32;
-        left[1].w = 32;
-        left[1].h = 32;
+    opened = true;
 
-        left[2].x = 64;
-        left[2].y = 32;
-        left[2].w = 32;
-        left[2].h = 32;
+    voices = Mix_AllocateChannels(voices);
+    priorities.assign(voices, 0);
+    started.assign(voices, 0);
 
-        right[0].x = 0;
-        right[0].y = 64;
-        right[0].w = 32;
-        right[0].h = 32;
+    mix_rate = threadTimeRate();
+    Mix_SetPostMix(mix_end, this);
 
-        right[1].x = 32;
-        right[1].y = 64;
-        right[1].w = 32;
-        right[1].h = 32;
+    for (int i = 0; i < SOUND_COUNT; i++)
+    {
+        sounds[i] = Mix_LoadWAV_RW(openAsset(sound_files[i]), 1);
+        if (sounds[i] == NULL)
+        {
+            printf("Sound %s not loaded, SDL_mixer Error: %s\n", sound_files[i], Mix_GetError());
+        }
+    }
 
-        right[2].x = 64;
-        right[2].y = 64;
-        right[2].w = 32;
-        right[2].h = 32;
+    printf("Audio: %d Hz, %d sample buffer (%.1f ms), %d voices\n", frequency, buffer, buffer * 1000.0 / frequency, voices);
 
-        up[0].x = 0;
-        up[0].y = 96;
-        up[0].w = 32;
-        up[0].h = 32;
+    return true;
+}
 
-        up[1].x = 32;
-        up[1].y = 96;
-        up[1].w = 32;
-        up[1].h = 32;
+void Audio::mix_end(void* data, Uint8*, int)
+{
+    Audio* audio = (Audio*)data;
+    Uint64 now = threadTime();
 
-        up[2].x = 64;
-        up[2].y = 96;
-        up[2].w = 32;
-        up[2].h = 32;
+    //the post mix is the last thing in every callback and the audio thread sleeps in between,
+    //so its cpu time since the previous post mix is one whole callback: music, channels and effects
+    if (audio->mixing != 0)
+    {
+        gPerf.record(PERF_MIXER, (Uint64)((now - audio->mixing) / audio->mix_rate));
     }
-    return succes;
+    audio->mixing = now;
 }
 
-void Player::handleEvents(SDL_Event& e)
+void Audio::play(Sound sound, int priority)
 {
-    if (e.type == SDL_KEYDOWN && keyboard_active)
+    if (!opened || sounds[sound] == NULL)
     {
-        ismoving = true;
-        switch (e.key.keysym.sym)
-        {
-        case SDLK_LEFT:
-        case SDLK_a:
-            Collider.x -= velocity;
-            lasty = 0;
-            lastx = -1;
-            break;
-        case SDLK_RIGHT:
-        case SDLK_d:
-            Collider.x += velocity;
-            lastx = 1;
-            lasty = 0;
-            break;
-        case SDLK_UP:
-        case SDLK_w:
-            Collider.y -= velocity;
-            lasty = 1;
-            lastx = 0;
-            break;
-        case SDLK_DOWN:
-        case SDLK_s:
-            Collider.y += velocity;
-            lastx = 0;
-            lasty = -1;
-        default:
-            break;
-        }
-
+        return;
     }
-    else if (e.type == SDL_KEYUP && keyboard_active)
+
+    int voice = -1;
+
+    for (int i = 0; i < voices && voice == -1; i++)
     {
-        ismoving = false;
+        if (Mix_Playing(i) == 0)
+        {
+            voice = i;
+        }
     }
-}
 
-void Player::move(SDL_Rect& wall)
-{
-    if (checkCollision(Collider, wall) == 1)
+    if (voice == -1)
     {
-        if (lastx != 0)
+        for (int i = 0; i < voices; i++)
         {
-            if (lastx == 1)
+            if (priorities[i] > priority)
             {
-                Collider.x -= velocity;
+                continue;
             }
-            else if (lastx == -1)
+            if (voice == -1 || priorities[i] < priorities[voice] || (priorities[i] == priorities[voice] && started[i] < started[voice]))
             {
-                Collider.x += velocity;
+                voice = i;
             }
         }
-        if (lasty != 0)
+
+        if (voice == -1)
+        {
+            return;
+        }
+
+        Mix_HaltChannel(voice);
+    }
+
+    if (Mix_PlayChannel(voice, sounds[sound], 0) != -1)
+    {
+        priorities[voice] = priority;
+        started[voice] = SDL_GetTicks();
+    }
+}
+
+void Audio::playMusic(std::string path)
+{
+    MemoryScope scope(MEMORY_AUDIO);
+
+    stopMusic();
+
+    if (!opened || path == "")
+    {
+        return;
+    }
+
+    music = Mix_LoadMUS_RW(openAsset(path), 1);
+
+    if (music == NULL)
+    {
+        printf("Music %s not loaded, SDL_mixer Error: %s\n", path.c_str(), Mix_GetError());
+        return;
+    }
+
+    Mix_PlayMusic(music, -1);
+}
+
+void Audio::stopMusic()
+{
+    if (music != NULL)
+    {
+        Mix_HaltMusic();
+        Mix_FreeMusic(music);
+        music = NULL;
+    }
+}
+
+void Audio::close()
+{
+    if (!opened)
+    {
+        return;
+    }
+
+    stopMusic();
+    Mix_HaltChannel(-1);
+    Mix_SetPostMix(NULL, NULL);
+    mixing = 0;
+
+    for (int i = 0; i < SOUND_COUNT; i++)
+    {
+        if (sounds[i] != NULL)
+        {
+            Mix_FreeChunk(sounds[i]);
+            sounds[i] = NULL;
+        }
+    }
+
+    Mix_CloseAudio();
+    Mix_Quit();
+    opened = false;
+}
+
+Uint64 hashBytes(const void* data, size_t size, Uint64 hash)
+{
+    const Uint8* bytes = (const Uint8*)data;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+MappedFile::MappedFile()
+{
+    mData = NULL;
+    mSize = 0;
+    mFile = NULL;
+    mMapping = NULL;
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(std::string path)
+{
+    close();
+
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER length;
+    GetFileSizeEx(handle, &length);
+
+    HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+    {
+        CloseHandle(handle);
+        return false;
+    }
+
+    mData = (const Uint8*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    mFile = handle;
+    mMapping = mapping;
+    mSize = (size_t)length.QuadPart;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat info;
+    fstat(fd, &info);
+    mSize = (size_t)info.st_size;
+
+    void* view = mmap(NULL, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    mData = view == MAP_FAILED ? NULL : (const Uint8*)view;
+#endif
+
+    if (mData == NULL)
+    {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+    if (mData != NULL)
+    {
+        UnmapViewOfFile(mData);
+    }
+    if (mMapping != NULL)
+    {
+        CloseHandle((HANDLE)mMapping);
+    }
+    if (mFile != NULL)
+    {
+        CloseHandle((HANDLE)mFile);
+    }
+#else
+    if (mData != NULL)
+    {
+        munmap((void*)mData, mSize);
+    }
+#endif
+    mData = NULL;
+    mSize = 0;
+    mFile = NULL;
+    mMapping = NULL;
+}
+
+const Uint8* MappedFile::data()
+{
+    return mData;
+}
+
+size_t MappedFile::size()
+{
+    return mSize;
+}
+
+//pack layout: "RPGP" | version | count | names size | index offset | 64-byte aligned data | PackEntry[count] sorted by path_hash | names
+const Uint32 pack_version = 1;
+
+const int pack_header = 24;
+
+const int pack_align = 64;
+
+const Uint32 cooked_format = SDL_PIXELFORMAT_ARGB8888;
+
+AssetPack::AssetPack()
+{
+    entries = NULL;
+    names = NULL;
+    entries_count = 0;
+}
+
+bool AssetPack::open(std::string path)
+{
+    close();
+
+    if (!file.open(path))
+    {
+        return false;
+    }
+
+    const Uint8* base = file.data();
+    Uint32 header[4];
+    Uint64 index_offset;
+
+    if (file.size() < pack_header || SDL_memcmp(base, "RPGP", 4) != 0)
+    {
+        printf("%s is not an asset pack\n", path.c_str());
+        file.close();
+        return false;
+    }
+
+    SDL_memcpy(header, base, 16);
+    SDL_memcpy(&index_offset, base + 16, 8);
+
+    if (header[1] != pack_version || index_offset + (Uint64)header[2] * sizeof(PackEntry) + header[3] > file.size())
+    {
+        printf("Asset pack %s is damaged or outdated\n", path.c_str());
+        file.close();
+        return false;
+    }
+
+    entries_count = header[2];
+    entries = (const PackEntry*)(base + index_offset);
+    names = (const char*)(entries + entries_count);
+
+    return true;
+}
+
+void AssetPack::close()
+{
+    file.close();
+    entries = NULL;
+    names = NULL;
+    entries_count = 0;
+}
+
+const PackEntry* AssetPack::find(std::string path)
+{
+    if (entries_count == 0)
+    {
+        return NULL;
+    }
+
+    Uint64 hash = hashBytes(path.c_str(), path.length());
+
+    int low = 0, high = entries_count;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (entries[mid].path_hash < hash)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    for (int i = low; i < entries_count && entries[i].path_hash == hash; i++)
+    {
+        if (entries[i].name_length == path.length() && SDL_memcmp(names + entries[i].name_offset, path.c_str(), path.length()) == 0)
+        {
+            return &entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+const Uint8* AssetPack::data(const PackEntry* entry)
+{
+    return file.data() + entry->offset;
+}
+
+std::string AssetPack::name(const PackEntry* entry)
+{
+    return std::string(names + entry->name_offset, entry->name_length);
+}
+
+int AssetPack::count()
+{
+    return entries_count;
+}
+
+const PackEntry* AssetPack::entry(int i)
+{
+    return &entries[i];
+}
+
+bool AssetPack::loaded()
+{
+    return entries_count > 0;
+}
+
+SDL_RWops* openAsset(std::string path)
+{
+    const PackEntry* entry = gPack.find(path);
+
+    if (entry != NULL)
+    {
+        return SDL_RWFromConstMem(gPack.data(entry), (int)entry->size);
+    }
+
+    return SDL_RWFromFile(path.c_str(), "rb");
+}
+
+bool readAsset(std::string path, std::string& content)
+{
+    const PackEntry* entry = gPack.find(path);
+
+    if (entry != NULL)
+    {
+        content.assign((const char*)gPack.data(entry), (size_t)entry->size);
+        return true;
+    }
+
+    std::fstream plik;
+    plik.open(path, std::ios::in | std::ios::binary);
+    if (!plik.good())
+    {
+        return false;
+    }
+
+    std::stringstream data;
+    data << plik.rdbuf();
+    content = data.str();
+    return true;
+}
+
+std::vector<std::string> listAssets(std::string directory, std::vector<std::string> extensions)
+{
+    namespace fs = std::filesystem;
+
+    std::vector<std::string> files;
+    std::error_code error;
+
+    for (fs::recursive_directory_iterator it(directory, error), end; it != end; it.increment(error))
+    {
+        if (error || !it->is_regular_file())
+        {
+            continue;
+        }
+
+        std::string name = it->path().generic_string();
+        std::string extension = it->path().extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+        if (name.find(directory + "/Saves/") == 0)
+        {
+            continue;
+        }
+
+        if (std::find(extensions.begin(), extensions.end(), extension) != extensions.end())
+        {
+            files.push_back(name);
+        }
+    }
+
+    std::sort(files.begin(), files.end());
+
+    return files;
+}
+
+bool writePack(std::string path, std::vector<PackEntry>& index, std::vector<const char*>& blobs, std::string& names)
+{
+    std::vector<int> order(index.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        order[i] = (int)i;
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return index[a].path_hash < index[b].path_hash; });
+
+    std::fstream pack;
+    pack.open(path + ".tmp", std::ios::out | std::ios::binary);
+    if (!pack.good())
+    {
+        printf("Cannot write %s\n", path.c_str());
+        return false;
+    }
+
+    char zeros[pack_align] = { 0 };
+    Uint64 offset = pack_header;
+    pack.write(zeros, pack_header);
+
+    for (size_t i = 0; i < index.size(); i++)
+    {
+        Uint64 padding = (pack_align - offset % pack_align) % pack_align;
+        pack.write(zeros, padding);
+        offset += padding;
+
+        index[i].offset = offset;
+        pack.write(blobs[i], index[i].size);
+        offset += index[i].size;
+    }
+
+    Uint64 padding = (8 - offset % 8) % 8;
+    pack.write(zeros, padding);
+    offset += padding;
+
+    for (int i : order)
+    {
+        pack.write((const char*)&index[i], sizeof(PackEntry));
+    }
+    pack.write(names.c_str(), names.length());
+
+    Uint32 header[4] = { 0, pack_version, (Uint32)index.size(), (Uint32)names.length() };
+    SDL_memcpy(header, "RPGP", 4);
+    pack.seekp(0);
+    pack.write((const char*)header, 16);
+    pack.write((const char*)&offset, 8);
+    pack.close();
+
+    return pack.good();
+}
+
+bool replaceFile(std::string from, std::string to)
+{
+    std::error_code error;
+    std::filesystem::rename(from, to, error);
+    if (error)
+    {
+        printf("Cannot replace %s: %s\n", to.c_str(), error.message().c_str());
+        return false;
+    }
+    return true;
+}
+
+bool buildPack(std::string directory, std::string path)
+{
+    namespace fs = std::filesystem;
+
+    std::vector<std::string> files = listAssets(directory, { ".png", ".txt", ".ttf", ".otf", ".wav", ".ogg", ".mp3", ".flac", ".opus", ".lsc" });
+    std::error_code error;
+
+    AssetPack old;
+    old.open(path);
+
+    std::vector<PackEntry> index(files.size());
+    std::vector<std::string> contents(files.size());
+    std::vector<const char*> blobs(files.size(), NULL);
+    std::string names;
+    int changed = 0, touched = 0;
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        PackEntry& entry = index[i];
+        fs::path source(files[i]);
+
+        entry.path_hash = hashBytes(files[i].c_str(), files[i].length());
+        entry.size = fs::file_size(source, error);
+        entry.stamp = (Uint64)fs::last_write_time(source, error).time_since_epoch().count();
+        entry.name_offset = (Uint32)names.length();
+        entry.name_length = (Uint32)files[i].length();
+        names += files[i];
+
+        const PackEntry* previous = old.find(files[i]);
+
+        if (previous != NULL && previous->size == entry.size && previous->stamp == entry.stamp)
+        {
+            entry.content_hash = previous->content_hash;
+            blobs[i] = (const char*)old.data(previous);
+            continue;
+        }
+
+        if (!readAsset(files[i], contents[i]))
+        {
+            printf("Cannot read %s\n", files[i].c_str());
+            return false;
+        }
+
+        entry.size = contents[i].length();
+        entry.content_hash = hashBytes(contents[i].c_str(), contents[i].length());
+        blobs[i] = contents[i].c_str();
+
+        if (previous != NULL && previous->size == entry.size && previous->content_hash == entry.content_hash)
+        {
+            touched++;
+        }
+        else
+        {
+            changed++;
+        }
+    }
+
+    if (changed == 0 && touched == 0 && old.count() == (int)files.size())
+    {
+        printf("Asset pack %s is up to date (%d files)\n", path.c_str(), (int)files.size());
+        return true;
+    }
+
+    bool written = writePack(path, index, blobs, names);
+    old.close();
+
+    if (!written || !replaceFile(path + ".tmp", path))
+    {
+        return false;
+    }
+
+    printf("Asset pack %s: %d files, %d repacked\n", path.c_str(), (int)files.size(), changed);
+    return true;
+}
+
+Uint64 assetStamp(std::string path)
+{
+    const PackEntry* entry = gPack.find(path);
+
+    if (entry != NULL)
+    {
+        return entry->content_hash;
+    }
+
+    std::error_code error;
+    Uint64 stamp[2];
+    stamp[0] = std::filesystem::file_size(path, error);
+    if (error)
+    {
+        return 0;
+    }
+    stamp[1] = (Uint64)std::filesystem::last_write_time(path, error).time_since_epoch().count();
+
+    return hashBytes(stamp, sizeof(stamp));
+}
+
+TextureCache::TextureCache()
+{
+    usable = false;
+    hits = misses = 0;
+}
+
+bool TextureCache::open(std::string path)
+{
+    usable = false;
+
+    if (!cooked.open(path) || cooked.count() == 0)
+    {
+        return false;
+    }
+
+    SDL_RendererInfo info;
+    if (SDL_GetRendererInfo(gRenderer, &info) == 0)
+    {
+        for (Uint32 i = 0; i < info.num_texture_formats; i++)
+        {
+            if (info.texture_formats[i] == cooked_format)
+            {
+                usable = true;
+            }
+        }
+    }
+
+    if (!usable)
+    {
+        printf("Renderer cannot use cooked textures, decoding PNG files instead\n");
+        cooked.close();
+    }
+
+    return usable;
+}
+
+SDL_Texture* TextureCache::load(std::string path, int& w, int& h)
+{
+    //the rasteriser keeps a CPU copy of every texture, which only the decoded surface gives it
+    if (!usable || gRaster != NULL)
+    {
+        return NULL;
+    }
+
+    const PackEntry* entry = cooked.find(path);
+
+    if (entry == NULL || entry->content_hash != assetStamp(path))
+    {
+        misses++;
+        return NULL;
+    }
+
+    const CookedTexture* header = (const CookedTexture*)cooked.data(entry);
+
+    SDL_Texture* texture = SDL_CreateTexture(gRenderer, header->format, SDL_TEXTUREACCESS_STATIC, header->width, header->height);
+
+    if (texture == NULL)
+    {
+        misses++;
+        return NULL;
+    }
+
+    SDL_UpdateTexture(texture, NULL, header + 1, header->pitch);
+
+    if (header->blend)
+    {
+        SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+    }
+
+    w = header->width;
+    h = header->height;
+    hits++;
+
+    return texture;
+}
+
+void TextureCache::close()
+{
+    if (usable)
+    {
+        printf("Cooked textures: %d loaded, %d stale or missing\n", hits, misses);
+    }
+    cooked.close();
+    usable = false;
+}
+
+bool TextureCache::cook(std::string directory, std::string path)
+{
+    std::vector<std::string> files = listAssets(directory, { ".png" });
+
+    AssetPack old;
+    old.open(path);
+
+    std::vector<PackEntry> index;
+    std::vector<std::string> contents;
+    std::vector<std::string> sources;
+    std::string names;
+    int changed = 0;
+
+    contents.reserve(files.size());
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        PackEntry entry;
+        entry.path_hash = hashBytes(files[i].c_str(), files[i].length());
+        entry.content_hash = assetStamp(files[i]);
+        entry.stamp = 0;
+        entry.name_offset = (Uint32)names.length();
+        entry.name_length = (Uint32)files[i].length();
+
+        const PackEntry* previous = old.find(files[i]);
+
+        if (previous != NULL && previous->content_hash == entry.content_hash)
+        {
+            entry.size = previous->size;
+            contents.push_back(std::string((const char*)old.data(previous), (size_t)previous->size));
+        }
+        else
+        {
+            SDL_Surface* loaded = IMG_Load_RW(openAsset(files[i]), 1);
+            if (loaded == NULL)
+            {
+                printf("Unable to cook %s! SDL_image Error: %s\n", files[i].c_str(), IMG_GetError());
+                continue;
+            }
+
+            SDL_Surface* converted = SDL_ConvertSurfaceFormat(loaded, cooked_format, 0);
+            if (converted == NULL)
+            {
+                printf("Unable to convert %s! SDL Error: %s\n", files[i].c_str(), SDL_GetError());
+                SDL_FreeSurface(loaded);
+                continue;
+            }
+
+            CookedTexture header;
+            SDL_memset(&header, 0, sizeof(header));
+            header.format = cooked_format;
+            header.width = converted->w;
+            header.height = converted->h;
+            header.pitch = converted->w * 4;
+            header.blend = loaded->format->Amask != 0 || SDL_HasColorKey(loaded);
+
+            std::string blob((const char*)&header, sizeof(header));
+            SDL_LockSurface(converted);
+            for (int y = 0; y < converted->h; y++)
+            {
+                blob.append((const char*)converted->pixels + y * converted->pitch, header.pitch);
+            }
+            SDL_UnlockSurface(converted);
+
+            SDL_FreeSurface(converted);
+            SDL_FreeSurface(loaded);
+
+            entry.size = blob.length();
+            contents.push_back(blob);
+            changed++;
+        }
+
+        names += files[i];
+        index.push_back(entry);
+    }
+
+    if (changed == 0 && old.count() == (int)index.size())
+    {
+        printf("Cooked textures %s are up to date (%d files)\n", path.c_str(), (int)index.size());
+        return true;
+    }
+
+    std::vector<const char*> blobs;
+    for (size_t i = 0; i < contents.size(); i++)
+    {
+        blobs.push_back(contents[i].c_str());
+    }
+
+    bool written = writePack(path, index, blobs, names);
+    old.close();
+
+    if (!written || !replaceFile(path + ".tmp", path))
+    {
+        return false;
+    }
+
+    printf("Cooked textures %s: %d files, %d cooked\n", path.c_str(), (int)index.size(), changed);
+    return true;
+}
+
+bool init()
+{
+    bool success = true;
+
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0)
+    {
+        printf("SDL could not initialize! SDL_ERROR: %s\n", SDL_GetError());
+    }
+    else
+    {
+
+        if (!SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1"))
+        {
+            printf("Warning: Linear texture filtering not enabled!");
+        }
+
+        Uint32 windowFlags = SDL_WINDOW_SHOWN;
+        Uint32 rendererFlags = SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC;
+
+        if (gReplay.playing && gReplay.headless)
+        {
+            windowFlags = SDL_WINDOW_HIDDEN;
+            rendererFlags = SDL_RENDERER_ACCELERATED;
+        }
+
+        gWindow = SDL_CreateWindow("SIMPLE RPG", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, screen_width, screen_height, windowFlags);
+        if (gWindow == NULL)
+        {
+            printf("Window could not be created SDL_ERROR: %s\n", SDL_GetError());
+            success = false;
+        }
+        else
+        {
+            gRenderer = SDL_CreateRenderer(gWindow, -1, rendererFlags);
+            if (gRenderer == NULL)
+            {
+                printf("Renderer could not be created! SDL Error: %s\n", SDL_GetError());
+                success = false;
+            }
+            else
+            {
+                SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
+                int imgFlags = IMG_INIT_PNG;
+                if ((!IMG_Init(imgFlags) & imgFlags))
+                {
+                    printf("SDL_image could not initialize! SDL_image Error: %s\n", IMG_GetError());
+                    success = false;
+                }
+
+                if (TTF_Init() == -1)
+                {
+                    printf("SDL_ttf could not initialize! SDL_ttf Error: %s\n", TTF_GetError());
+                    success = false;
+                }
+
+                if (!gAudio.open())
+                {
+                    printf("SDL_mixer could not initialize! SDL_mixer Error: %s\n", Mix_GetError());
+                    success = false;
+                }
+
+            }
+
+        }
+
+    }
+
+    return success;
+}
+
+int loadMedia(Tilemap* t)
+{
+    int success = 1;
+
+    gPack.open("Assets.pack");
+
+    //cooked textures need the renderer to check their pixel format, so the cache opens here rather than with the options
+    gTextureCache.open("Assets.cook");
+
+    gFont = TTF_OpenFontRW(openAsset("Assets/Fonts/DroidSansMono.ttf"), 1, 28);
+
+    if (gFont == NULL)
+    {
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search font file. Please reinstall game :)", NULL);
+        printf("Failed to load lazy font! SDL_ttf Error: %s\n", TTF_GetError());
+        success = 0;
+    }
+
+    if (t->load() == false)
+    {
+        success = 0;
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search tilemap file. Please reinstall game :)", NULL);
+        printf("Failed to load tilemap\n");
+    }
+
+    return success;
+}
+
+void close(Tilemap* t, Player* p, Levels* l)
+{
+    gCapture.stop();
+
+    //the preload thread may still be reading from the pack
+    if (l != NULL)
+        l->wait();
+
+    t->free();
+    p->~Player();
+
+    for (int i = 0; i < MEMORY_TAGS + 2; i++)
+    {
+        hud_lines[i].free();
+    }
+
+    TTF_CloseFont(gFont);
+    gFont = NULL;
+
+    gTextureCache.close();
+    gPack.close();
+
+    SDL_DestroyRenderer(gRenderer);
+    SDL_DestroyWindow(gWindow);
+    gWindow = NULL;
+    gRenderer = NULL;
+
+    gReplay.close();
+
+    gAudio.close();
+
+    gPerf.report();
+
+    printf("Memory: Tilemap object %d KB\n", (int)(sizeof(Tilemap) / 1024));
+    gMemory.report();
+
+    TTF_Quit();
+    IMG_Quit();
+    SDL_Quit();
+}
+
+Replay::Replay()
+{
+    recording = false;
+    playing = false;
+    headless = false;
+    now = 0;
+    for (int i = 0; i < SDL_NUM_SCANCODES; i++)
+    {
+        keys[i] = 0;
+    }
+}
+
+bool Replay::record(std::string path)
+{
+    file.open(path, std::ios::out | std::ios::binary);
+    if (!file.good())
+    {
+        return false;
+    }
+
+    file.write("RPGR", 4);
+
+    for (int i = 0; i < 3; i++)
+    {
+        std::fstream plik;
+        plik.open("Assets/Saves/" + std::to_string(i + 1) + ".txt", std::ios::in | std::ios::binary);
+        std::stringstream content;
+        if (plik.good())
+        {
+            content << plik.rdbuf();
+        }
+        saves[i] = content.str();
+        put(saves[i].length());
+        file.write(saves[i].c_str(), saves[i].length());
+    }
+
+    recording = true;
+    return true;
+}
+
+bool Replay::play(std::string path)
+{
+    file.open(path, std::ios::in | std::ios::binary);
+    char magic[4];
+    if (!file.good() || !file.read(magic, 4) || std::string(magic, 4) != "RPGR")
+    {
+        file.close();
+        return false;
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        Uint32 length = 0;
+        get(length);
+        saves[i].resize(length);
+        if (length > 0)
+        {
+            file.read(&saves[i][0], length);
+        }
+    }
+
+    playing = true;
+    return true;
+}
+
+void Replay::put(Uint32 value)
+{
+    while (value >= 0x80)
+    {
+        file.put((char)(value | 0x80));
+        value >>= 7;
+    }
+    file.put((char)value);
+}
+
+bool Replay::get(Uint32& value)
+{
+    value = 0;
+    int shift = 0;
+    char c;
+    while (file.get(c))
+    {
+        value |= (Uint32)(c & 0x7F) << shift;
+        if ((c & 0x80) == 0)
+        {
+            return true;
+        }
+        shift += 7;
+    }
+    return false;
+}
+
+void Replay::track(SDL_Event* e)
+{
+    switch (e->type)
+    {
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:
+        if (e->key.keysym.scancode >= 0 && e->key.keysym.scancode < SDL_NUM_SCANCODES)
+        {
+            keys[e->key.keysym.scancode] = e->type == SDL_KEYDOWN;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+int Replay::poll(SDL_Event* e)
+{
+    //record: [tick delta][kind][payload], kind 0 marks an empty poll so frame boundaries replay too
+    if (playing)
+    {
+        Uint32 delta, kind, a = 0, b = 0, c = 0;
+        SDL_memset(e, 0, sizeof(SDL_Event));
+
+        if (!get(delta) || !get(kind))
+        {
+            e->type = SDL_QUIT;
+            return 1;
+        }
+
+        now += delta;
+
+        switch (kind)
+        {
+        case 0:
+            SDL_PumpEvents();
+            SDL_FlushEvents(SDL_FIRSTEVENT, SDL_LASTEVENT);
+            return 0;
+        case 1:
+            e->type = SDL_QUIT;
+            break;
+        case 2:
+        case 3:
+            get(a);
+            get(b);
+            get(c);
+            e->type = kind == 2 ? SDL_KEYDOWN : SDL_KEYUP;
+            e->key.state = kind == 2 ? SDL_PRESSED : SDL_RELEASED;
+            e->key.keysym.scancode = (SDL_Scancode)a;
+            e->key.keysym.sym = (SDL_Keycode)b;
+            e->key.repeat = (Uint8)c;
+            break;
+        case 4:
+            get(a);
+            e->type = SDL_TEXTINPUT;
+            file.read(e->text.text, a < 31 ? a : 31);
+            break;
+        case 5:
+            get(a);
+            get(b);
+            e->type = SDL_MOUSEMOTION;
+            e->motion.x = (Sint32)a;
+            e->motion.y = (Sint32)b;
+            break;
+        case 6:
+        case 7:
+            get(a);
+            get(b);
+            get(c);
+            e->type = kind == 6 ? SDL_MOUSEBUTTONDOWN : SDL_MOUSEBUTTONUP;
+            e->button.x = (Sint32)a;
+            e->button.y = (Sint32)b;
+            e->button.button = (Uint8)c;
+            break;
+        default:
+            get(a);
+            e->type = a;
+            break;
+        }
+
+        track(e);
+        return 1;
+    }
+
+    int result = SDL_PollEvent(e);
+
+    if (recording)
+    {
+        Uint32 t = SDL_GetTicks();
+        put(t - now);
+        now = t;
+
+        if (result == 0)
+        {
+            put(0);
+        }
+        else
+        {
+            switch (e->type)
+            {
+            case SDL_QUIT:
+                put(1);
+                break;
+            case SDL_KEYDOWN:
+            case SDL_KEYUP:
+                put(e->type == SDL_KEYDOWN ? 2 : 3);
+                put(e->key.keysym.scancode);
+                put(e->key.keysym.sym);
+                put(e->key.repeat);
+                break;
+            case SDL_TEXTINPUT:
+            {
+                Uint32 length = SDL_strlen(e->text.text);
+                put(4);
+                put(length);
+                file.write(e->text.text, length);
+                break;
+            }
+            case SDL_MOUSEMOTION:
+                put(5);
+                put(e->motion.x);
+                put(e->motion.y);
+                break;
+            case SDL_MOUSEBUTTONDOWN:
+            case SDL_MOUSEBUTTONUP:
+                put(e->type == SDL_MOUSEBUTTONDOWN ? 6 : 7);
+                put(e->button.x);
+                put(e->button.y);
+                put(e->button.button);
+                break;
+            default:
+                put(8);
+                put(e->type);
+                break;
+            }
+            track(e);
+        }
+    }
+
+    return result;
+}
+
+void Replay::wait(int timeout)
+{
+    if (!playing)
+    {
+        SDL_WaitEventTimeout(NULL, timeout);
+    }
+}
+
+Uint32 Replay::ticks()
+{
+    if (recording || playing)
+    {
+        return now;
+    }
+    return SDL_GetTicks();
+}
+
+const Uint8* Replay::keyboard()
+{
+    if (recording || playing)
+    {
+        return keys;
+    }
+    return SDL_GetKeyboardState(NULL);
+}
+
+bool Replay::read_save(std::string number, std::string& content)
+{
+    if (playing)
+    {
+        int slot = atoi(number.c_str()) - 1;
+        if (slot < 0 || slot > 2)
+        {
+            return false;
+        }
+        content = saves[slot];
+        return true;
+    }
+
+    std::fstream plik;
+    plik.open("Assets/Saves/" + number + ".txt", std::ios::in);
+    if (!plik.good())
+    {
+        return false;
+    }
+    std::stringstream data;
+    data << plik.rdbuf();
+    content = data.str();
+    return true;
+}
+
+void Replay::close()
+{
+    if (file.is_open())
+    {
+        file.close();
+    }
+    recording = false;
+    playing = false;
+}
+
+Texture::Texture()
+{
+    mTexture = NULL;
+    mWidth = 0;
+    mHeight = 0;
+    mBytes = 0;
+    mTag = MEMORY_OTHER;
+}
+
+void Texture::track()
+{
+    if (mTexture != NULL)
+    {
+        mBytes = mWidth * mHeight * 4;
+        mTag = Memory::tag();
+        gMemory.addTexture(mTag, mBytes);
+    }
+}
+Texture::~Texture()
+{
+    free();
+}
+
+bool Texture::loadFromFile(std::string path)
+{
+    free();
+
+    mTexture = gTextureCache.load(path, mWidth, mHeight);
+
+    if (mTexture != NULL)
+    {
+        track();
+        return true;
+    }
+
+    SDL_Surface* loadedSurface = IMG_Load_RW(openAsset(path), 1);
+
+    if (loadedSurface == NULL)
+    {
+        printf("Unable to load image %s! SDL_image Error: %s\n", path.c_str(), IMG_GetError());
+
+    }
+    else
+    {
+        if (!loadFromSurface(loadedSurface))
+        {
+            printf("Unable to create texture %s! SDL Error: %s\n", path.c_str(), SDL_GetError());
+        }
+        SDL_FreeSurface(loadedSurface);
+    }
+
+    return mTexture != NULL;
+}
+bool Texture::loadFromSurface(SDL_Surface* surface)
+{
+    free();
+
+    mTexture = SDL_CreateTextureFromSurface(gRenderer, surface);
+
+    if (mTexture != NULL)
+    {
+        mWidth = surface->w;
+        mHeight = surface->h;
+        track();
+
+        if (gRaster != NULL)
+            gRaster->keep(mTexture, surface);
+    }
+
+    return mTexture != NULL;
+}
+bool Texture::loadFromRenderedText(const std::string& textureText, SDL_Color textColor)
+{
+    return loadFromRenderedText(textureText.c_str(), textColor);
+}
+
+bool Texture::loadFromRenderedText(const char* textureText, SDL_Color textColor)
+{
+    free();
+
+    SDL_Surface* textSurface = TTF_RenderText_Solid(gFont, textureText, textColor);
+
+    if (textSurface == NULL)
+    {
+        printf("Unable to render text surface! SDL_ttf Error: %s\n", TTF_GetError());
+
+    }
+    else
+    {
+        mTexture = SDL_CreateTextureFromSurface(gRenderer, textSurface);
+
+        if (mTexture == NULL)
+        {
+            printf("Unable to create texture from rendered text! SDL Error: %s\n", SDL_GetError());
+        }
+        else
+        {
+            mWidth = textSurface->w;
+            mHeight = textSurface->h;
+            track();
+
+            if (gRaster != NULL)
+                gRaster->keep(mTexture, textSurface);
+        }
+        SDL_FreeSurface(textSurface);
+    }
+
+    return mTexture != NULL;
+}
+void Texture::SetColor(Uint8 red, Uint8 green, Uint8 blue)
+{
+    SDL_SetTextureColorMod(mTexture, red, green, blue);
+}
+void Texture::setBlendMode(SDL_BlendMode blending)
+{
+    SDL_SetTextureBlendMode(mTexture, blending);
+}
+void Texture::setAlpha(Uint8 alpha)
+{
+    SDL_SetTextureAlphaMod(mTexture, alpha);
+}
+void Texture::free()
+{
+    if (mTexture != NULL)
+    {
+        if (gRaster != NULL)
+            gRaster->forget(mTexture);
+        SDL_DestroyTexture(mTexture);
+        gMemory.removeTexture(mTag, mBytes);
+        mTexture = NULL;
+        mWidth = 0;
+        mHeight = 0;
+        mBytes = 0;
+    }
+}
+void Texture::render(int x, int y, SDL_Rect* clip)
+{
+    SDL_Rect renderQuad = { x,y,mWidth,mHeight };
+
+    if (clip != NULL)
+    {
+        renderQuad.w = clip->w;
+        renderQuad.h = clip->h;
+    }
+
+    DrawList* list = DrawList::recording();
+    if (list != NULL)
+    {
+        list->copy(mTexture, clip, &renderQuad);
+        return;
+    }
+
+    SDL_RenderCopy(gRenderer, mTexture, clip, &renderQuad);
+}
+static thread_local DrawList* recording_list = NULL;
+
+DrawList::DrawList()
+{
+    commands.reserve(4096);
+    strings.reserve(4096);
+    input = 0;
+}
+
+void DrawList::reset()
+{
+    commands.clear();
+    strings.clear();
+    input = 0;
+}
+
+DrawList* DrawList::recording()
+{
+    return recording_list;
+}
+
+//while a list is recording on this thread, Texture::render appends to it instead of drawing
+void DrawList::record(DrawList* list)
+{
+    recording_list = list;
+}
+
+void DrawList::clear(Uint8 r, Uint8 g, Uint8 b, Uint8 a)
+{
+    DrawCommand command;
+    SDL_memset(&command, 0, sizeof(command));
+    command.type = DRAW_CLEAR;
+    command.color.r = r;
+    command.color.g = g;
+    command.color.b = b;
+    command.color.a = a;
+    commands.push_back(command);
+}
+
+void DrawList::copy(SDL_Texture* texture, SDL_Rect* src, SDL_Rect* dst)
+{
+    DrawCommand command;
+    SDL_memset(&command, 0, sizeof(command));
+    command.type = DRAW_COPY;
+    command.texture = texture;
+    command.clipped = src != NULL;
+    if (src != NULL)
+        command.src = *src;
+    command.dst = *dst;
+    commands.push_back(command);
+}
+
+//the light map's pixels stay in its own double buffer, the command only names which half
+void DrawList::light(LightMap* map, int buffer)
+{
+    DrawCommand command;
+    SDL_memset(&command, 0, sizeof(command));
+    command.type = DRAW_LIGHT;
+    command.light = map;
+    command.text = buffer;
+    commands.push_back(command);
+}
+
+void DrawList::text(const char* text, int x, int y)
+{
+    DrawCommand command;
+    SDL_memset(&command, 0, sizeof(command));
+    command.type = DRAW_TEXT;
+    command.dst.x = x;
+    command.dst.y = y;
+    command.color = white;
+    command.text = (int)strings.size();
+    strings.insert(strings.end(), text, text + SDL_strlen(text) + 1);
+    commands.push_back(command);
+}
+
+void DrawList::execute()
+{
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        DrawCommand& command = commands[i];
+
+        if (command.type == DRAW_CLEAR)
+        {
+            SDL_SetRenderDrawColor(gRenderer, command.color.r, command.color.g, command.color.b, command.color.a);
+            SDL_RenderClear(gRenderer);
+        }
+        else if (command.type == DRAW_COPY)
+        {
+            SDL_RenderCopy(gRenderer, command.texture, command.clipped ? &command.src : NULL, &command.dst);
+        }
+        else if (command.type == DRAW_TEXT)
+        {
+            scratch.loadFromRenderedText(&strings[command.text], command.color);
+            scratch.render(command.dst.x, command.dst.y);
+        }
+        else if (command.type == DRAW_LIGHT)
+        {
+            command.light->upload(command.text);
+        }
+    }
+}
+
+SoftRaster::SoftRaster(int width, int height, int threads)
+{
+    this->width = width;
+    this->height = height;
+    pixels = new Uint32[width * height];
+    SDL_memset(pixels, 0, width * height * sizeof(Uint32));
+    done = SDL_CreateSemaphore(0);
+    quit = false;
+    ops.reserve(4096);
+
+    if (threads < 1)
+        threads = 1;
+    strips.resize(threads);
+
+    for (int i = 0; i < threads; i++)
+    {
+        RasterStrip& strip = strips[i];
+        strip.raster = this;
+        strip.top = i * height / threads;
+        strip.bottom = (i + 1) * height / threads;
+        strip.row.resize(width);
+        strip.go = SDL_CreateSemaphore(0);
+        strip.thread = threads > 1 ? SDL_CreateThread(worker, "raster", &strip) : NULL;
+    }
+}
+
+SoftRaster::~SoftRaster()
+{
+    quit = true;
+    for (RasterStrip& strip : strips)
+    {
+        if (strip.thread != NULL)
+        {
+            SDL_SemPost(strip.go);
+            SDL_WaitThread(strip.thread, NULL);
+        }
+        SDL_DestroySemaphore(strip.go);
+    }
+    SDL_DestroySemaphore(done);
+
+    for (auto& image : images)
+        SDL_FreeSurface(image.second);
+    for (SDL_Surface* text : texts)
+        SDL_FreeSurface(text);
+
+    delete[] pixels;
+}
+
+//textures cannot be read back, so every one created while rasterising keeps an ARGB copy of its pixels here
+void SoftRaster::keep(SDL_Texture* texture, SDL_Surface* surface)
+{
+    forget(texture);
+
+    SDL_Surface* copy = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ARGB8888, 0);
+    if (copy != NULL)
+        images[texture] = copy;
+}
+
+void SoftRaster::forget(SDL_Texture* texture)
+{
+    auto found = images.find(texture);
+    if (found != images.end())
+    {
+        SDL_FreeSurface(found->second);
+        images.erase(found);
+    }
+}
+
+void SoftRaster::draw(DrawList* list)
+{
+    for (SDL_Surface* text : texts)
+        SDL_FreeSurface(text);
+    texts.clear();
+    ops.clear();
+
+    //everything that touches SDL is resolved here, the strips only read plain pixels
+    for (size_t i = 0; i < list->commands.size(); i++)
+    {
+        DrawCommand& command = list->commands[i];
+
+        RasterOp op;
+        SDL_memset(&op, 0, sizeof(op));
+        op.type = command.type;
+        op.blend = SDL_BLENDMODE_BLEND;
+        op.alpha = op.r = op.g = op.b = 0xFF;
+
+        if (command.type == DRAW_CLEAR)
+        {
+            op.r = command.color.r;
+            op.g = command.color.g;
+            op.b = command.color.b;
+        }
+        else if (command.type == DRAW_COPY)
+        {
+            auto found = images.find(command.texture);
+            if (found == images.end())
+                continue;
+
+            SDL_Surface* image = found->second;
+            SDL_Rect bounds = { 0, 0, image->w, image->h };
+            op.src = command.clipped ? command.src : bounds;
+            op.dst = command.dst;
+
+            SDL_Rect inside;
+            if (!SDL_IntersectRect(&op.src, &bounds, &inside))
+                continue;
+            if (op.src.w == op.dst.w && op.src.h == op.dst.h)
+            {
+                op.dst.x += inside.x - op.src.x;
+                op.dst.y += inside.y - op.src.y;
+                op.dst.w = inside.w;
+                op.dst.h = inside.h;
+            }
+            op.src = inside;
+
+            op.pixels = (const Uint32*)image->pixels;
+            op.pitch = image->pitch / 4;
+            SDL_GetTextureBlendMode(command.texture, &op.blend);
+            SDL_GetTextureAlphaMod(command.texture, &op.alpha);
+            SDL_GetTextureColorMod(command.texture, &op.r, &op.g, &op.b);
+        }
+        else if (command.type == DRAW_TEXT)
+        {
+            SDL_Surface* rendered = TTF_RenderText_Solid(gFont, &list->strings[command.text], command.color);
+            if (rendered == NULL)
+                continue;
+            SDL_Surface* text = SDL_ConvertSurfaceFormat(rendered, SDL_PIXELFORMAT_ARGB8888, 0);
+            SDL_FreeSurface(rendered);
+            if (text == NULL)
+                continue;
+            texts.push_back(text);
+
+            op.type = DRAW_COPY;
+            op.pixels = (const Uint32*)text->pixels;
+            op.pitch = text->pitch / 4;
+            op.src = { 0, 0, text->w, text->h };
+            op.dst = { command.dst.x, command.dst.y, text->w, text->h };
+        }
+        else if (command.type == DRAW_LIGHT)
+        {
+            op.type = DRAW_COPY;
+            op.pixels = command.light->buffer(command.text);
+            op.pitch = light_columns;
+            op.src = { 0, 0, light_columns, light_rows };
+            op.dst = { 0, 0, width, height };
+            op.blend = SDL_BLENDMODE_MOD;
+        }
+
+        ops.push_back(op);
+    }
+
+    if (strips.size() == 1)
+    {
+        strip(strips[0]);
+        return;
+    }
+
+    for (RasterStrip& strip : strips)
+        SDL_SemPost(strip.go);
+    for (size_t i = 0; i < strips.size(); i++)
+        SDL_SemWait(done);
+}
+
+int SoftRaster::worker(void* data)
+{
+    RasterStrip* strip = (RasterStrip*)data;
+    SoftRaster* raster = strip->raster;
+
+    for (;;)
+    {
+        SDL_SemWait(strip->go);
+        if (raster->quit)
+            break;
+        raster->strip(*strip);
+        SDL_SemPost(raster->done);
+    }
+    return 0;
+}
+
+//x / 255 rounded to nearest, exact for every x up to 65535
+static inline Uint32 div255(Uint32 x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static inline Uint32 blendPixel(Uint32 s, Uint32 d)
+{
+    Uint32 a = s >> 24;
+    Uint32 out = 0xFF000000;
+    for (int shift = 0; shift < 24; shift += 8)
+        out |= div255(((s >> shift) & 0xFF) * a + ((d >> shift) & 0xFF) * (255 - a)) << shift;
+    return out;
+}
+
+//the common case, straight alpha over an opaque framebuffer, four pixels per step with the same rounding as blendPixel
+static void blendRow(Uint32* dst, const Uint32* src, int count)
+{
+    int i = 0;
+#ifdef SIMD_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i bias = _mm_set1_epi16(128);
+    const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+
+        __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+        __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+        __m128i d_lo = _mm_unpacklo_epi8(d, zero);
+        __m128i d_hi = _mm_unpackhi_epi8(d, zero);
+
+        __m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, 0xFF), 0xFF);
+        __m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, 0xFF), 0xFF);
+
+        __m128i x_lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s_lo, a_lo), _mm_mullo_epi16(d_lo, _mm_sub_epi16(full, a_lo))), bias);
+        __m128i x_hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s_hi, a_hi), _mm_mullo_epi16(d_hi, _mm_sub_epi16(full, a_hi))), bias);
+        x_lo = _mm_srli_epi16(_mm_add_epi16(x_lo, _mm_srli_epi16(x_lo, 8)), 8);
+        x_hi = _mm_srli_epi16(_mm_add_epi16(x_hi, _mm_srli_epi16(x_hi, 8)), 8);
+
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_packus_epi16(x_lo, x_hi), opaque));
+    }
+#endif
+    for (; i < count; i++)
+        dst[i] = blendPixel(src[i], dst[i]);
+}
+
+//--blend-check: div255 against exact rounding for every input, and blendRow against blendPixel for every alpha, source and destination value
+bool checkBlend()
+{
+    int wrong = 0;
+    for (Uint32 x = 0; x <= 65535; x++)
+    {
+        if (div255(x) != (x + 127) / 255)
+            wrong++;
+    }
+    printf("Blend check: div255 %s\n", wrong == 0 ? "exact" : "wrong");
+
+    //odd length so the scalar tail runs after the four wide steps
+    Uint32 src[257], dst[257];
+    int differ = 0;
+    for (Uint32 a = 0; a < 256; a++)
+    {
+        for (Uint32 s = 0; s < 256; s++)
+        {
+            for (Uint32 d = 0; d < 257; d++)
+            {
+                Uint32 under = d & 0xFF;
+                src[d] = (a << 24) | (s << 16) | ((255 - s) << 8) | (s ^ 0x5A);
+                dst[d] = 0xFF000000 | (under << 16) | ((under ^ 0xA5) << 8) | (255 - under);
+            }
+
+            Uint32 expected[257];
+            for (int i = 0; i < 257; i++)
+                expected[i] = blendPixel(src[i], dst[i]);
+
+            blendRow(dst, src, 257);
+            for (int i = 0; i < 257; i++)
+            {
+                if (dst[i] != expected[i])
+                    differ++;
+            }
+        }
+    }
+#ifdef SIMD_SSE2
+    const char* path = "SSE2";
+#else
+    const char* path = "scalar";
+#endif
+    printf("Blend check: blendRow %s, %d pixels differ from blendPixel\n", path, differ);
+
+    return wrong == 0 && differ == 0;
+}
+
+//colour and alpha modulation and the other blend modes, rare enough to stay scalar
+static void mixRow(Uint32* dst, const Uint32* src, int count, RasterOp& op)
+{
+    for (int i = 0; i < count; i++)
+    {
+        Uint32 s = src[i];
+        Uint32 d = dst[i];
+        Uint32 a = div255((s >> 24) * op.alpha);
+        Uint32 r = div255(((s >> 16) & 0xFF) * op.r);
+        Uint32 g = div255(((s >> 8) & 0xFF) * op.g);
+        Uint32 b = div255((s & 0xFF) * op.b);
+        Uint32 c[3] = { b, g, r };
+
+        Uint32 out = 0xFF000000;
+        for (int k = 0; k < 3; k++)
+        {
+            Uint32 under = (d >> (k * 8)) & 0xFF;
+            Uint32 v;
+            if (op.blend == SDL_BLENDMODE_NONE)
+                v = c[k];
+            else if (op.blend == SDL_BLENDMODE_ADD)
+                v = std::min(255u, under + div255(c[k] * a));
+            else if (op.blend == SDL_BLENDMODE_MOD)
+                v = div255(under * c[k]);
+            else
+                v = div255(c[k] * a + under * (255 - a));
+            out |= v << (k * 8);
+        }
+        dst[i] = out;
+    }
+}
+
+void SoftRaster::strip(RasterStrip& strip)
+{
+    for (RasterOp& op : ops)
+    {
+        if (op.type == DRAW_CLEAR)
+        {
+            Uint32 color = 0xFF000000 | (op.r << 16) | (op.g << 8) | op.b;
+            for (int i = strip.top * width; i < strip.bottom * width; i++)
+                pixels[i] = color;
+            continue;
+        }
+
+        int x0 = std::max(op.dst.x, 0);
+        int x1 = std::min(op.dst.x + op.dst.w, width);
+        int y0 = std::max(op.dst.y, strip.top);
+        int y1 = std::min(op.dst.y + op.dst.h, strip.bottom);
+        if (x0 >= x1 || y0 >= y1)
+            continue;
+
+        //scaled copies sample the nearest source pixel, so the output never depends on filtering
+        bool scaled = op.src.w != op.dst.w || op.src.h != op.dst.h;
+        bool plain = op.blend == SDL_BLENDMODE_BLEND && op.alpha == 0xFF && op.r == 0xFF && op.g == 0xFF && op.b == 0xFF;
+
+        for (int y = y0; y < y1; y++)
+        {
+            int sy = op.src.y + (scaled ? (y - op.dst.y) * op.src.h / op.dst.h : y - op.dst.y);
+            const Uint32* line = op.pixels + sy * op.pitch;
+            const Uint32* src;
+
+            if (scaled)
+            {
+                for (int x = x0; x < x1; x++)
+                    strip.row[x - x0] = line[op.src.x + (x - op.dst.x) * op.src.w / op.dst.w];
+                src = strip.row.data();
+            }
+            else
+            {
+                src = line + op.src.x + (x0 - op.dst.x);
+            }
+
+            Uint32* dst = pixels + y * width + x0;
+            if (plain)
+                blendRow(dst, src, x1 - x0);
+            else
+                mixRow(dst, src, x1 - x0, op);
+        }
+    }
+}
+
+Capture::Capture()
+{
+    directory = "Captures";
+    workers = 4;
+    buffers = 6;
+    recording = pending = false;
+    taken = dropped = written = 0;
+    readback_us = encode_us = 0;
+    lock = NULL;
+    changed = NULL;
+    quit = started = false;
+    session = shots = sequence = 0;
+}
+
+void Capture::screenshot()
+{
+    pending = true;
+}
+
+void Capture::toggle()
+{
+    recording = !recording;
+    printf(recording ? "Recording frames to %s\n" : "Stopped recording frames to %s\n", directory.c_str());
+}
+
+//threads and buffers only exist once something is captured, so a session that never presses F11/F12 pays nothing
+bool Capture::start()
+{
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+
+    lock = SDL_CreateMutex();
+    changed = SDL_CreateCond();
+    session = (Uint32)time(NULL);
+
+    frames.resize(buffers);
+    for (int i = 0; i < buffers; i++)
+    {
+        frames[i].pixels.resize(screen_width * screen_height);
+        idle.push_back(i);
+    }
+    queued.reserve(buffers);
+
+    for (int i = 0; i < workers; i++)
+    {
+        SDL_Thread* thread = SDL_CreateThread(worker, "capture", this);
+        if (thread != NULL)
+            threads.push_back(thread);
+    }
+
+    started = !threads.empty();
+    if (!started)
+        printf("Cannot start capture workers! SDL Error: %s\n", SDL_GetError());
+    return started;
+}
+
+//called by present() right before the flip, the copy is the only part that waits for the GPU
+void Capture::grab()
+{
+    if (!pending && !recording)
+        return;
+
+    if (!started && !start())
+    {
+        pending = recording = false;
+        return;
+    }
+
+    int width, height;
+    SDL_GetRendererOutputSize(gRenderer, &width, &height);
+    if (width * height > screen_width * screen_height)
+    {
+        width = screen_width;
+        height = screen_height;
+    }
+
+    //every buffer still being encoded: drop this frame rather than stall the game or grow memory
+    SDL_LockMutex(lock);
+    int index = -1;
+    if (!idle.empty())
+    {
+        index = idle.back();
+        idle.pop_back();
+    }
+    SDL_UnlockMutex(lock);
+
+    if (index == -1)
+    {
+        dropped++;
+        return;
+    }
+
+    CaptureFrame& frame = frames[index];
+    Uint64 start = SDL_GetPerformanceCounter();
+    SDL_Rect area = { 0, 0, width, height };
+    SDL_RenderReadPixels(gRenderer, &area, SDL_PIXELFORMAT_ARGB8888, frame.pixels.data(), width * 4);
+    readback_us += (SDL_GetPerformanceCounter() - start) * 1000000 / SDL_GetPerformanceFrequency();
+
+    frame.width = width;
+    frame.height = height;
+    frame.png = pending;
+    frame.number = pending ? shots++ : sequence++;
+    pending = false;
+    taken++;
+
+    SDL_LockMutex(lock);
+    queued.push_back(index);
+    SDL_CondSignal(changed);
+    SDL_UnlockMutex(lock);
+}
+
+//https://qoiformat.org, three channels since the back buffer is opaque
+static void encodeQoi(const Uint32* pixels, int width, int height, std::vector<Uint8>& out)
+{
+    out.clear();
+    const char magic[4] = { 'q', 'o', 'i', 'f' };
+    out.insert(out.end(), magic, magic + 4);
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back((Uint8)(width >> shift));
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back((Uint8)(height >> shift));
+    out.push_back(3);
+    out.push_back(0);
+
+    Uint32 index[64];
+    SDL_memset(index, 0, sizeof(index));
+    int pr = 0, pg = 0, pb = 0;
+    int run = 0;
+    int count = width * height;
+
+    for (int i = 0; i < count; i++)
+    {
+        int r = (pixels[i] >> 16) & 0xFF;
+        int g = (pixels[i] >> 8) & 0xFF;
+        int b = pixels[i] & 0xFF;
+
+        if (r == pr && g == pg && b == pb)
+        {
+            run++;
+            if (run == 62 || i == count - 1)
+            {
+                out.push_back((Uint8)(0xC0 | (run - 1)));
+                run = 0;
+            }
+            continue;
+        }
+
+        if (run > 0)
+        {
+            out.push_back((Uint8)(0xC0 | (run - 1)));
+            run = 0;
+        }
+
+        int hash = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+        Uint32 key = (r << 24) | (g << 16) | (b << 8) | 0xFF;
+
+        if (index[hash] == key)
+        {
+            out.push_back((Uint8)hash);
+        }
+        else
+        {
+            index[hash] = key;
+
+            int dr = (Sint8)(r - pr);
+            int dg = (Sint8)(g - pg);
+            int db = (Sint8)(b - pb);
+            int dr_dg = dr - dg;
+            int db_dg = db - dg;
+
+            if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2)
+            {
+                out.push_back((Uint8)(0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2)));
+            }
+            else if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 && db_dg > -9 && db_dg < 8)
+            {
+                out.push_back((Uint8)(0x80 | (dg + 32)));
+                out.push_back((Uint8)(((dr_dg + 8) << 4) | (db_dg + 8)));
+            }
+            else
+            {
+                out.push_back(0xFE);
+                out.push_back((Uint8)r);
+                out.push_back((Uint8)g);
+                out.push_back((Uint8)b);
+            }
+        }
+
+        pr = r;
+        pg = g;
+        pb = b;
+    }
+
+    const Uint8 end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    out.insert(out.end(), end, end + 8);
+}
+
+int Capture::worker(void* data)
+{
+    Capture* capture = (Capture*)data;
+
+    //worst case QOI is 4 bytes a pixel plus framing, reserved once per worker
+    std::vector<Uint8> encoded;
+    encoded.reserve(screen_width * screen_height * 4 + 32);
+
+    SDL_LockMutex(capture->lock);
+    for (;;)
+    {
+        while (capture->queued.empty() && !capture->quit)
+            SDL_CondWait(capture->changed, capture->lock);
+
+        //quitting still drains what was already read back
+        if (capture->queued.empty())
+            break;
+
+        int index = capture->queued.front();
+        capture->queued.erase(capture->queued.begin());
+        SDL_UnlockMutex(capture->lock);
+
+        CaptureFrame& frame = capture->frames[index];
+        Uint64 start = SDL_GetPerformanceCounter();
+
+        char name[64];
+        if (frame.png)
+        {
+            SDL_snprintf(name, sizeof(name), "/shot_%u_%04u.png", capture->session, frame.number);
+            SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormatFrom(frame.pixels.data(), frame.width, frame.height, 32, frame.width * 4, SDL_PIXELFORMAT_ARGB8888);
+            if (surface == NULL || IMG_SavePNG(surface, (capture->directory + name).c_str()) != 0)
+                printf("Cannot write screenshot %s%s! SDL_image Error: %s\n", capture->directory.c_str(), name, IMG_GetError());
+            else
+                printf("Saved %s%s\n", capture->directory.c_str(), name);
+            SDL_FreeSurface(surface);
+        }
+        else
+        {
+            SDL_snprintf(name, sizeof(name), "/frame_%u_%06u.qoi", capture->session, frame.number);
+            encodeQoi(frame.pixels.data(), frame.width, frame.height, encoded);
+            SDL_RWops* file = SDL_RWFromFile((capture->directory + name).c_str(), "wb");
+            if (file == NULL || SDL_RWwrite(file, encoded.data(), 1, encoded.size()) != encoded.size())
+                printf("Cannot write frame %s%s\n", capture->directory.c_str(), name);
+            if (file != NULL)
+                SDL_RWclose(file);
+        }
+
+        Uint64 took = (SDL_GetPerformanceCounter() - start) * 1000000 / SDL_GetPerformanceFrequency();
+
+        SDL_LockMutex(capture->lock);
+        capture->idle.push_back(index);
+        capture->written++;
+        capture->encode_us += took;
+    }
+    SDL_UnlockMutex(capture->lock);
+    return 0;
+}
+
+void Capture::stop()
+{
+    if (!started)
+        return;
+
+    SDL_LockMutex(lock);
+    quit = true;
+    SDL_CondBroadcast(changed);
+    SDL_UnlockMutex(lock);
+
+    for (SDL_Thread* thread : threads)
+        SDL_WaitThread(thread, NULL);
+    threads.clear();
+
+    printf("Capture: %u frames taken, %u dropped, %u written, readback %.2f ms, encode and write %.2f ms per frame\n", taken, dropped, written,
+        taken > 0 ? readback_us / 1000.0 / taken : 0.0, written > 0 ? encode_us / 1000.0 / written : 0.0);
+
+    SDL_DestroyCond(changed);
+    SDL_DestroyMutex(lock);
+    started = false;
+}
+
+FramePipe::FramePipe()
+{
+    lock = SDL_CreateMutex();
+    changed = SDL_CreateCond();
+    thread = NULL;
+    submitted = produced = ticks = 0;
+    quit = finished = false;
+    request = NULL;
+    request_data = NULL;
+
+    for (int i = 0; i < 2; i++)
+    {
+        inputs[i].events.reserve(64);
+        SDL_memset(inputs[i].keys, 0, sizeof(inputs[i].keys));
+        inputs[i].arrival = inputs[i].sampled = 0;
+    }
+}
+
+FramePipe::~FramePipe()
+{
+    stop();
+    SDL_DestroyCond(changed);
+    SDL_DestroyMutex(lock);
+}
+
+bool FramePipe::start(int (*simulate)(void* data), void* data)
+{
+    thread = SDL_CreateThread(simulate, "simulation", data);
+    return thread != NULL;
+}
+
+//main thread: hand this frame's input over, draw the previous tick while it simulates, then wait for it
+bool FramePipe::frame()
+{
+    if (thread == NULL)
+    {
+        return false;
+    }
+
+    InputBatch& input = inputs[submitted & 1];
+    input.events.clear();
+
+    bool quitting = false;
+    SDL_Event e;
+    while (pollEvent(&e) != 0)
+    {
+        if (e.type == SDL_QUIT)
+            quitting = true;
+        input.events.push_back(e);
+    }
+
+    SDL_memcpy(input.keys, getKeyboardState(), sizeof(input.keys));
+    input.sampled = SDL_GetPerformanceCounter();
+    input.arrival = takeInput();
+
+    SDL_LockMutex(lock);
+    quit = quitting;
+    submitted++;
+    SDL_CondBroadcast(changed);
+    SDL_UnlockMutex(lock);
+
+    if (submitted > 1)
+    {
+        DrawList& list = lists[(submitted - 2) & 1];
+        if (list.input != 0)
+            markInput(list.input);
+        list.execute();
+        present();
+    }
+
+    SDL_LockMutex(lock);
+    while (produced < submitted && !finished)
+    {
+        if (request != NULL)
+        {
+            void (*function)(void* data) = request;
+            void* data = request_data;
+            SDL_UnlockMutex(lock);
+            function(data);
+            SDL_LockMutex(lock);
+            request = NULL;
+            SDL_CondBroadcast(changed);
+        }
+        else
+        {
+            SDL_CondWait(changed, lock);
+        }
+    }
+    bool running = !finished && !quitting;
+    SDL_UnlockMutex(lock);
+
+    return running;
+}
+
+//simulation thread: wait for the next input batch, NULL once the game is quitting
+InputBatch* FramePipe::next()
+{
+    SDL_LockMutex(lock);
+    while (submitted <= ticks && !quit)
+    {
+        SDL_CondWait(changed, lock);
+    }
+
+    InputBatch* input = &inputs[ticks & 1];
+    if (quit)
+    {
+        finished = true;
+        SDL_CondBroadcast(changed);
+        input = NULL;
+    }
+    SDL_UnlockMutex(lock);
+
+    return input;
+}
+
+DrawList* FramePipe::list()
+{
+    return &lists[ticks & 1];
+}
+
+void FramePipe::publish()
+{
+    SDL_LockMutex(lock);
+    ticks++;
+    produced = ticks;
+    SDL_CondBroadcast(changed);
+    SDL_UnlockMutex(lock);
+}
+
+//simulation thread: run function on the main thread and wait for it to finish
+void FramePipe::call(void (*function)(void* data), void* data)
+{
+    SDL_LockMutex(lock);
+    request = function;
+    request_data = data;
+    SDL_CondBroadcast(changed);
+    while (request != NULL && !quit)
+    {
+        SDL_CondWait(changed, lock);
+    }
+    SDL_UnlockMutex(lock);
+}
+
+void FramePipe::stop()
+{
+    if (thread == NULL)
+    {
+        return;
+    }
+
+    SDL_LockMutex(lock);
+    quit = true;
+    SDL_CondBroadcast(changed);
+    SDL_UnlockMutex(lock);
+
+    SDL_WaitThread(thread, NULL);
+    thread = NULL;
+}
+
+int Texture::getWidth()
+{
+    return mWidth;
+}
+int Texture::getHeight()
+{
+    return mHeight;
+}
+
+void Texture::to_input(SDL_Rect& col)
+{
+    SDL_QueryTexture(mTexture, NULL, NULL, &col.w, &col.h);
+}
+
+
+TileLayer::TileLayer()
+{
+    fill(0);
+}
+
+Uint16 TileLayer::get(int x, int y) const
+{
+    return cells[y * map_width + x];
+}
+
+void TileLayer::set(int x, int y, Uint16 id)
+{
+    cells[y * map_width + x] = id;
+}
+
+void TileLayer::fill(Uint16 id)
+{
+    for (int i = 0; i < map_cells; i++)
+        cells[i] = id;
+}
+
+SparseLayer::SparseLayer()
+{
+    clear();
+}
+
+void SparseLayer::clear()
+{
+    runs.clear();
+    tiles.clear();
+    for (int y = 0; y <= map_height; y++)
+        rows[y] = 0;
+}
+
+void SparseLayer::build(const TileLayer& dense)
+{
+    clear();
+
+    for (int y = 0; y < map_height; y++)
+    {
+        rows[y] = (Uint16)runs.size();
+
+        const Uint16* row = dense.cells + y * map_width;
+        int x = 0;
+        while (x < map_width)
+        {
+            if (row[x] == 0)
+            {
+                x++;
+                continue;
+            }
+
+            TileRun run;
+            run.x = (Uint8)x;
+            run.first = (Uint16)tiles.size();
+            while (x < map_width && row[x] != 0)
+                tiles.push_back(row[x++]);
+            run.length = (Uint8)(x - run.x);
+            runs.push_back(run);
+        }
+    }
+    rows[map_height] = (Uint16)runs.size();
+
+    runs.shrink_to_fit();
+    tiles.shrink_to_fit();
+}
+
+Uint16 SparseLayer::get(int x, int y) const
+{
+    for (int r = rows[y]; r < rows[y + 1]; r++)
+    {
+        const TileRun& run = runs[r];
+        if (x < run.x)
+            return 0;
+        if (x < run.x + run.length)
+            return tiles[run.first + x - run.x];
+    }
+    return 0;
+}
+
+//--layer-check: the sparse layer must read back every cell of the level 1 maps exactly like the dense one
+bool checkLayers()
+{
+    const LevelInfo* info = Levels::find(1);
+    std::string paths[2] = { info->ground, info->objects };
+    bool same = true;
+
+    for (std::string& path : paths)
+    {
+        std::string content;
+        if (!readAsset(path, content))
+        {
+            printf("Layer check: cannot read %s\n", path.c_str());
+            same = false;
+            continue;
+        }
+
+        TileLayer dense;
+        parseLayer(content, dense);
+        SparseLayer sparse;
+        sparse.build(dense);
+
+        int differ = 0;
+        for (int y = 0; y < map_height; y++)
+        {
+            for (int x = 0; x < map_width; x++)
+            {
+                if (sparse.get(x, y) != dense.get(x, y))
+                    differ++;
+            }
+        }
+
+        printf("Layer check: %s, %d runs, %d tiles, %d cells differ\n", path.c_str(), (int)sparse.runs.size(), (int)sparse.tiles.size(), differ);
+        if (differ != 0)
+            same = false;
+    }
+    return same;
+}
+
+TriggerGrid::TriggerGrid()
+{
+    pass = 0;
+    zones = 0;
+    events.reserve(64);
+    current.reserve(16);
+    for (int i = 0; i < trigger_movers; i++)
+        inside[i].reserve(16);
+    index();
+}
+
+//horizontal runs of the same trigger tile become one rectangle
+void TriggerGrid::build(const SparseLayer& objects)
+{
+    triggers.clear();
+    events.clear();
+    for (int i = 0; i < trigger_movers; i++)
+        inside[i].clear();
+    zones = 0;
+
+    for (int y = 0; y < map_height; y++)
+    {
+        for (int r = objects.rows[y]; r < objects.rows[y + 1]; r++)
+        {
+            const TileRun& run = objects.runs[r];
+            for (int k = 0; k < run.length; k++)
+            {
+                Uint16 tile = objects.tiles[run.first + k];
+                if (!tileIs(tile, TILE_TRIGGER))
+                    continue;
+
+                int length = 1;
+                while (k + length < run.length && objects.tiles[run.first + k + length] == tile)
+                    length++;
+
+                Trigger trigger = { { (run.x + k) * 32, y * 32, length * 32, 32 }, tile, (Uint32)tileCooldown(tile), 0, 0, 0 };
+                triggers.push_back(trigger);
+                k += length - 1;
+            }
+        }
+    }
+
+    index();
+}
+
+int TriggerGrid::zone(SDL_Rect area, Uint32 cooldown)
+{
+    int tag = tile_count + 1 + zones++;
+    Trigger trigger = { area, tag, cooldown, 0, 0, 0 };
+    triggers.push_back(trigger);
+    index();
+    return tag;
+}
+
+void TriggerGrid::index()
+{
+    cells.assign(map_cells + 1, 0);
+
+    //counted, summed and filled the same way SparseLayer lays out its rows
+    for (int fill = 0; fill < 2; fill++)
+    {
+        for (int t = 0; t < (int)triggers.size(); t++)
+        {
+            SDL_Rect& a = triggers[t].area;
+            int x0 = std::max(0, a.x / 32);
+            int x1 = std::min(map_width - 1, (a.x + a.w - 1) / 32);
+            int y0 = std::max(0, a.y / 32);
+            int y1 = std::min(map_height - 1, (a.y + a.h - 1) / 32);
+            for (int y = y0; y <= y1; y++)
+            {
+                for (int x = x0; x <= x1; x++)
+                {
+                    if (fill == 0)
+                        cells[y * map_width + x + 1]++;
+                    else
+                        members[cells[y * map_width + x]++] = (Uint16)t;
+                }
+            }
+        }
+
+        if (fill == 0)
+        {
+            for (int i = 0; i < map_cells; i++)
+                cells[i + 1] += cells[i];
+            members.assign(cells[map_cells], 0);
+        }
+    }
+
+    //filling moved every start to the next cell's, shift them back
+    for (int i = map_cells; i > 0; i--)
+        cells[i] = cells[i - 1];
+    cells[0] = 0;
+}
+
+void TriggerGrid::begin()
+{
+    events.clear();
+}
+
+void TriggerGrid::move(int mover, const SDL_Rect& body, Uint32 now)
+{
+    if (mover < 0 || mover >= trigger_movers)
+        return;
+
+    pass++;
+    Uint8 bit = (Uint8)(1 << mover);
+    SDL_Rect rect = body;
+    current.clear();
+
+    int x0 = std::max(0, rect.x / 32);
+    int x1 = std::min(map_width - 1, (rect.x + rect.w - 1) / 32);
+    int y0 = std::max(0, rect.y / 32);
+    int y1 = std::min(map_height - 1, (rect.y + rect.h - 1) / 32);
+    for (int y = y0; y <= y1; y++)
+    {
+        for (int x = x0; x <= x1; x++)
+        {
+            for (int m = cells[y * map_width + x]; m < cells[y * map_width + x + 1]; m++)
+            {
+                Trigger& trigger = triggers[members[m]];
+                if (trigger.seen == pass || !checkCollision(rect, trigger.area))
+                    continue;
+
+                trigger.seen = pass;
+                current.push_back(members[m]);
+            }
+        }
+    }
+
+    for (int t : current)
+    {
+        Trigger& trigger = triggers[t];
+        if ((trigger.inside & bit) != 0)
+        {
+            events.push_back({ trigger.tag, (Uint8)mover, TRIGGER_STAY });
+            continue;
+        }
+
+        //stepping in while the trigger cools down only counts as being inside
+        trigger.inside |= bit;
+        if (now >= trigger.ready)
+        {
+            trigger.ready = now + trigger.cooldown;
+            events.push_back({ trigger.tag, (Uint8)mover, TRIGGER_ENTER });
+        }
+        else
+        {
+            events.push_back({ trigger.tag, (Uint8)mover, TRIGGER_STAY });
+        }
+    }
+
+    for (int t : inside[mover])
+    {
+        Trigger& trigger = triggers[t];
+        if (trigger.seen != pass)
+        {
+            trigger.inside &= (Uint8)~bit;
+            events.push_back({ trigger.tag, (Uint8)mover, TRIGGER_EXIT });
+        }
+    }
+
+    inside[mover].swap(current);
+}
+
+//tag 0 matches any trigger, inside covers both entering and staying
+bool TriggerGrid::happened(int mover, int tag, int phase)
+{
+    for (const TriggerEvent& e : events)
+    {
+        if (e.mover != mover || (tag != 0 && e.tag != tag))
+            continue;
+        if (e.phase == phase || (phase == TRIGGER_STAY && e.phase == TRIGGER_ENTER))
+            return true;
+    }
+    return false;
+}
+
+Tilemap::Tilemap()
+{
+    set();
+}
+
+bool Tilemap::load()
+{
+    MemoryScope scope(MEMORY_TILEMAP);
+
+    bool succes = true;
+
+    for (int i = 0; i < tile_count; i++)
+    {
+        std::string do_zmiany = std::to_string(i + 1);
+        if (elements[i].loadFromFile("Assets/Tilemap/" + do_zmiany + ".png") == false)
+        {
+            succes = false;
+        }
+    }
+    return succes;
+}
+
+void Tilemap::set()
+{
+    ground.fill(1);
+
+    for (int i = 0; i < 40; i++)
+    {
+        for (int j = 0; j < 24; j++)
+        {
+            collider[i][j].x = i * 32;
+            collider[i][j].y = j * 32;
+            collider[i][j].h = collider[i][j].w = 32;
+        }
+    }
+
+}
+
+void Tilemap::show(int id)
+{
+    //animated tiles step to the next id of their strip every 200 ms
+    Uint32 beat = getTicks() / 200;
+
+    if (id == 0)
+    {
+        for (int i = 0; i < map_cells; i++)
+        {
+            Uint16 tile = ground.cells[i];
+            if (tileIs(tile, TILE_ANIMATED))
+                tile += beat % tileFrames(tile);
+            elements[tile - 1].render(i % map_width * 32, i / map_width * 32);
+        }
+    }
+    else
+    {
+        for (int y = 0; y < map_height; y++)
+        {
+            for (int r = objects.rows[y]; r < objects.rows[y + 1]; r++)
+            {
+                const TileRun& run = objects.runs[r];
+                for (int k = 0; k < run.length; k++)
+                {
+                    Uint16 tile = objects.tiles[run.first + k];
+                    if (tileIs(tile, TILE_ANIMATED))
+                        tile += beat % tileFrames(tile);
+                    elements[tile - 1].render((run.x + k) * 32, y * 32);
+                }
+            }
+        }
+    }
+}
+
+void Tilemap::free()
+{
+    for (int i = 0; i < tile_count; i++)
+    {
+        elements[i].free();
+    }
+}
+
+bool parseLayer(std::string& content, TileLayer& layer)
+{
+    std::istringstream mapa(content);
+    int a = 0;
+    int i = 0;
+    while (i < map_cells && mapa >> a)
+    {
+        layer.cells[i] = (Uint16)a;
+        i++;
+    }
+    return true;
+}
+
+bool Tilemap::loadFromfile(std::string path, int l)
+{
+    bool loaded = true;
+    std::string content;
+    if (!readAsset(path, content))
+    {
+        printf("Something wrong with map level isn't working");
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search map level file. Please reinstall game :)", NULL);
+        loaded = false;
+    }
+    else
+    {
+        switch (l)
+        {
+        case 0:
+            parseLayer(content, ground);
+            break;
+        case 1:
+        {
+            TileLayer dense;
+            parseLayer(content, dense);
+            objects.build(dense);
+            triggers.build(objects);
+            break;
+        }
+        }
+    }
+    return loaded;
+}
+
+void Tilemap::loadLevel(LevelAssets* level)
+{
+    MemoryScope scope(MEMORY_TILEMAP);
+
+    ground = level->ground;
+    objects.build(level->objects);
+    triggers.build(objects);
+}
+
+LightMap::LightMap()
+{
+    //three float planes plus two output buffers, so the simulation shades one while the renderer uploads the other
+    red = new float[light_columns * light_rows];
+    green = new float[light_columns * light_rows];
+    blue = new float[light_columns * light_rows];
+    pixels[0] = new Uint32[light_columns * light_rows];
+    pixels[1] = new Uint32[light_columns * light_rows];
+    SDL_memset(pixels[0], 0, light_columns * light_rows * sizeof(Uint32));
+    SDL_memset(pixels[1], 0, light_columns * light_rows * sizeof(Uint32));
+    SDL_memset(explored, 0, sizeof(explored));
+
+    placed = count = 0;
+    ambient = 0.04f;
+    fog = 0.22f;
+    front = 0;
+    texture = NULL;
+#ifdef SIMD_SSE2
+    avx = SDL_HasAVX() == SDL_TRUE;
+#else
+    avx = false;
+#endif
+}
+
+LightMap::~LightMap()
+{
+    free();
+    delete[] red;
+    delete[] green;
+    delete[] blue;
+    delete[] pixels[0];
+    delete[] pixels[1];
+}
+
+void LightMap::free()
+{
+    if (texture != NULL)
+    {
+        SDL_DestroyTexture(texture);
+        texture = NULL;
+    }
+}
+
+//drops the lights added for the last frame, placed ones like torches stay
+void LightMap::begin()
+{
+    count = 0;
+}
+
+int LightMap::place(float x, float y, float radius, float r, float g, float b)
+{
+    if (placed >= max_lights || radius <= 0)
+        return -1;
+
+    Light& light = placed_lights[placed];
+    light.x = x;
+    light.y = y;
+    light.radius = radius;
+    light.r = r;
+    light.g = g;
+    light.b = b;
+    return placed++;
+}
+
+void LightMap::add(float x, float y, float radius, float r, float g, float b)
+{
+    if (count >= max_lights || radius <= 0)
+        return;
+
+    Light& light = lights[count++];
+    light.x = x;
+    light.y = y;
+    light.radius = radius;
+    light.r = r;
+    light.g = g;
+    light.b = b;
+}
+
+static bool opaqueTile(Tilemap* t, int x, int y)
+{
+    return tileIs(t->objects.get(x, y), TILE_OPAQUE);
+}
+
+//a tile is lit when the line from the light to its centre crosses no wall before reaching it
+void LightMap::visibility(Light& light, Tilemap* t)
+{
+    int x0 = std::max(0, (int)((light.x - light.radius) / 32));
+    int x1 = std::min(39, (int)((light.x + light.radius) / 32));
+    int y0 = std::max(0, (int)((light.y - light.radius) / 32));
+    int y1 = std::min(23, (int)((light.y + light.radius) / 32));
+
+    int from_x = (int)(light.x / 32);
+    int from_y = (int)(light.y / 32);
+
+    for (int tx = x0; tx <= x1; tx++)
+    {
+        for (int ty = y0; ty <= y1; ty++)
+        {
+            if (t == NULL || from_x < 0 || from_x >= 40 || from_y < 0 || from_y >= 24)
+            {
+                visible[tx][ty] = 1.0f;
+                continue;
+            }
+
+            //grid walk from the light's tile towards the target, one tile boundary at a time
+            float dx = tx * 32 + 16 - light.x;
+            float dy = ty * 32 + 16 - light.y;
+            int step_x = dx > 0 ? 1 : -1;
+            int step_y = dy > 0 ? 1 : -1;
+            float delta_x = dx != 0 ? fabsf(32 / dx) : 1e9f;
+            float delta_y = dy != 0 ? fabsf(32 / dy) : 1e9f;
+            float next_x = dx > 0 ? ((from_x + 1) * 32 - light.x) / dx : dx < 0 ? (light.x - from_x * 32) / -dx : 1e9f;
+            float next_y = dy > 0 ? ((from_y + 1) * 32 - light.y) / dy : dy < 0 ? (light.y - from_y * 32) / -dy : 1e9f;
+
+            int x = from_x;
+            int y = from_y;
+            float lit = 1.0f;
+            while (x != tx || y != ty)
+            {
+                if (next_x < next_y)
+                {
+                    x += step_x;
+                    next_x += delta_x;
+                }
+                else
+                {
+                    y += step_y;
+                    next_y += delta_y;
+                }
+
+                if ((x != tx || y != ty) && opaqueTile(t, x, y))
+                {
+                    lit = 0.0f;
+                    break;
+                }
+            }
+            visible[tx][ty] = lit;
+        }
+    }
+}
+
+//every light adds (1 - d^2/r^2)^2 of its colour to the cells it can see, four cells (one tile) per step
+static void accumulate(const Light& light, const float (*visible)[24], float* red, float* green, float* blue, int x0, int x1, int y0, int y1)
+{
+#ifdef SIMD_SSE2
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 inverse = _mm_set1_ps(1.0f / (light.radius * light.radius));
+    const __m128 r = _mm_set1_ps(light.r);
+    const __m128 g = _mm_set1_ps(light.g);
+    const __m128 b = _mm_set1_ps(light.b);
+    const __m128 centres = _mm_setr_ps(0.5f * light_cell, 1.5f * light_cell, 2.5f * light_cell, 3.5f * light_cell);
+
+    for (int y = y0; y < y1; y++)
+    {
+        float dy = (y + 0.5f) * light_cell - light.y;
+        __m128 dy2 = _mm_set1_ps(dy * dy);
+
+        for (int x = x0; x < x1; x += 4)
+        {
+            __m128 dx = _mm_sub_ps(_mm_add_ps(_mm_set1_ps((float)(x * light_cell)), centres), _mm_set1_ps(light.x));
+            __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), dy2);
+            __m128 a = _mm_max_ps(zero, _mm_sub_ps(one, _mm_mul_ps(d2, inverse)));
+            a = _mm_mul_ps(_mm_mul_ps(a, a), _mm_set1_ps(visible[x / 4][y / 4]));
+
+            int i = y * light_columns + x;
+            _mm_storeu_ps(red + i, _mm_add_ps(_mm_loadu_ps(red + i), _mm_mul_ps(a, r)));
+            _mm_storeu_ps(green + i, _mm_add_ps(_mm_loadu_ps(green + i), _mm_mul_ps(a, g)));
+            _mm_storeu_ps(blue + i, _mm_add_ps(_mm_loadu_ps(blue + i), _mm_mul_ps(a, b)));
+        }
+    }
+#else
+    float inverse = 1.0f / (light.radius * light.radius);
+    for (int y = y0; y < y1; y++)
+    {
+        float dy = (y + 0.5f) * light_cell - light.y;
+        for (int x = x0; x < x1; x++)
+        {
+            float dx = (x + 0.5f) * light_cell - light.x;
+            float a = std::max(0.0f, 1.0f - (dx * dx + dy * dy) * inverse);
+            a = a * a * visible[x / 4][y / 4];
+
+            int i = y * light_columns + x;
+            red[i] += a * light.r;
+            green[i] += a * light.g;
+            blue[i] += a * light.b;
+        }
+    }
+#endif
+}
+
+#ifdef SIMD_SSE2
+//same sum eight cells (two tiles) at a time, only called when the CPU reports AVX
+TARGET_AVX static void accumulateAvx(const Light& light, const float (*visible)[24], float* red, float* green, float* blue, int x0, int x1, int y0, int y1)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 inverse = _mm256_set1_ps(1.0f / (light.radius * light.radius));
+    const __m256 r = _mm256_set1_ps(light.r);
+    const __m256 g = _mm256_set1_ps(light.g);
+    const __m256 b = _mm256_set1_ps(light.b);
+    const __m256 centres = _mm256_setr_ps(0.5f * light_cell, 1.5f * light_cell, 2.5f * light_cell, 3.5f * light_cell,
+        4.5f * light_cell, 5.5f * light_cell, 6.5f * light_cell, 7.5f * light_cell);
+
+    for (int y = y0; y < y1; y++)
+    {
+        float dy = (y + 0.5f) * light_cell - light.y;
+        __m256 dy2 = _mm256_set1_ps(dy * dy);
+
+        for (int x = x0; x < x1; x += 8)
+        {
+            __m256 dx = _mm256_sub_ps(_mm256_add_ps(_mm256_set1_ps((float)(x * light_cell)), centres), _mm256_set1_ps(light.x));
+            __m256 d2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), dy2);
+            __m256 a = _mm256_max_ps(zero, _mm256_sub_ps(one, _mm256_mul_ps(d2, inverse)));
+            __m256 seen = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(visible[x / 4][y / 4])), _mm_set1_ps(visible[x / 4 + 1][y / 4]), 1);
+            a = _mm256_mul_ps(_mm256_mul_ps(a, a), seen);
+
+            int i = y * light_columns + x;
+            _mm256_storeu_ps(red + i, _mm256_add_ps(_mm256_loadu_ps(red + i), _mm256_mul_ps(a, r)));
+            _mm256_storeu_ps(green + i, _mm256_add_ps(_mm256_loadu_ps(green + i), _mm256_mul_ps(a, g)));
+            _mm256_storeu_ps(blue + i, _mm256_add_ps(_mm256_loadu_ps(blue + i), _mm256_mul_ps(a, b)));
+        }
+    }
+}
+#endif
+
+void LightMap::shade(Tilemap* t)
+{
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    //tiles seen once stay dimly visible, the rest of the level is nearly black
+    for (int y = 0; y < light_rows; y++)
+    {
+        for (int x = 0; x < light_columns; x += 4)
+        {
+            float base = explored[x / 4][y / 4] ? fog : ambient;
+            int i = y * light_columns + x;
+            for (int k = 0; k < 4; k++)
+                red[i + k] = green[i + k] = blue[i + k] = base;
+        }
+    }
+
+    for (int n = 0; n < placed + count; n++)
+    {
+        Light& light = n < placed ? placed_lights[n] : lights[n - placed];
+
+        //cell bounds rounded out to whole tile pairs, so both kernels start on a tile and the AVX one on a pair
+        int x0 = std::max(0, (int)((light.x - light.radius) / light_cell) & ~7);
+        int x1 = std::min(light_columns, ((int)((light.x + light.radius) / light_cell) + 8) & ~7);
+        int y0 = std::max(0, (int)((light.y - light.radius) / light_cell));
+        int y1 = std::min(light_rows, (int)((light.y + light.radius) / light_cell) + 1);
+        if (x0 >= x1 || y0 >= y1)
+            continue;
+
+        for (int tx = x0 / 4; tx < x1 / 4; tx++)
+        {
+            for (int ty = y0 / 4; ty <= (y1 - 1) / 4; ty++)
+                visible[tx][ty] = 0.0f;
+        }
+        visibility(light, t);
+
+#ifdef SIMD_SSE2
+        if (avx)
+            accumulateAvx(light, visible, red, green, blue, x0, x1, y0, y1);
+        else
+#endif
+            accumulate(light, visible, red, green, blue, x0, x1, y0, y1);
+
+        //whatever a light reaches counts as explored from now on, without a tilemap there is nothing to explore
+        if (t == NULL)
+            continue;
+
+        for (int tx = x0 / 4; tx < x1 / 4; tx++)
+        {
+            for (int ty = y0 / 4; ty <= (y1 - 1) / 4; ty++)
+            {
+                float dx = tx * 32 + 16 - light.x;
+                float dy = ty * 32 + 16 - light.y;
+                if (visible[tx][ty] > 0 && dx * dx + dy * dy < light.radius * light.radius * 0.5f)
+                    explored[tx][ty] = true;
+            }
+        }
+    }
+
+    int back = front ^ 1;
+    Uint32* out = pixels[back];
+
+#ifdef SIMD_SSE2
+    const __m128 scale = _mm_set1_ps(255.0f);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    for (int i = 0; i < light_columns * light_rows; i += 4)
+    {
+        __m128i r = _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(red + i), scale), scale));
+        __m128i g = _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(green + i), scale), scale));
+        __m128i b = _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(blue + i), scale), scale));
+        __m128i argb = _mm_or_si128(_mm_or_si128(alpha, _mm_slli_epi32(r, 16)), _mm_or_si128(_mm_slli_epi32(g, 8), b));
+        _mm_storeu_si128((__m128i*)(out + i), argb);
+    }
+#else
+    for (int i = 0; i < light_columns * light_rows; i++)
+    {
+        Uint32 r = (Uint32)(std::min(red[i], 1.0f) * 255.0f + 0.5f);
+        Uint32 g = (Uint32)(std::min(green[i], 1.0f) * 255.0f + 0.5f);
+        Uint32 b = (Uint32)(std::min(blue[i], 1.0f) * 255.0f + 0.5f);
+        out[i] = 0xFF000000 | (r << 16) | (g << 8) | b;
+    }
+#endif
+
+    front = back;
+
+    gPerf.add(PERF_LIGHTING, start);
+}
+
+void LightMap::draw()
+{
+    if (DrawList::recording() != NULL)
+        DrawList::recording()->light(this, front);
+    else
+        upload(front);
+}
+
+//renderer thread only: stream the shaded buffer in and multiply it over everything drawn so far
+void LightMap::upload(int buffer)
+{
+    if (texture == NULL)
+    {
+        texture = SDL_CreateTexture(gRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, light_columns, light_rows);
+        if (texture == NULL)
+        {
+            printf("Unable to create light map! SDL Error: %s\n", SDL_GetError());
+            return;
+        }
+        SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_MOD);
+        SDL_SetTextureScaleMode(texture, SDL_ScaleModeLinear);
+    }
+
+    void* locked;
+    int pitch;
+    if (SDL_LockTexture(texture, NULL, &locked, &pitch) != 0)
+        return;
+
+    for (int y = 0; y < light_rows; y++)
+        SDL_memcpy((Uint8*)locked + y * pitch, pixels[buffer] + y * light_columns, light_columns * sizeof(Uint32));
+
+    SDL_UnlockTexture(texture);
+    SDL_RenderCopy(gRenderer, texture, NULL, NULL);
+}
+
+const Uint32* LightMap::buffer(int index)
+{
+    return pixels[index];
+}
+
+Particles::Particles()
+{
+    x = y = vx = vy = gravity = drag = life = fade = NULL;
+    kind = NULL;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    vertices = NULL;
+    indices = NULL;
+#else
+    rects = NULL;
+    buckets = NULL;
+#endif
+    count = 0;
+    seed = 0x9E3779B9;
+#ifdef SIMD_SSE2
+    simd = true;
+#else
+    simd = false;
+#endif
+}
+
+Particles::~Particles()
+{
+    delete[] x;
+    delete[] y;
+    delete[] vx;
+    delete[] vy;
+    delete[] gravity;
+    delete[] drag;
+    delete[] life;
+    delete[] fade;
+    delete[] kind;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    delete[] vertices;
+    delete[] indices;
+#else
+    delete[] rects;
+    delete[] buckets;
+#endif
+}
+
+//name count rate life life_spread speed speed_spread angle spread gravity drag size r g b r2 g2 b2 additive
+bool Particles::load(std::string path)
+{
+    std::string content;
+    if (!readAsset(path, content))
+    {
+        printf("Cannot read particle emitters from %s\n", path.c_str());
+        return false;
+    }
+
+    emitters.clear();
+
+    std::istringstream lines(content);
+    std::string line;
+    int number = 0;
+    while (std::getline(lines, line))
+    {
+        number++;
+        if (line.empty() || line[0] == '#' || line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+
+        std::istringstream fields(line);
+        Emitter e;
+        int r, g, b, r2, g2, b2, additive;
+        if (!(fields >> e.name >> e.count >> e.rate >> e.life >> e.life_spread >> e.speed >> e.speed_spread >> e.angle >> e.spread
+            >> e.gravity >> e.drag >> e.size >> r >> g >> b >> r2 >> g2 >> b2 >> additive))
+        {
+            printf("Bad emitter on line %d of %s\n", number, path.c_str());
+            continue;
+        }
+
+        //the emitter index is stored per particle in a byte
+        if (emitters.size() == 256)
+        {
+            printf("Too many emitters in %s, %s and later are ignored\n", path.c_str(), e.name.c_str());
+            break;
+        }
+
+        e.r = (Uint8)r;
+        e.g = (Uint8)g;
+        e.b = (Uint8)b;
+        e.r2 = (Uint8)r2;
+        e.g2 = (Uint8)g2;
+        e.b2 = (Uint8)b2;
+        e.additive = additive != 0;
+        emitters.push_back(e);
+    }
+
+    carry.assign(emitters.size(), 0.0f);
+    return !emitters.empty();
+}
+
+int Particles::find(std::string name)
+{
+    for (int i = 0; i < (int)emitters.size(); i++)
+    {
+        if (emitters[i].name == name)
+            return i;
+    }
+    return -1;
+}
+
+bool Particles::reserve()
+{
+    if (x != NULL)
+        return true;
+
+    //zeroed so the integrator can run past count up to the next group of four without touching garbage
+    float** planes[8] = { &x, &y, &vx, &vy, &gravity, &drag, &life, &fade };
+    for (float** plane : planes)
+    {
+        *plane = new float[max_particles];
+        SDL_memset(*plane, 0, max_particles * sizeof(float));
+    }
+    kind = new Uint8[max_particles];
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    //indices never change, each quad points at its own four vertices
+    vertices = new SDL_Vertex[max_particles * 4];
+    indices = new int[max_particles * 6];
+    for (int i = 0; i < max_particles; i++)
+    {
+        const int corners[6] = { 0, 1, 2, 2, 1, 3 };
+        for (int k = 0; k < 6; k++)
+            indices[i * 6 + k] = i * 4 + corners[k];
+    }
+#else
+    rects = new SDL_FRect[max_particles];
+    buckets = new int[256 * particle_shades + 1];
+#endif
+    return true;
+}
+
+static float particleRandom(Uint32& seed)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return (seed >> 8) * (1.0f / 16777216.0f);
+}
+
+int Particles::emit(int emitter, float px, float py, int n)
+{
+    if (emitter < 0 || emitter >= (int)emitters.size() || !reserve())
+        return 0;
+
+    Emitter& e = emitters[emitter];
+    if (n <= 0)
+        n = e.count;
+    n = std::min(n, max_particles - count);
+
+    for (int k = 0; k < n; k++)
+    {
+        int i = count++;
+        float angle = (e.angle + (particleRandom(seed) - 0.5f) * e.spread) * 0.0174532925f;
+        float speed = e.speed + (particleRandom(seed) * 2.0f - 1.0f) * e.speed_spread;
+        float span = std::max(0.05f, e.life + (particleRandom(seed) * 2.0f - 1.0f) * e.life_spread);
+
+        x[i] = px;
+        y[i] = py;
+        vx[i] = cosf(angle) * speed;
+        vy[i] = -sinf(angle) * speed;
+        gravity[i] = e.gravity;
+        drag[i] = e.drag;
+        life[i] = span;
+        fade[i] = 1.0f / span;
+        kind[i] = (Uint8)emitter;
+    }
+    return n;
+}
+
+void Particles::stream(int emitter, float px, float py, float dt)
+{
+    if (emitter < 0 || emitter >= (int)emitters.size())
+        return;
+
+    carry[emitter] += emitters[emitter].rate * dt;
+    int n = (int)carry[emitter];
+    carry[emitter] -= n;
+    emit(emitter, px, py, n);
+}
+
+void Particles::update(float dt)
+{
+    if (count == 0)
+        return;
+
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    int i = 0;
+#ifdef SIMD_SSE2
+    if (simd)
+    {
+        const __m128 step = _mm_set1_ps(dt);
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        int rounded = (count + 3) & ~3;
+        for (; i < rounded; i += 4)
+        {
+            __m128 svx = _mm_loadu_ps(vx + i);
+            __m128 svy = _mm_add_ps(_mm_loadu_ps(vy + i), _mm_mul_ps(_mm_loadu_ps(gravity + i), step));
+            __m128 damp = _mm_max_ps(zero, _mm_sub_ps(one, _mm_mul_ps(_mm_loadu_ps(drag + i), step)));
+            svx = _mm_mul_ps(svx, damp);
+            svy = _mm_mul_ps(svy, damp);
+            _mm_storeu_ps(vx + i, svx);
+            _mm_storeu_ps(vy + i, svy);
+            _mm_storeu_ps(x + i, _mm_add_ps(_mm_loadu_ps(x + i), _mm_mul_ps(svx, step)));
+            _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(svy, step)));
+            _mm_storeu_ps(life + i, _mm_sub_ps(_mm_loadu_ps(life + i), step));
+        }
+    }
+#endif
+    for (; i < count; i++)
+    {
+        float sy = vy[i] + gravity[i] * dt;
+        float damp = std::max(0.0f, 1.0f - drag[i] * dt);
+        vx[i] = vx[i] * damp;
+        vy[i] = sy * damp;
+        x[i] = x[i] + vx[i] * dt;
+        y[i] = y[i] + vy[i] * dt;
+        life[i] = life[i] - dt;
+    }
+
+    //dead particles are replaced by the last live one, order does not matter to the renderer
+    for (i = 0; i < count;)
+    {
+        if (life[i] > 0.0f)
+        {
+            i++;
+            continue;
+        }
+
+        int last = --count;
+        x[i] = x[last];
+        y[i] = y[last];
+        vx[i] = vx[last];
+        vy[i] = vy[last];
+        gravity[i] = gravity[last];
+        drag[i] = drag[last];
+        life[i] = life[last];
+        fade[i] = fade[last];
+        kind[i] = kind[last];
+    }
+
+    gPerf.add(PERF_PARTICLES, start);
+}
+
+void Particles::render()
+{
+    if (count == 0)
+        return;
+
+    SDL_BlendMode previous;
+    SDL_GetRenderDrawBlendMode(gRenderer, &previous);
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    //every particle is a quad fading from the start to the end colour, one geometry call per blend mode
+    for (int pass = 0; pass < 2; pass++)
+    {
+        bool additive = pass == 1;
+        int quads = 0;
+        for (int i = 0; i < count; i++)
+        {
+            Emitter& e = emitters[kind[i]];
+            if (e.additive != additive)
+                continue;
+
+            float t = std::min(1.0f, life[i] * fade[i]);
+            SDL_Color color = { (Uint8)(e.r2 + (e.r - e.r2) * t), (Uint8)(e.g2 + (e.g - e.g2) * t), (Uint8)(e.b2 + (e.b - e.b2) * t), (Uint8)(255 * t) };
+            float half = e.size * 0.5f;
+
+            SDL_Vertex* v = vertices + quads * 4;
+            v[0] = { { x[i] - half, y[i] - half }, color, { 0, 0 } };
+            v[1] = { { x[i] + half, y[i] - half }, color, { 1, 0 } };
+            v[2] = { { x[i] - half, y[i] + half }, color, { 0, 1 } };
+            v[3] = { { x[i] + half, y[i] + half }, color, { 1, 1 } };
+            quads++;
+        }
+
+        if (quads > 0)
+        {
+            SDL_SetRenderDrawBlendMode(gRenderer, additive ? SDL_BLENDMODE_ADD : SDL_BLENDMODE_BLEND);
+            SDL_RenderGeometry(gRenderer, NULL, vertices, quads * 4, indices, quads * 6);
+        }
+    }
+#else
+    //SDL 2.0.16 has no geometry call, so particles are sorted into a few colour shades per emitter and each shade is one rect batch
+    int keys = (int)emitters.size() * particle_shades;
+    SDL_memset(buckets, 0, (keys + 1) * sizeof(int));
+    for (int i = 0; i < count; i++)
+    {
+        int shade = std::min(particle_shades - 1, (int)(life[i] * fade[i] * particle_shades));
+        buckets[kind[i] * particle_shades + shade + 1]++;
+    }
+    for (int k = 0; k < keys; k++)
+        buckets[k + 1] += buckets[k];
+
+    for (int i = 0; i < count; i++)
+    {
+        int shade = std::min(particle_shades - 1, (int)(life[i] * fade[i] * particle_shades));
+        float size = emitters[kind[i]].size;
+        rects[buckets[kind[i] * particle_shades + shade]++] = { x[i] - size * 0.5f, y[i] - size * 0.5f, size, size };
+    }
+
+    //the placing pass moved every bucket start to the next one's, so bucket k now spans [k - 1, k)
+    for (int k = 0; k < keys; k++)
+    {
+        int first = k == 0 ? 0 : buckets[k - 1];
+        int n = buckets[k] - first;
+        if (n == 0)
+            continue;
+
+        Emitter& e = emitters[k / particle_shades];
+        float t = (k % particle_shades + 0.5f) / particle_shades;
+        SDL_SetRenderDrawBlendMode(gRenderer, e.additive ? SDL_BLENDMODE_ADD : SDL_BLENDMODE_BLEND);
+        SDL_SetRenderDrawColor(gRenderer, (Uint8)(e.r2 + (e.r - e.r2) * t), (Uint8)(e.g2 + (e.g - e.g2) * t), (Uint8)(e.b2 + (e.b - e.b2) * t), (Uint8)(255 * t));
+        SDL_RenderFillRectsF(gRenderer, rects + first, n);
+    }
+#endif
+
+    SDL_SetRenderDrawBlendMode(gRenderer, previous);
+}
+
+void Particles::clear()
+{
+    count = 0;
+    carry.assign(emitters.size(), 0.0f);
+}
+
+Player::Player(int pozx, int pozy)
+{
+    frame = 0;
+    lastx = 0;
+    lasty = -1;
+    //pixels per walk step, the level walks net_rate steps a second whatever the frame rate is
+    velocity = 3;
+    ismoving = false;
+    Collider.w = 21;
+    Collider.h = 32;
+    Collider.x = pozx;
+    Collider.y = pozy;
+    nick = "NICKNAME";
+    id = "0";
+    map = 1;
+    save = "0";
+    keyboard_active = true;
+}
+
+bool Player::load()
+{
+    bool succes = true;
+
+    if (!player_texture.loadFromFile("Assets/Player/p" + id + ".png"))
+    {
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search player texture file. Please reinstall game :)", NULL);
+        succes = false;
+    }
+    else
+    {
+        down[0].x = 0;
+        down[0].y = 0;
+        down[0].w = 32;
+        down[0].h = 32;
+
+        down[1].x = 32;
+        down[1].y = 0;
+        down[1].w = 32;
+        down[1].h = 32;
+
+        down[2].x = 64;
+        down[2].y = 0;
+        down[2].w = 32;
+        down[2].h = 32;
+
+        left[0].x = 0;
+        left[0].y = 32;
+        left[0].w = 32;
+        left[0].h = 32;
+
+        left[1].x = 32;
+        left[1].y = 32;
+        left[1].w = 32;
+        left[1].h = 32;
+
+        left[2].x = 64;
+        left[2].y = 32;
+        left[2].w = 32;
+        left[2].h = 32;
+
+        right[0].x = 0;
+        right[0].y = 64;
+        right[0].w = 32;
+        right[0].h = 32;
+
+        right[1].x = 32;
+        right[1].y = 64;
+        right[1].w = 32;
+        right[1].h = 32;
+
+        right[2].x = 64;
+        right[2].y = 64;
+        right[2].w = 32;
+        right[2].h = 32;
+
+        up[0].x = 0;
+        up[0].y = 96;
+        up[0].w = 32;
+        up[0].h = 32;
+
+        up[1].x = 32;
+        up[1].y = 96;
+        up[1].w = 32;
+        up[1].h = 32;
+
+        up[2].x = 64;
+        up[2].y = 96;
+        up[2].w = 32;
+        up[2].h = 32;
+    }
+    return succes;
+}
+
+void Player::handleKeys(const Uint8* keys)
+{
+    if (!keyboard_active)
+    {
+        return;
+    }
+
+    ismoving = true;
+
+    if (keys[SDL_SCANCODE_LEFT] || keys[SDL_SCANCODE_A])
+    {
+        Collider.x -= velocity;
+        lasty = 0;
+        lastx = -1;
+    }
+    else if (keys[SDL_SCANCODE_RIGHT] || keys[SDL_SCANCODE_D])
+    {
+        Collider.x += velocity;
+        lastx = 1;
+        lasty = 0;
+    }
+    else if (keys[SDL_SCANCODE_UP] || keys[SDL_SCANCODE_W])
+    {
+        Collider.y -= velocity;
+        lasty = 1;
+        lastx = 0;
+    }
+    else if (keys[SDL_SCANCODE_DOWN] || keys[SDL_SCANCODE_S])
+    {
+        Collider.y += velocity;
+        lastx = 0;
+        lasty = -1;
+    }
+    else
+    {
+        ismoving = false;
+    }
+}
+
+void Player::move(SDL_Rect& wall)
+{
+    if (checkCollision(Collider, wall) == 1)
+    {
+        if (lastx != 0)
+        {
+            if (lastx == 1)
+            {
+                Collider.x -= velocity;
+            }
+            else if (lastx == -1)
+            {
+                Collider.x += velocity;
+            }
+        }
+        if (lasty != 0)
+        {
+            if (lasty == 1)
+            {
+                Collider.y += velocity;
+            }
+            else if (lasty == -1)
+            {
+                Collider.y -= velocity;
+            }
+        }
+
+    }
+    else
+    {
+
+        if (Collider.x < 0)
+        {
+            Collider.x += velocity;
+        }
+        else if (Collider.x + Collider.w > 1280)
+        {
+            Collider.x -= velocity;
+        }
+
+        if (Collider.y < 0)
+        {
+            Collider.y += velocity;
+        }
+        else if (Collider.y + Collider.h > 768)
+        {
+            Collider.y -= velocity;
+        }
+    }
+}
+
+void Player::render()
+{
+    SDL_Rect* current;
+
+    if (ismoving)
+    {
+
+        if (frame / 20 >= 3)
+        {
+            frame = 0;
+        }
+        else
+        {
+            if (lastx == 1)
+            {
+                current = &right[frame / 20];
+            }
+            else if (lastx == -1)
+            {
+                current = &left[frame / 20];
+            }
+            else if (lasty == 1)
+            {
+                current = &up[frame / 20];
+            }
+            else
+            {
+                current = &down[frame / 20];
+            }
+
+            player_texture.render(Collider.x, Collider.y, current);
+
+            frame++;
+        }
+    }
+    else
+    {
+        if (lastx == 1)
+        {
+            current = &right[1];
+        }
+        else if (lastx == -1)
+        {
+            current = &left[1];
+        }
+        else if (lasty == 1)
+        {
+            current = &up[1];
+        }
+        else
+        {
+            current = &down[1];
+        }
+
+        player_texture.render(Collider.x, Collider.y, current);
+
+    }
+
+}
+
+Player::~Player()
+{
+    player_texture.free();
+
+    if (save != "0" && !gReplay.playing)
+    {
+        std::ofstream plik;
+
+        plik.open("Assets/Saves/" + save + ".txt");
+
+        plik << nick << std::endl << id << std::endl<<health << std::endl << strenght;
+    }
+
+}
+
+Start_men::Start_men(int x, int y, SDL_Surface* sprite)
+{
+    hp = 50;
+    strenght = 1;
+    int w = 32;
+    int h = 32;
+    Collider.x = x;
+    Collider.y = y;
+    Collider.w = w;
+    Collider.h = h;
+
+    down[0].x = 0;
+    down[0].y = 0;
+    down[0].w = w;
+    down[0].h = h;
+
+    down[1].x = 32;
+    down[1].y = 0;
+    down[1].w = w;
+    down[1].h = h;
+
+    down[2].x = 64;
+    down[2].y = 0;
+    down[2].w = w;
+    down[2].h = h;
+
+    left[0].x = 0;
+    left[0].y = 32;
+    left[0].w = w;
+    left[0].h = h;
+
+    left[1].x = 32;
+    left[1].y = 32;
+    left[1].w = w;
+    left[1].h = h;
+
+    left[2].x = 64;
+    left[2].y = 32;
+    left[2].w = w;
+    left[2].h = h;
+
+    right[0].x = 0;
+    right[0].y = 64;
+    right[0].w = w;
+    right[0].h = h;
+
+    right[1].x = 32;
+    right[1].y = 64;
+    right[1].w = w;
+    right[1].h = h;
+
+    right[2].x = 64;
+    right[2].y = 64;
+    right[2].w = w;
+    right[2].h = h;
+
+    up[0].x = 0;
+    up[0].y = 96;
+    up[0].w = w;
+    up[0].h = h;
+
+    up[1].x = 32;
+    up[1].y = 96;
+    up[1].w = w;
+    up[1].h = h;
+
+    up[2].x = 64;
+    up[2].y = 96;
+    up[2].w = w;
+    up[2].h = h;
+
+    frame = 0;
+
+    ismoving = false;
+
+    lastx = 0;
+    lasty = -1;
+
+    //server npcs are only positions, there is no renderer to give them a texture
+    if (gRenderer != NULL && (sprite == NULL || !npc_texture.loadFromSurface(sprite)))
+    {
+        load();
+    }
+
+}
+
+bool Start_men::load()
+{
+    //mandar.png
+    if (npc_texture.loadFromFile("Assets/oldman/old.png") == false)
+    {
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search NPC texture file. Please reinstall game :)", NULL);
+        printf("Failed to load old man texture\n");
+        return false;
+    }
+    else
+    {
+        return true;
+    }
+}
+
+void Start_men::render()
+{
+
+    SDL_Rect* current;
+
+    if (ismoving)
+    {
+
+        if (frame / 20 >= 3)
+        {
+            frame = 0;
+        }
+        else
+        {
+            if (lastx == -1)
+            {
+                current = &left[frame / 20];
+            }
+            else if (lasty == 1)
+            {
+                current = &up[frame / 20];
+            }
+            else
+            {
+                current = &down[frame / 20];
+            }
+
+            npc_texture.render(Collider.x, Collider.y, current);
+
+            frame++;
+        }
+    }
+    else
+    {
+        if (lastx == -1)
+        {
+            current = &left[0];
+        }
+        else if (lasty == 1)
+        {
+            current = &up[0];
+        }
+        else
+        {
+            current = &down[0];
+        }
+
+        npc_texture.render(Collider.x, Collider.y, current);
+
+    }
+
+}
+
+
+bool readDialog(std::string path, std::vector<std::string>& lines)
+{
+    std::string content;
+    if (!readAsset("Assets/dialog/" + path, content))
+    {
+        return false;
+    }
+
+    std::istringstream plik(content);
+    std::string linia;
+    while (std::getline(plik, linia))
+    {
+        if (!linia.empty() && linia.back() == '\r')
+        {
+            linia.pop_back();
+        }
+        lines.push_back(linia);
+    }
+    return true;
+}
+
+TimerWheel::TimerWheel()
+{
+    current = 0;
+    count = 0;
+    for (int level = 0; level < 4; level++)
+    {
+        occupied[level] = 0;
+        for (int slot = 0; slot < 64; slot++)
+            slots[level][slot] = NULL;
+    }
+}
+
+void TimerWheel::add(WheelTimer* timer, Uint32 due)
+{
+    if (timer->linked)
+        cancel(timer);
+
+    //the slot for the current tick has already been run, anything due fires on the next one
+    timer->due = due;
+    place(timer, current + 1);
+    count++;
+}
+
+void TimerWheel::place(WheelTimer* timer, Uint32 earliest)
+{
+    Uint32 due = (Sint32)(timer->due - earliest) > 0 ? timer->due : earliest;
+    Uint32 delta = due - current;
+
+    int level = 0;
+    if (delta >= (1u << 18))
+    {
+        level = 3;
+        if (delta >= (1u << 24))
+            due = current + (1u << 24) - 1;
+    }
+    else if (delta >= (1u << 12))
+        level = 2;
+    else if (delta >= (1u << 6))
+        level = 1;
+
+    int slot = (due >> (level * 6)) & 63;
+
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = slots[level][slot];
+    if (timer->next != NULL)
+        timer->next->prev = timer;
+    slots[level][slot] = timer;
+    occupied[level] |= 1ULL << slot;
+    timer->linked = true;
+}
+
+void TimerWheel::cancel(WheelTimer* timer)
+{
+    if (!timer->linked)
+        return;
+
+    if (timer->prev != NULL)
+    {
+        timer->prev->next = timer->next;
+    }
+    else
+    {
+        slots[timer->level][timer->slot] = timer->next;
+        if (timer->next == NULL)
+            occupied[timer->level] &= ~(1ULL << timer->slot);
+    }
+    if (timer->next != NULL)
+        timer->next->prev = timer->prev;
+
+    timer->linked = false;
+    count--;
+}
+
+void TimerWheel::cascade(int level)
+{
+    int slot = (current >> (level * 6)) & 63;
+    WheelTimer* timer = slots[level][slot];
+    slots[level][slot] = NULL;
+    occupied[level] &= ~(1ULL << slot);
+
+    while (timer != NULL)
+    {
+        WheelTimer* next = timer->next;
+        place(timer, current);
+        timer = next;
+    }
+}
+
+int TimerWheel::advance(Uint32 now)
+{
+    int fired = 0;
+
+    while ((Sint32)(now - current) > 0)
+    {
+        if (count == 0)
+        {
+            current = now;
+            break;
+        }
+
+        //nothing in the lowest level, skip straight to the tick before the next cascade
+        if (occupied[0] == 0 && (current & 63) != 63)
+        {
+            Uint32 edge = current | 63;
+            current = (Sint32)(now - edge) > 0 ? edge : now;
+            continue;
+        }
+
+        current++;
+        if ((current & 63) == 0)
+        {
+            if (((current >> 6) & 63) == 0)
+            {
+                if (((current >> 12) & 63) == 0)
+                    cascade(3);
+                cascade(2);
+            }
+            cascade(1);
+        }
+
+        int slot = current & 63;
+        while (slots[0][slot] != NULL)
+        {
+            WheelTimer* timer = slots[0][slot];
+            cancel(timer);
+            timer->fire(timer);
+            fired++;
+        }
+    }
+    return fired;
+}
+
+const int cutscene_block = 512;
+
+const int cutscene_blocks = 32;
+
+static Uint8 cutscene_pool[cutscene_blocks][cutscene_block];
+
+static void* cutscene_free[cutscene_blocks];
+
+static int cutscene_free_count = -1;
+
+//server instances start cutscenes from several threads at once
+static SDL_SpinLock cutscene_lock = 0;
+
+//cutscenes start mid-game, so their frames come from a fixed pool instead of the heap
+void* cutsceneAlloc(size_t size)
+{
+    void* frame = NULL;
+
+    SDL_AtomicLock(&cutscene_lock);
+    if (cutscene_free_count < 0)
+    {
+        for (int i = 0; i < cutscene_blocks; i++)
+            cutscene_free[i] = cutscene_pool[i];
+        cutscene_free_count = cutscene_blocks;
+    }
+
+    if (size <= cutscene_block && cutscene_free_count > 0)
+        frame = cutscene_free[--cutscene_free_count];
+    SDL_AtomicUnlock(&cutscene_lock);
+
+    return frame != NULL ? frame : ::operator new(size);
+}
+
+void cutsceneFree(void* frame, size_t size)
+{
+    if (frame >= (void*)cutscene_pool && frame < (void*)(cutscene_pool + cutscene_blocks))
+    {
+        SDL_AtomicLock(&cutscene_lock);
+        cutscene_free[cutscene_free_count++] = frame;
+        SDL_AtomicUnlock(&cutscene_lock);
+    }
+    else
+        ::operator delete(frame, size);
+}
+
+Cutscene::Cutscene(std::coroutine_handle<promise_type> h)
+{
+    handle = h;
+}
+
+Cutscene::Cutscene(Cutscene&& other) noexcept
+{
+    handle = other.handle;
+    other.handle = nullptr;
+}
+
+Cutscene& Cutscene::operator=(Cutscene&& other) noexcept
+{
+    if (this != &other)
+    {
+        if (handle)
+            handle.destroy();
+        handle = other.handle;
+        other.handle = nullptr;
+    }
+    return *this;
+}
+
+Cutscene::~Cutscene()
+{
+    //destroying a suspended cutscene runs its awaiters' destructors, which unhook them from the scheduler
+    if (handle)
+        handle.destroy();
+}
+
+bool Cutscene::done()
+{
+    return !handle || handle.done();
+}
+
+static void wakeSleeper(WheelTimer* timer)
+{
+    std::coroutine_handle<>::from_address(timer->data).resume();
+}
+
+Sleep::Sleep(Scheduler* owner, Uint32 due)
+{
+    this->owner = owner;
+    timer.next = timer.prev = NULL;
+    timer.due = due;
+    timer.fire = wakeSleeper;
+    timer.data = NULL;
+    timer.linked = false;
+    timer.level = timer.slot = 0;
+}
+
+Sleep::~Sleep()
+{
+    owner->wheel.cancel(&timer);
+}
+
+bool Sleep::await_ready()
+{
+    return (Sint32)(timer.due - getTicks()) <= 0;
+}
+
+void Sleep::await_suspend(std::coroutine_handle<> h)
+{
+    timer.data = h.address();
+    owner->wheel.add(&timer, timer.due);
+}
+
+Until::Until(Scheduler* owner, bool (*done)(void* data), void* data)
+{
+    this->owner = owner;
+    this->done = done;
+    this->data = data;
+    queued = false;
+}
+
+Until::~Until()
+{
+    if (queued)
+        owner->waiting.erase(std::find(owner->waiting.begin(), owner->waiting.end(), this));
+}
+
+bool Until::await_ready()
+{
+    return done(data);
+}
+
+void Until::await_suspend(std::coroutine_handle<> h)
+{
+    waiting = h;
+    queued = true;
+    owner->waiting.push_back(this);
+}
+
+Arrive::Arrive(Scheduler* owner, SDL_Rect* body, int* lastx, int* lasty, bool* ismoving, int dx, int dy, int ms, int speed)
+{
+    this->owner = owner;
+    this->body = body;
+    this->lastx = lastx;
+    this->lasty = lasty;
+    this->ismoving = ismoving;
+    this->dx = dx > 0 ? 1 : dx < 0 ? -1 : 0;
+    this->dy = dy > 0 ? 1 : dy < 0 ? -1 : 0;
+    due = getTicks() + (Uint32)ms;
+    this->speed = speed > 0 ? speed : 1;
+    reached = 0;
+    queued = false;
+}
+
+Arrive::~Arrive()
+{
+    if (queued)
+        owner->movers.erase(std::find(owner->movers.begin(), owner->movers.end(), this));
+}
+
+bool Arrive::await_ready()
+{
+    return (dx == 0 && dy == 0) || (Sint32)(due - getTicks()) <= 0;
+}
+
+//a body walks for one cutscene at a time, the newest walk takes over and the older one ends on its next step
+void Arrive::await_suspend(std::coroutine_handle<> h)
+{
+    for (Arrive* mover : owner->movers)
+    {
+        if (mover->body == body)
+            mover->due = getTicks();
+    }
+
+    waiting = h;
+    queued = true;
+    reached = dx * body->x + dy * body->y;
+    owner->movers.push_back(this);
+}
+
+//one step in the walking direction; true once the time is up or the body was pushed back since the last step
+bool Arrive::step()
+{
+    int along = dx * body->x + dy * body->y;
+    if ((Sint32)(due - getTicks()) <= 0 || along < reached)
+    {
+        *ismoving = false;
+        return true;
+    }
+
+    body->x += dx * speed;
+    body->y += dy * speed;
+    reached = along + speed;
+    *ismoving = true;
+    *lastx = dx;
+    *lasty = -dy;
+    return false;
+}
+
+Scheduler::Scheduler()
+{
+    waiting.reserve(16);
+    movers.reserve(16);
+    cutscenes.reserve(16);
+    ready.reserve(32);
+}
+
+Scheduler::~Scheduler()
+{
+    cutscenes.clear();
+}
+
+static bool dialogClosed(void* data)
+{
+    return !((Dialog*)data)->active_dialog();
+}
+
+Sleep Scheduler::sleep(int ms)
+{
+    Uint32 now = getTicks();
+    if (wheel.count == 0)
+        wheel.current = now;
+    return Sleep(this, now + (Uint32)ms);
+}
+
+Until Scheduler::until(Dialog* dialog)
+{
+    return Until(this, dialogClosed, dialog);
+}
+
+void Scheduler::start(Cutscene cutscene)
+{
+    if (!cutscene.done())
+        cutscenes.push_back(std::move(cutscene));
+}
+
+bool Scheduler::moving(SDL_Rect* body)
+{
+    for (Arrive* mover : movers)
+    {
+        if (mover->body == body)
+            return true;
+    }
+    return false;
+}
+
+void Scheduler::update()
+{
+    wheel.advance(getTicks());
+
+    //resumed cutscenes may queue new awaiters, so take the ready ones out first
+    ready.clear();
+
+    for (size_t i = 0; i < movers.size();)
+    {
+        if (movers[i]->step())
+        {
+            movers[i]->queued = false;
+            ready.push_back(movers[i]->waiting);
+            movers.erase(movers.begin() + i);
+        }
+        else
+            i++;
+    }
+
+    for (size_t i = 0; i < waiting.size();)
+    {
+        if (waiting[i]->done(waiting[i]->data))
+        {
+            waiting[i]->queued = false;
+            ready.push_back(waiting[i]->waiting);
+            waiting.erase(waiting.begin() + i);
+        }
+        else
+            i++;
+    }
+
+    for (std::coroutine_handle<>& h : ready)
+        h.resume();
+
+    for (size_t i = 0; i < cutscenes.size();)
+    {
+        if (cutscenes[i].done())
+            cutscenes.erase(cutscenes.begin() + i);
+        else
+            i++;
+    }
+}
+
+Dialog::Dialog(std::string path)
+{
+    MemoryScope scope(MEMORY_DIALOG);
+
+    std::vector<std::string> lines;
+    if (!readDialog(path, lines))
+    {
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search dialog file. Please reinstall game :)", NULL);
+        printf("Dialog isn't working");
+    }
+    set(lines);
+}
+
+Dialog::Dialog(std::vector<std::string>& lines)
+{
+    MemoryScope scope(MEMORY_DIALOG);
+
+    set(lines);
+}
+
+void Dialog::set(std::vector<std::string>& lines)
+{
+    page = 0;
+    back.loadFromFile("Assets/Gui/dialog.png");
+    view = false;
+    i = 0;
+    for (size_t k = 0; k < lines.size() && i < 100; k++)
+    {
+        texts[i] = lines[k];
+        i++;
+    }
+    max_pages = ceil(i / 5);
+    pixels[0] = 600;
+    pixels[1] = 630;
+    pixels[2] = 660;
+    pixels[3] = 690;
+    pixels[4] = 720;
+}
+
+void Dialog::next_page(SDL_Event& e)
+{
+    if (e.type == SDL_KEYDOWN)
+    {
+        if (e.key.keysym.sym == SDLK_RETURN)
+        {
+            if (view)
+                gAudio.play(SOUND_BLIP, 0);
+            if (page + 1 <= max_pages)
+                page++;
+            else
+                view = false;
+        }
+    }
+}
+
+void Dialog::start()
+{
+    view = true;
+    autoplay = play();
+}
+
+//turns a page every 5 seconds and hides the dialog 5 seconds after the last one
+Cutscene Dialog::play()
+{
+    while (view)
+    {
+        co_await gScheduler.sleep(5000);
+
+        if (page + 1 <= max_pages)
+        {
+            page++;
+            if (view)
+                gAudio.play(SOUND_BLIP, 0);
+        }
+        else
+        {
+            view = false;
+        }
+    }
+}
+
+
+void Dialog::draw()
+{
+    MemoryScope scope(MEMORY_DIALOG);
+
+    if (view)
+    {
+        back.render(0, 600);
+        int ile = (page + 1) * 5;
+        if (ile > i)
+        {
+            int r = ile - i;
+            ile -= r;
+        }
+        int k = 0;
+        for (int j = page * 5; j < ile; j++)
+        {
+            if (DrawList::recording() != NULL)
+            {
+                DrawList::recording()->text(texts[j].c_str(), 0, pixels[k]);
+            }
+            else
+            {
+                text.loadFromRenderedText(texts[j], white);
+                text.render(0, pixels[k]);
+            }
+            k++;
+        }
+    }
+}
+
+bool Dialog::active_dialog()
+{
+    return view;
+}
+
+Widget::Widget()
+{
+    Collider.x = Collider.y = Collider.w = Collider.h = 0;
+    drawn = Collider;
+    visible = true;
+    placed = false;
+    dirty = true;
+}
+
+Widget::~Widget()
+{
+}
+
+int Widget::handleEvent(SDL_Event*)
+{
+    return 0;
+}
+
+void Widget::setPosistion(int x, int y)
+{
+    Collider.x = x;
+    Collider.y = y;
+    placed = true;
+    dirty = true;
+}
+
+void Widget::setVisible(bool v)
+{
+    if (visible != v)
+    {
+        visible = v;
+        dirty = true;
+    }
+}
+
+bool Widget::contains(int x, int y)
+{
+    return visible && x >= Collider.x && x <= Collider.x + Collider.w && y >= Collider.y && y <= Collider.y + Collider.h;
+}
+
+void Widget::invalidate()
+{
+    dirty = true;
+}
+
+bool Widget::changed()
+{
+    bool was_dirty = dirty;
+    dirty = false;
+    return was_dirty;
+}
+
+Label::Label(std::string t, int x, int y)
+{
+    setPosistion(x, y);
+    setText(t);
+}
+
+void Label::setText(std::string t)
+{
+    if (t == text && texture.getWidth() > 0)
+    {
+        return;
+    }
+
+    text = t;
+    texture.loadFromRenderedText(text, white);
+    Collider.w = texture.getWidth();
+    Collider.h = texture.getHeight();
+    dirty = true;
+}
+
+void Label::render()
+{
+    texture.render(Collider.x, Collider.y);
+}
+
+Input::Input(int x, int y)
+{
+    write = false;
+    text.reserve(64);
+    text = "some text";
+    setPosistion(x, y);
+    update();
+}
+
+void Input::update()
+{
+    if (text != "")
+    {
+        texttexture.loadFromRenderedText(text.c_str(), white);
+    }
+    else
+    {
+        texttexture.loadFromRenderedText(" ", white);
+    }
+
+    Collider.w = texttexture.getWidth() + 20;
+    Collider.h = texttexture.getHeight() + 20;
+    dirty = true;
+}
+
+int Input::handleEvent(SDL_Event* e)
+{
+    if (e->type == SDL_MOUSEBUTTONDOWN)
+    {
+        bool yes = contains(e->button.x, e->button.y);
+        if (yes != write)
+        {
+            write = yes;
+            dirty = true;
+        }
+    }
+
+    if (e->type == SDL_TEXTINPUT && write == true)
+    {
+        text += e->text.text;
+        update();
+    }
+    if (e->type == SDL_KEYDOWN && e->key.keysym.sym == SDLK_BACKSPACE && text.length() > 0 && write == true)
+    {
+        text = text.substr(0, text.length() - 1);
+        update();
+    }
+
+    return 0;
+}
+
+void Input::render()
+{
+    texttexture.render(Collider.x + 10, Collider.y + 10);
+
+    if (write)
+    {
+        SDL_SetRenderDrawColor(gRenderer, 232, 28, 255, 255);
+    }
+    else
+    {
+
+        SDL_SetRenderDrawColor(gRenderer, 227, 117, 240, 255);
+    }
+
+    SDL_RenderDrawRect(gRenderer, &Collider);
+
+}
+
+
+Button::Button(std::string pathin, std::string pathout)
+{
+    if (mousein.loadFromFile(pathin) == false || mouseuot.loadFromFile(pathout) == false)
+    {
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search someone of button texture. Please reinstall game :)", NULL);
+        exit(0);
+    }
+
+    Collider.w = mousein.getWidth();
+    Collider.h = mousein.getHeight();
+
+    inside = false;
+}
+
+int Button::handleEvent(SDL_Event* e)
+{
+    int klik = 0;
+
+    if (e->type == SDL_MOUSEMOTION || e->type == SDL_MOUSEBUTTONDOWN || e->type == SDL_MOUSEBUTTONUP)
+    {
+        bool was_inside = inside;
+
+        if (e->type == SDL_MOUSEMOTION)
+        {
+            inside = contains(e->motion.x, e->motion.y);
+        }
+        else
+        {
+            inside = contains(e->button.x, e->button.y);
+        }
+
+        if (inside != was_inside)
+        {
+            dirty = true;
+        }
+
+        if (inside && e->type == SDL_MOUSEBUTTONDOWN)
+        {
+            klik = 1;
+            gAudio.play(SOUND_CLICK, 1);
+        }
+
+    }
+    return klik;
+}
+
+void Button::render()
+{
+    if (inside)
+    {
+        mouseuot.render(Collider.x, Collider.y);
+    }
+    else
+    {
+        mousein.render(Collider.x, Collider.y);
+    }
+}
+
+Button::~Button()
+{
+    mousein.free();
+    mouseuot.free();
+}
+
+Eq::Eq(Player *p)
+{
+    visible = false;
+    if (!eq.loadFromFile("Assets/Gui/UIEQ.png"))
+    {
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search UI image file. Please reinstall game :)", NULL);
+        printf("EQ UI graphics load failed");
+    }
+        
+
+    nickname.loadFromRenderedText("Nazwa: "+p->nick, white);
+    hp.loadFromRenderedText("Punkty zycia: "+std::to_string(p->health), white);
+    power.loadFromRenderedText("Sila: "+std::to_string(p->strenght), white);
+
+    setPosistion(0, 0);
+    Collider.w = eq.getWidth();
+    Collider.h = eq.getHeight();
+}
+
+Eq::~Eq()
+{
+    eq.free();
+    nickname.free();
+    hp.free();
+    power.free();
+}
+
+void Eq::render()
+{
+    if (visible)
+    {
+        eq.render(Collider.x, Collider.y);
+        nickname.render(Collider.x + 5, Collider.y + 5);
+        hp.render(Collider.x + 5, Collider.y + 45);
+        power.render(Collider.x + 5, Collider.y + 85);
+    }
+}
+
+int Eq::handleEvent(SDL_Event* e)
+{
+    if (e->type == SDL_KEYDOWN && e->key.keysym.sym == SDLK_e)
+    {
+        setVisible(!visible);
+    }
+    return 0;
+}
+
+Ui::Ui(Texture* bg)
+{
+    MemoryScope scope(MEMORY_UI);
+
+    background = bg;
+    hovered = NULL;
+    focused = NULL;
+    canvas = NULL;
+    full = true;
+    stale = true;
+}
+
+Ui::~Ui()
+{
+    if (canvas != NULL)
+    {
+        SDL_DestroyTexture(canvas);
+        gMemory.removeTexture(MEMORY_UI, screen_width * screen_height * 4);
+    }
+}
+
+void Ui::add(Widget* w)
+{
+    widgets.push_back(w);
+    stale = true;
+}
+
+void Ui::column(int top, int gap)
+{
+    int y = top;
+
+    for (Widget* w : widgets)
+    {
+        if (!w->placed)
+        {
+            w->Collider.x = (screen_width - w->Collider.w) / 2;
+            w->Collider.y = y;
+            w->dirty = true;
+            y += w->Collider.h + gap;
+        }
+    }
+
+    stale = true;
+}
+
+void Ui::index()
+{
+    //horizontal bands between widget edges, each holding the widgets that cover it, for binary-searched hit tests
+    edges.clear();
+    bands.clear();
+
+    for (Widget* w : widgets)
+    {
+        if (w->visible)
+        {
+            edges.push_back(w->Collider.y);
+            edges.push_back(w->Collider.y + w->Collider.h + 1);
+        }
+    }
+
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+    for (size_t i = 0; i + 1 < edges.size(); i++)
+    {
+        bands.push_back(std::vector<Widget*>());
+        for (Widget* w : widgets)
+        {
+            if (w->visible && w->Collider.y <= edges[i] && w->Collider.y + w->Collider.h + 1 >= edges[i + 1])
+            {
+                bands.back().push_back(w);
+            }
+        }
+    }
+
+    stale = false;
+}
+
+Widget* Ui::hit(int x, int y)
+{
+    if (stale)
+    {
+        index();
+    }
+
+    size_t band = std::upper_bound(edges.begin(), edges.end(), y) - edges.begin();
+
+    if (band == 0 || band > bands.size())
+    {
+        return NULL;
+    }
+
+    std::vector<Widget*>& candidates = bands[band - 1];
+
+    for (size_t i = candidates.size(); i > 0; i--)
+    {
+        if (candidates[i - 1]->contains(x, y))
+        {
+            return candidates[i - 1];
+        }
+    }
+
+    return NULL;
+}
+
+Widget* Ui::route(SDL_Event* e)
+{
+    Widget* target = NULL;
+
+    switch (e->type)
+    {
+    case SDL_MOUSEMOTION:
+        target = hit(e->motion.x, e->motion.y);
+        if (hovered != NULL && hovered != target)
+        {
+            hovered->handleEvent(e);
+        }
+        if (target != NULL)
+        {
+            target->handleEvent(e);
+        }
+        hovered = target;
+        return NULL;
+    case SDL_MOUSEBUTTONDOWN:
+    case SDL_MOUSEBUTTONUP:
+        target = hit(e->button.x, e->button.y);
+        if (e->type == SDL_MOUSEBUTTONDOWN && focused != NULL && focused != target)
+        {
+            focused->handleEvent(e);
+        }
+        if (target == NULL)
+        {
+            if (e->type == SDL_MOUSEBUTTONDOWN)
+            {
+                focused = NULL;
+            }
+            return NULL;
+        }
+        if (e->type == SDL_MOUSEBUTTONDOWN)
+        {
+            focused = target;
+        }
+        return target->handleEvent(e) == 1 ? target : NULL;
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:
+    case SDL_TEXTINPUT:
+        if (focused != NULL && focused->handleEvent(e) == 1)
+        {
+            return focused;
+        }
+        return NULL;
+    case SDL_WINDOWEVENT:
+    case SDL_RENDER_TARGETS_RESET:
+        full = true;
+        return NULL;
+    default:
+        return NULL;
+    }
+}
+
+bool Ui::dirty()
+{
+    if (full)
+    {
+        return true;
+    }
+
+    for (Widget* w : widgets)
+    {
+        if (w->dirty)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool Ui::draw()
+{
+    MemoryScope scope(MEMORY_UI);
+
+    std::vector<SDL_Rect> rects;
+
+    for (Widget* w : widgets)
+    {
+        if (w->dirty)
+        {
+            SDL_Rect area;
+            SDL_UnionRect(&w->drawn, &w->Collider, &area);
+            area.w++;
+            area.h++;
+            rects.push_back(area);
+            stale = true;
+        }
+    }
+
+    if (rects.empty() && !full)
+    {
+        return false;
+    }
+
+    if (canvas == NULL)
+    {
+        canvas = SDL_CreateTexture(gRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, screen_width, screen_height);
+        if (canvas != NULL)
+            gMemory.addTexture(MEMORY_UI, screen_width * screen_height * 4);
+        full = true;
+    }
+
+    //without a canvas to keep, everything is drawn straight to the back buffer and the canvas is rebuilt once it works again
+    bool direct = canvas == NULL || SDL_SetRenderTarget(gRenderer, canvas) != 0;
+    if (direct)
+    {
+        full = true;
+    }
+
+    if (full)
+    {
+        rects.clear();
+        SDL_Rect screen = { 0, 0, screen_width, screen_height };
+        rects.push_back(screen);
+    }
+
+    for (SDL_Rect& r : rects)
+    {
+        SDL_RenderSetClipRect(gRenderer, &r);
+
+        //SDL_RenderClear ignores the clip rect, so only the dirty area is filled
+        SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
+        SDL_RenderFillRect(gRenderer, &r);
+
+        if (background != NULL)
+        {
+            background->render(0, 0);
+        }
+
+        for (Widget* w : widgets)
+        {
+            if (w->visible && SDL_HasIntersection(&w->Collider, &r))
+            {
+                w->render();
+            }
+        }
+    }
+
+    SDL_RenderSetClipRect(gRenderer, NULL);
+
+    if (!direct)
+    {
+        SDL_SetRenderTarget(gRenderer, NULL);
+        SDL_RenderCopy(gRenderer, canvas, NULL, NULL);
+    }
+
+    present();
+
+    for (Widget* w : widgets)
+    {
+        w->dirty = false;
+        w->drawn = w->Collider;
+    }
+
+    full = direct;
+
+    return true;
+}
+
+//no level ships a music track yet, an empty path plays silence
+const LevelInfo levels_registry[] =
+{
+    { 1, "Assets/m1.txt", "Assets/m1_coll.txt", "prolog.txt", "Assets/oldman/old.png", "", "Assets/scripts/m1.lsc", false },
+};
+
+LevelAssets::LevelAssets()
+{
+    id = 0;
+    npc = NULL;
+    loaded = false;
+    ground.fill(1);
+}
+
+LevelAssets::~LevelAssets()
+{
+    if (npc != NULL)
+    {
+        SDL_FreeSurface(npc);
+    }
+}
+
+bool LevelAssets::load(const LevelInfo* info)
+{
+    MemoryScope scope(MEMORY_TILEMAP);
+
+    std::string content;
+
+    id = info->id;
+    loaded = true;
+
+    if (readAsset(info->ground, content))
+    {
+        parseLayer(content, ground);
+    }
+    else
+    {
+        printf("Cannot read map %s\n", info->ground.c_str());
+        loaded = false;
+    }
+
+    if (readAsset(info->objects, content))
+    {
+        parseLayer(content, objects);
+    }
+    else
+    {
+        printf("Cannot read map %s\n", info->objects.c_str());
+        loaded = false;
+    }
+
+    {
+        MemoryScope dialog_scope(MEMORY_DIALOG);
+        if (!readDialog(info->dialog, dialog))
+        {
+            printf("Cannot read dialog %s\n", info->dialog.c_str());
+            loaded = false;
+        }
+    }
+
+    if (info->npc != "")
+    {
+        npc = IMG_Load_RW(openAsset(info->npc), 1);
+        if (npc == NULL)
+        {
+            printf("Unable to load image %s! SDL_image Error: %s\n", info->npc.c_str(), IMG_GetError());
+        }
+    }
+
+    if (info->script != "" && !loadScript(info->script, script))
+    {
+        printf("Cannot read level script %s\n", info->script.c_str());
+        loaded = false;
+    }
+
+    return loaded;
+}
+
+Levels::Levels()
+{
+    next = NULL;
+    current = NULL;
+    thread = NULL;
+}
+
+Levels::~Levels()
+{
+    wait();
+    delete next;
+    delete current;
+}
+
+const LevelInfo* Levels::find(int id)
+{
+    for (const LevelInfo& info : levels_registry)
+    {
+        if (info.id == id)
+        {
+            return &info;
+        }
+    }
+    return NULL;
+}
+
+int Levels::worker(void* data)
+{
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+
+    LevelAssets* level = (LevelAssets*)data;
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    level->load(Levels::find(level->id));
+
+    printf("Level %d preloaded in %.1f ms\n", level->id, (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency());
+    return 0;
+}
+
+void Levels::wait()
+{
+    if (thread != NULL)
+    {
+        SDL_WaitThread(thread, NULL);
+        thread = NULL;
+    }
+}
+
+void Levels::preload(int id)
+{
+    if (find(id) == NULL || (next != NULL && next->id == id))
+    {
+        return;
+    }
+
+    wait();
+    delete next;
+
+    next = new LevelAssets();
+    next->id = id;
+
+    thread = SDL_CreateThread(worker, "level preload", next);
+    if (thread == NULL)
+    {
+        next->load(find(id));
+    }
+}
+
+LevelAssets* Levels::take(int id)
+{
+    const LevelInfo* info = find(id);
+
+    if (info == NULL)
+    {
+        return NULL;
+    }
+
+    if (next == NULL || next->id != id)
+    {
+        preload(id);
+    }
+
+    wait();
+
+    delete current;
+    current = next;
+    next = NULL;
+
+    return current;
+}
+
+Rewind::Rewind(int bytes)
+{
+    capacity = bytes;
+    buffer = new Uint8[capacity];
+    head = tail = used = frames = peak = largest = dropped = 0;
+    has_last = false;
+    record_time = 0;
+    records = 0;
+    combat = NULL;
+    turn = NULL;
+    for (int i = 0; i < 16; i++)
+    {
+        last[i] = 0;
+    }
+}
+
+//a fight keeps its own ring and starts it empty, it also rewinds whose turn it is and the casts left
+void Rewind::attach(Combat* c, bool* turn)
+{
+    combat = c;
+    this->turn = turn;
+    head = tail = used = frames = 0;
+    has_last = false;
+}
+
+Rewind::~Rewind()
+{
+    delete[] buffer;
+}
+
+void Rewind::capture(Player* p, NPC* npc, int* values)
+{
+    values[0] = p->Collider.x;
+    values[1] = p->Collider.y;
+    values[2] = p->lastx;
+    values[3] = p->lasty;
+    values[4] = p->ismoving;
+    values[5] = p->health;
+    values[6] = p->strenght;
+    values[7] = npc->Collider.x;
+    values[8] = npc->Collider.y;
+    values[9] = npc->lastx;
+    values[10] = npc->lasty;
+    values[11] = npc->ismoving;
+    values[12] = npc->hp;
+    values[13] = turn != NULL ? *turn : 0;
+    values[14] = combat != NULL ? combat->player.casts : 0;
+    values[15] = combat != NULL ? combat->enemy.casts : 0;
+}
+
+void Rewind::apply(Player* p, NPC* npc)
+{
+    p->Collider.x = last[0];
+    p->Collider.y = last[1];
+    p->lastx = last[2];
+    p->lasty = last[3];
+    p->ismoving = last[4] != 0;
+    p->health = last[5];
+    p->strenght = last[6];
+    npc->Collider.x = last[7];
+    npc->Collider.y = last[8];
+    npc->lastx = last[9];
+    npc->lasty = last[10];
+    npc->ismoving = last[11] != 0;
+    npc->hp = last[12];
+    if (turn != NULL)
+        *turn = last[13] != 0;
+    if (combat != NULL)
+    {
+        combat->player.casts = last[14];
+        combat->enemy.casts = last[15];
+    }
+}
+
+void Rewind::push(Uint8* data, int len)
+{
+    while (used + len > capacity && frames > 0)
+    {
+        if (frames < rewind_seconds * 60)
+            dropped++;
+        int old = buffer[tail];
+        tail = (tail + old) % capacity;
+        used -= old;
+        frames--;
+    }
+
+    for (int i = 0; i < len; i++)
+    {
+        buffer[head] = data[i];
+        head = (head + 1) % capacity;
+    }
+
+    used += len;
+    frames++;
+
+    if (used > peak)
+    {
+        peak = used;
+    }
+    if (len > largest)
+    {
+        largest = len;
+    }
+}
+
+int Rewind::pop(Uint8* data)
+{
+    if (frames == 0)
+    {
+        return 0;
+    }
+
+    int len = buffer[(head - 1 + capacity) % capacity];
+    head = (head - len + capacity) % capacity;
+
+    for (int i = 0; i < len; i++)
+    {
+        data[i] = buffer[(head + i) % capacity];
+    }
+
+    used -= len;
+    frames--;
+
+    return len;
+}
+
+void Rewind::record(Player* p, NPC* npc)
+{
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    int values[16];
+    capture(p, npc, values);
+
+    if (has_last)
+    {
+        //[len][mask][mask][zigzag varint of (previous - current) per changed field][len]
+        Uint8 data[rewind_frame_max];
+        int len = 3;
+        int mask = 0;
+
+        for (int i = 0; i < 16; i++)
+        {
+            if (values[i] != last[i])
+            {
+                mask |= 1 << i;
+                Uint32 delta = (Uint32)(last[i] - values[i]);
+                Uint32 zigzag = (delta << 1) ^ (Uint32)((Sint32)delta >> 31);
+                while (zigzag >= 0x80)
+                {
+                    data[len++] = (Uint8)(zigzag | 0x80);
+                    zigzag >>= 7;
+                }
+                data[len++] = (Uint8)zigzag;
+                last[i] = values[i];
+            }
+        }
+
+        data[len++] = 0;
+        data[0] = data[len - 1] = (Uint8)len;
+        data[1] = mask & 0xFF;
+        data[2] = mask >> 8;
+
+        push(data, len);
+    }
+    else
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            last[i] = values[i];
+        }
+        has_last = true;
+    }
+
+    record_time += SDL_GetPerformanceCounter() - start;
+    records++;
+}
+
+bool Rewind::step_back(Player* p, NPC* npc)
+{
+    Uint8 data[rewind_frame_max];
+
+    if (!has_last || pop(data) == 0)
+    {
+        return false;
+    }
+
+    int mask = data[1] | (data[2] << 8);
+    int k = 3;
+
+    for (int i = 0; i < 16; i++)
+    {
+        if (mask & (1 << i))
+        {
+            Uint32 zigzag = 0;
+            int shift = 0;
+            while (data[k] & 0x80)
+            {
+                zigzag |= (Uint32)(data[k++] & 0x7F) << shift;
+                shift += 7;
+            }
+            zigzag |= (Uint32)data[k++] << shift;
+            last[i] += (Sint32)((zigzag >> 1) ^ (0 - (zigzag & 1)));
+        }
+    }
+
+    apply(p, npc);
+
+    return true;
+}
+
+bool Rewind::held()
+{
+    const Uint8* keys = getKeyboardState();
+
+    return keys[SDL_SCANCODE_R] != 0;
+}
+
+bool Rewind::empty()
+{
+    return !has_last || frames == 0;
+}
+
+void Rewind::report()
+{
+    double us = 0;
+
+    if (records > 0)
+    {
+        us = record_time * 1000000.0 / SDL_GetPerformanceFrequency() / records;
+    }
+
+    printf("Rewind: %d frames (~%.1f s at 60 fps), %d/%d bytes, peak %d, largest frame %d bytes, %.2f us per snapshot\n", frames, frames / 60.0, used, capacity, peak, largest, us);
+
+    if (dropped > 0)
+    {
+        printf("Rewind: %d frames dropped with less than %d s of history, %d bytes do not hold %d s of %d byte frames\n", dropped, rewind_seconds, capacity, rewind_seconds, largest);
+    }
+}
+
+Combat::Combat()
+{
+    set(0, 0, 0, 0);
+    start();
+}
+
+void Combat::start(Uint64 seed, int spread)
+{
+    this->spread = spread;
+    state = seed;
+    turns = 0;
+    player_hit = 0;
+    enemy_hit = 0;
+    fled = false;
+    player.casts = 1;
+    enemy.casts = 1;
+}
+
+void Combat::reseed(Uint64 seed)
+{
+    state = seed;
+}
+
+void Combat::set(int player_hp, int player_strength, int enemy_hp, int enemy_strength)
+{
+    player.hp = player_hp;
+    player.strength = player_strength;
+    enemy.hp = enemy_hp;
+    enemy.strength = enemy_strength;
+}
+
+int Combat::roll(int strength)
+{
+    if (spread <= 0 || strength <= 0)
+    {
+        return strength;
+    }
+
+    //splitmix64, so every seed gives an independent battle
+    state += 0x9E3779B97F4A7C15ULL;
+    Uint64 z = state;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+
+    int percent = 100 - spread + (int)(z % (Uint64)(2 * spread + 1));
+    int damage = (strength * percent + 50) / 100;
+
+    return damage > 0 ? damage : 1;
+}
+
+void Combat::attack()
+{
+    //the enemy always answers, even with its last breath, as it did in the original fight loop
+    playerAct(ACTION_ATTACK);
+    enemyAct(ACTION_ATTACK);
+
+    turns++;
+}
+
+void Combat::playerAct(int action)
+{
+    player_hit = act(player, enemy, action);
+}
+
+void Combat::enemyAct(int action)
+{
+    enemy_hit = act(enemy, player, action);
+}
+
+bool Combat::legal(const Combatant& side, int action)
+{
+    return action != ACTION_CAST || side.casts > 0;
+}
+
+int Combat::act(Combatant& from, Combatant& to, int action)
+{
+    int hit = 0;
+
+    if (action == ACTION_RETREAT)
+    {
+        fled = true;
+    }
+    else if (action == ACTION_CAST && from.casts > 0)
+    {
+        //one spell per fight, hitting twice as hard as a plain attack
+        from.casts--;
+        hit = roll(from.strength * 2);
+    }
+    else
+    {
+        hit = roll(from.strength);
+    }
+
+    to.hp -= hit;
+    return hit;
+}
+
+bool Combat::over()
+{
+    return player.hp <= 0 || enemy.hp <= 0 || fled;
+}
+
+bool Combat::won()
+{
+    return enemy.hp <= 0;
+}
+
+struct CombatSetup
+{
+    int player_hp, player_strength, enemy_hp, enemy_strength;
+};
+
+const CombatSetup combat_setups[] =
+{
+    { 20, 1, 50, 1 }, { 20, 2, 50, 1 }, { 20, 3, 50, 1 }, { 20, 5, 50, 1 },
+    { 40, 1, 50, 2 }, { 40, 2, 50, 2 }, { 40, 3, 50, 2 }, { 40, 5, 50, 2 },
+    { 60, 2, 50, 3 }, { 60, 3, 50, 3 }, { 60, 5, 50, 3 }, { 60, 8, 50, 3 },
+    { 100, 3, 80, 4 }, { 100, 5, 80, 4 }, { 100, 8, 80, 4 }, { 100, 10, 80, 4 }
+};
+
+const int combat_setup_count = sizeof(combat_setups) / sizeof(combat_setups[0]);
+
+const int combat_turn_limit = 1000;
+
+const int combat_turn_buckets = 128;
+
+struct CombatTally
+{
+    Uint64 battles, wins, fled, turns;
+    Uint64 histogram[combat_turn_buckets];
+};
+
+struct CombatJob
+{
+    int first, count;
+    Uint64 seed;
+    int spread;
+    CombatTally tally[combat_setup_count];
+};
+
+static Uint64 nextRandom(Uint64& state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+//the player is modelled as someone who fires the spell at a random moment and otherwise attacks
+static int playerPolicy(Combat& game, Uint64& random)
+{
+    if (game.player.casts > 0 && nextRandom(random) % 3 == 0)
+        return ACTION_CAST;
+    return ACTION_ATTACK;
+}
+
+//a cheap stand-in for the fight's search: the spell when it finishes the player or the enemy is behind, running when the next hit would kill it
+static int enemyPolicy(Combat& game)
+{
+    if (game.enemy.casts > 0 && (game.player.hp <= game.enemy.strength * 2 || game.enemy.hp < game.player.hp))
+        return ACTION_CAST;
+    if (game.enemy.hp <= game.player.strength)
+        return ACTION_RETREAT;
+    return ACTION_ATTACK;
+}
+
+static int combatWorker(void* data)
+{
+    CombatJob* job = (CombatJob*)data;
+    Combat combat;
+
+    for (int s = 0; s < combat_setup_count; s++)
+    {
+        const CombatSetup& setup = combat_setups[s];
+        CombatTally& tally = job->tally[s];
+
+        for (int i = job->first; i < job->first + job->count; i++)
+        {
+            combat.set(setup.player_hp, setup.player_strength, setup.enemy_hp, setup.enemy_strength);
+            Uint64 seed = hashBytes(&i, sizeof(i), hashBytes(&s, sizeof(s), job->seed));
+            Uint64 random = hashBytes(&seed, sizeof(seed), 0) | 1;
+            combat.start(seed, job->spread);
+
+            //turns play out as in Fight::fight, the player moves first and a beaten enemy does not answer
+            while (!combat.over() && combat.turns < combat_turn_limit)
+            {
+                combat.playerAct(playerPolicy(combat, random));
+                if (!combat.over())
+                    combat.enemyAct(enemyPolicy(combat));
+                combat.turns++;
+            }
+
+            tally.battles++;
+            tally.turns += combat.turns;
+            if (combat.won())
+                tally.wins++;
+            if (combat.fled)
+                tally.fled++;
+            tally.histogram[combat.turns < combat_turn_buckets - 1 ? combat.turns : combat_turn_buckets - 1]++;
+        }
+    }
+    return 0;
+}
+
+void simulateCombat(int battles, Uint64 seed, int spread)
+{
+    int workers = SDL_GetCPUCount();
+    if (workers < 1)
+        workers = 1;
+    if (workers > battles)
+        workers = battles;
+
+    std::vector<CombatJob> jobs(workers);
+    std::vector<SDL_Thread*> threads(workers);
+
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    int first = 0;
+    for (int w = 0; w < workers; w++)
+    {
+        SDL_memset(&jobs[w], 0, sizeof(CombatJob));
+        jobs[w].first = first;
+        jobs[w].count = battles / workers + (w < battles % workers ? 1 : 0);
+        jobs[w].seed = seed;
+        jobs[w].spread = spread;
+        first += jobs[w].count;
+
+        threads[w] = SDL_CreateThread(combatWorker, "combat", &jobs[w]);
+        if (threads[w] == NULL)
+        {
+            combatWorker(&jobs[w]);
+        }
+    }
+
+    for (int w = 0; w < workers; w++)
+    {
+        if (threads[w] != NULL)
+            SDL_WaitThread(threads[w], NULL);
+    }
+
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    printf("Simulated %d battles for each of %d setups on %d threads in %.2f s (seed %llu, spread %d%%)\n", battles, combat_setup_count, workers, seconds, (unsigned long long)seed, spread);
+
+    for (int s = 0; s < combat_setup_count; s++)
+    {
+        CombatTally total;
+        SDL_memset(&total, 0, sizeof(total));
+
+        for (int w = 0; w < workers; w++)
+        {
+            total.battles += jobs[w].tally[s].battles;
+            total.wins += jobs[w].tally[s].wins;
+            total.fled += jobs[w].tally[s].fled;
+            total.turns += jobs[w].tally[s].turns;
+            for (int b = 0; b < combat_turn_buckets; b++)
+                total.histogram[b] += jobs[w].tally[s].histogram[b];
+        }
+
+        int percentiles[3] = { 10, 50, 90 };
+        int found[3] = { 0, 0, 0 };
+        int longest = 0;
+        Uint64 seen = 0;
+        int p = 0;
+        for (int b = 0; b < combat_turn_buckets; b++)
+        {
+            seen += total.histogram[b];
+            while (p < 3 && seen * 100 >= total.battles * percentiles[p])
+                found[p++] = b;
+            if (total.histogram[b] != 0)
+                longest = b;
+        }
+
+        const CombatSetup& setup = combat_setups[s];
+        printf("Player %d hp %d str vs enemy %d hp %d str: %.2f%% wins, %.2f%% fled, %.2f turns average, p10 %d, p50 %d, p90 %d, max %d%s\n",
+            setup.player_hp, setup.player_strength, setup.enemy_hp, setup.enemy_strength,
+            100.0 * total.wins / total.battles, 100.0 * total.fled / total.battles, (double)total.turns / total.battles,
+            found[0], found[1], found[2], longest, longest == combat_turn_buckets - 1 ? "+" : "");
+
+        printf("  turns:");
+        for (int b = 0; b < combat_turn_buckets; b++)
+        {
+            if (total.histogram[b] != 0)
+                printf(" %d=%llu", b, (unsigned long long)total.histogram[b]);
+        }
+        printf("\n");
+    }
+}
+
+const int combat_search_nodes = 32768;
+
+const int combat_search_depth = 64;
+
+static int randomAction(Combat& game, Uint64& random)
+{
+    int action;
+    do
+    {
+        action = (int)(nextRandom(random) % ACTION_COUNT);
+    } while (!game.legal(game.enemy, action));
+    return action;
+}
+
+//from the enemy's side: killing the player is best, getting away alive is better than dying
+static float combatReward(Combat& game)
+{
+    if (game.enemy.hp <= 0)
+        return 0.0f;
+    if (game.player.hp <= 0)
+        return 1.0f;
+    if (game.fled)
+        return 0.35f;
+    return 0.5f;
+}
+
+//a recorded or replayed fight searches a fixed number of playouts instead of a wall clock budget
+const Uint64 combat_replay_playouts = 20000;
+
+const Uint64 combat_replay_seed = 0x5EED;
+
+CombatAI::CombatAI()
+{
+    workers = SDL_GetCPUCount() - 1;
+    if (workers < 1)
+        workers = 1;
+
+    thinking = false;
+    playouts = 0;
+    trees = 0;
+    due = 0;
+    quit = false;
+    done = SDL_CreateSemaphore(0);
+
+    SDL_AtomicSet(&finished, 0);
+    SDL_AtomicSet(&stop, 0);
+
+    //the workers live as long as the fight and sleep on their semaphore between turns
+    searches.resize(workers);
+    for (int w = 0; w < workers; w++)
+    {
+        searches[w].ai = this;
+        searches[w].nodes.resize(combat_search_nodes);
+        searches[w].playouts = 0;
+        searches[w].limit = 0;
+        searches[w].go = SDL_CreateSemaphore(0);
+        searches[w].thread = SDL_CreateThread(worker, "combat ai", &searches[w]);
+        if (searches[w].thread == NULL)
+        {
+            printf("Cannot start combat AI worker, it will search on the calling thread! SDL Error: %s\n", SDL_GetError());
+        }
+    }
+}
+
+CombatAI::~CombatAI()
+{
+    if (thinking)
+    {
+        SDL_AtomicSet(&stop, 1);
+        decide();
+    }
+
+    quit = true;
+    for (CombatSearch& s : searches)
+    {
+        if (s.thread != NULL)
+        {
+            SDL_SemPost(s.go);
+            SDL_WaitThread(s.thread, NULL);
+        }
+        SDL_DestroySemaphore(s.go);
+    }
+    SDL_DestroySemaphore(done);
+}
+
+void CombatAI::think(Combat& combat, int budget)
+{
+    if (thinking)
+    {
+        SDL_AtomicSet(&stop, 1);
+        decide();
+    }
+
+    SDL_AtomicSet(&finished, 0);
+    SDL_AtomicSet(&stop, 0);
+
+    //the tree count and seeds must not depend on the machine, so a replay makes the same choice as the recording
+    bool fixed = gReplay.recording || gReplay.playing;
+    trees = fixed ? 1 : workers;
+    due = getTicks() + budget;
+
+    Uint64 deadline = SDL_GetPerformanceCounter() + (Uint64)budget * SDL_GetPerformanceFrequency() / 1000;
+
+    thinking = true;
+
+    for (int w = 0; w < trees; w++)
+    {
+        CombatSearch& s = searches[w];
+        s.root = combat;
+        s.deadline = deadline;
+        s.limit = fixed ? combat_replay_playouts : 0;
+        s.seed = hashBytes(&w, sizeof(w), fixed ? combat_replay_seed + combat.turns : SDL_GetPerformanceCounter()) | 1;
+        if (s.thread != NULL)
+            SDL_SemPost(s.go);
+        else
+        {
+            search(&s);
+            SDL_AtomicIncRef(&finished);
+        }
+    }
+}
+
+bool CombatAI::ready()
+{
+    if (!thinking)
+        return true;
+    if (gReplay.recording || gReplay.playing)
+        return (Sint32)(getTicks() - due) >= 0;
+    return SDL_AtomicGet(&finished) == trees;
+}
+
+int CombatAI::decide()
+{
+    for (int w = 0; w < trees; w++)
+    {
+        if (searches[w].thread != NULL)
+            SDL_SemWait(done);
+    }
+    thinking = false;
+
+    //root parallel: every worker grew its own tree, their root visits are summed
+    Uint64 visits[ACTION_COUNT] = { 0 };
+    playouts = 0;
+    for (int w = 0; w < trees; w++)
+    {
+        CombatSearch& s = searches[w];
+        playouts += s.playouts;
+        if (s.playouts == 0)
+            continue;
+        for (int a = 0; a < ACTION_COUNT; a++)
+        {
+            if (s.nodes[0].child[a] >= 0)
+                visits[a] += s.nodes[s.nodes[0].child[a]].visits;
+        }
+    }
+
+    int best = ACTION_ATTACK;
+    for (int a = 0; a < ACTION_COUNT; a++)
+    {
+        if (visits[a] > visits[best])
+            best = a;
+    }
+    return best;
+}
+
+int CombatAI::worker(void* data)
+{
+    CombatSearch* s = (CombatSearch*)data;
+    CombatAI* ai = s->ai;
+
+    for (;;)
+    {
+        SDL_SemWait(s->go);
+        if (ai->quit)
+            break;
+        search(s);
+        SDL_AtomicIncRef(&ai->finished);
+        SDL_SemPost(ai->done);
+    }
+    return 0;
+}
+
+void CombatAI::search(CombatSearch* s)
+{
+    CombatAI* ai = s->ai;
+
+    CombatNode empty = { { -1, -1, -1 }, 0, 0.0f };
+    s->nodes[0] = empty;
+    s->used = 1;
+    s->playouts = 0;
+
+    int path[combat_search_depth + 1];
+
+    while (SDL_AtomicGet(&ai->stop) == 0 && (s->limit != 0 ? s->playouts < s->limit : SDL_GetPerformanceCounter() < s->deadline))
+    {
+        Combat game = s->root;
+        game.reseed(nextRandom(s->seed));
+
+        int node = 0;
+        int depth = 0;
+        path[depth++] = node;
+
+        //selection and expansion, the tree only branches on the enemy's choices
+        while (!game.over() && game.turns < combat_turn_limit && depth <= combat_search_depth)
+        {
+            CombatNode& n = s->nodes[node];
+            int action = -1;
+            bool untried = false;
+
+            for (int a = 0; a < ACTION_COUNT; a++)
+            {
+                if (game.legal(game.enemy, a) && n.child[a] < 0)
+                {
+                    untried = true;
+                    if (s->used < combat_search_nodes)
+                    {
+                        s->nodes[s->used] = empty;
+                        n.child[a] = s->used++;
+                        action = a;
+                    }
+                    break;
+                }
+            }
+
+            if (untried && action < 0)
+                break;
+
+            if (action < 0)
+            {
+                float best = -1.0f;
+                for (int a = 0; a < ACTION_COUNT; a++)
+                {
+                    if (!game.legal(game.enemy, a) || n.child[a] < 0)
+                        continue;
+                    CombatNode& c = s->nodes[n.child[a]];
+                    float score = c.value / c.visits + 1.4f * sqrtf(logf((float)n.visits) / c.visits);
+                    if (score > best)
+                    {
+                        best = score;
+                        action = a;
+                    }
+                }
+            }
+
+            game.enemyAct(action);
+            node = n.child[action];
+            path[depth++] = node;
+
+            if (!game.over())
+            {
+                game.playerAct(playerPolicy(game, s->seed));
+                game.turns++;
+            }
+
+            if (untried)
+                break;
+        }
+
+        //random playout to the end of the fight
+        while (!game.over() && game.turns < combat_turn_limit)
+        {
+            game.enemyAct(randomAction(game, s->seed));
+            if (!game.over())
+                game.playerAct(playerPolicy(game, s->seed));
+            game.turns++;
+        }
+
+        float reward = combatReward(game);
+        for (int i = 0; i < depth; i++)
+        {
+            s->nodes[path[i]].visits++;
+            s->nodes[path[i]].value += reward;
+        }
+        s->playouts++;
+    }
+}
+
+Fight::Fight(Tilemap* t, Player* p, Levels* l, Rewind* r)
+{
+    MemoryScope scope(MEMORY_FIGHT);
+
+    rewind = r;
+    levels = l;
+    lights = NULL;
+    if (!back.loadFromFile("Assets/fight/fight_back.png"))
+    {
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search fight window background texture file. Please reinstall game :)", NULL);
+        close(t, p, l);
+    }
+    if (!ui.loadFromFile("Assets/fight/fight_ui.png"))
+    {
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search fight window background texture file. Please reinstall game :)", NULL);
+        close(t, p, l);
+    }
+    particles.load("Assets/fight/effects.txt");
+}
+
+//the enemy's lunge holds for a second before the turn comes back to the player
+static Cutscene handBack(Scheduler* scheduler, bool* your_round, Texture* round)
+{
+    co_await scheduler->sleep(1000);
+    round->loadFromRenderedText("Twoj ruch", white);
+    *your_round = true;
+}
+
+//a fleeing enemy stays on screen under its label for a second before the fight ends
+static Cutscene runAway(Scheduler* scheduler, bool* gone)
+{
+    co_await scheduler->sleep(1000);
+    *gone = true;
+}
+
+static Cutscene fireballFlash(Scheduler* scheduler, Uint32* fireball)
+{
+    Uint32 cast = *fireball;
+    co_await scheduler->sleep(800);
+    if (*fireball == cast)
+        *fireball = 0;
+}
+
+bool Fight::fight(Player* p, NPC* npc, Tilemap* t)
+{
+    MemoryScope scope(MEMORY_FIGHT);
+
+    SDL_Event e;
+
+    Texture hp, str, hp_enemy, str_enemy, round;
+    hp.loadFromRenderedText("Twoje punkty zycia: " + std::to_string(p->health), white);
+    str.loadFromRenderedText("Twoja sila: " + std::to_string(p->strenght), white);
+    str_enemy.loadFromRenderedText("Sila przeciwnika: " + std::to_string(npc->strenght), white);
+    hp_enemy.loadFromRenderedText("Twoja sila: " + std::to_string(npc->hp), white);
+    round.loadFromRenderedText("Twoj ruch",white);
+    combat.start();
+
+    p->Collider.x = 600;
+    p->Collider.y = 400;
+    p->ismoving = false;
+    p->lastx = 0;
+    p->lasty = 1;
+    
+    npc->Collider.x = 600;
+    npc->Collider.y = 200;
+
+    Button buttons[4] =
+    { 
+     Button("Assets/fight/fight_attack_out.png","Assets/fight/fight_attack_in.png"),
+     Button("Assets/fight/fight_cast_out.png","Assets/fight/fight_cast_in.png"),
+     Button("Assets/fight/fight_back_out.png","Assets/fight/fight_back_in.png"),
+     Button("Assets/fight/fight_fireball_out.png","Assets/fight/fight_fireball_in.png")
+    };
+
+    buttons[0].setPosistion(0, 468);
+    buttons[1].setPosistion(0, 568);
+    buttons[2].setPosistion(0, 668);
+    buttons[3].setPosistion(0, 468);
+
+    bool cast_visible = false;
+
+    bool run = true;
+
+    Uint32 fireball = 0;
+
+    particles.clear();
+    int mana = particles.find("mana");
+    int hit = particles.find("hit");
+    int flames = particles.find("fireball");
+    int embers = particles.find("embers");
+    int curse = particles.find("curse");
+    Uint32 last_frame = getTicks();
+
+    bool your_round_active = true;
+
+    bool fled = false;
+
+    //a fallen player stays on the arena until Return, so holding R can still take the last turns back
+    bool lost = false;
+
+    int chosen = -1;
+
+    if (rewind != NULL)
+        rewind->attach(&combat, &your_round_active);
+
+    while (run && npc->hp>0 && !lost && !fled)
+    {
+        while (pollEvent(&e) != 0)
+        {
+            if (e.type == SDL_QUIT)
+            {
+                run = false;
+                if (rewind != NULL)
+                    rewind->report();
+                close(t, p, levels);
+                exit(0);
+            }
+            if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_RETURN && p->health <= 0)
+                lost = true;
+            buttons[2].handleEvent(&e);
+            if (!cast_visible)
+            {
+                if (buttons[0].handleEvent(&e) == 1 && your_round_active)
+                    chosen = ACTION_ATTACK;
+                    
+                if (buttons[1].handleEvent(&e) == 1)
+                    cast_visible = true;
+            }
+            else
+            {
+                if (buttons[3].handleEvent(&e) == 1)
+                {
+                    cast_visible = false;
+                    if (your_round_active && combat.player.casts > 0)
+                        chosen = ACTION_CAST;
+                }
+            }
+        }
+
+        if (chosen >= 0)
+        {
+            your_round_active = false;
+            combat.set(p->health, p->strenght, npc->hp, npc->strenght);
+            combat.playerAct(chosen);
+            npc->hp = combat.enemy.hp;
+            gAudio.play(SOUND_HIT, 2);
+
+            if (chosen == ACTION_CAST)
+            {
+                fireball = getTicks();
+                scheduler.start(fireballFlash(&scheduler, &fireball));
+                particles.emit(flames, npc->Collider.x + 16.0f, npc->Collider.y + 16.0f);
+                particles.emit(embers, npc->Collider.x + 16.0f, npc->Collider.y + 16.0f);
+            }
+            else
+            {
+                particles.emit(hit, npc->Collider.x + 16.0f, npc->Collider.y + 16.0f);
+            }
+
+            //the search runs on worker threads, the fight keeps rendering until it is ready
+            if (!combat.over())
+            {
+                ai.think(combat, gAiBudget);
+                round.loadFromRenderedText("Przeciwnik mysli...", white);
+            }
+            chosen = -1;
+        }
+
+        if (ai.thinking && ai.ready())
+        {
+            int action = ai.decide();
+            combat.set(p->health, p->strenght, npc->hp, npc->strenght);
+            combat.enemyAct(action);
+            combat.turns++;
+            p->health = combat.player.hp;
+
+            if (action == ACTION_RETREAT)
+                round.loadFromRenderedText("Przeciwnik ucieka", white);
+            else if (action == ACTION_CAST)
+            {
+                round.loadFromRenderedText(gFrame.format("Przeciwnik rzuca czar za: %d", combat.enemy_hit), white);
+                particles.emit(curse, p->Collider.x + 16.0f, p->Collider.y + 16.0f);
+            }
+            else
+            {
+                round.loadFromRenderedText(gFrame.format("Przeciwnik uderza za: %d", combat.enemy_hit), white);
+                particles.emit(hit, p->Collider.x + 16.0f, p->Collider.y + 16.0f);
+            }
+            npc->Collider.y = 250;
+            if (combat.fled)
+                scheduler.start(runAway(&scheduler, &fled));
+            else if (p->health <= 0)
+            {
+                if (rewind == NULL || rewind->empty())
+                    lost = true;
+                else
+                    round.loadFromRenderedText("Przegrana! R cofa, Enter konczy", white);
+            }
+            else
+                scheduler.start(handBack(&scheduler, &your_round_active, &round));
+        }
+
+        scheduler.update();
+
+        if (your_round_active)
+            npc->Collider.y=200 ;
+
+        //the enemy's half of a turn is skipped, so rewinding always lands on the player's move
+        if (rewind != NULL && rewind->held() && !ai.thinking && scheduler.cutscenes.empty())
+        {
+            while (rewind->step_back(p, npc) && !your_round_active)
+            {
+            }
+            if (!your_round_active)
+            {
+                your_round_active = true;
+                round.loadFromRenderedText("Twoj ruch", white);
+            }
+        }
+        else if (rewind != NULL && p->health > 0)
+        {
+            rewind->record(p, npc);
+        }
+            
+        float dt = std::min(0.1f, (getTicks() - last_frame) / 1000.0f);
+        last_frame = getTicks();
+        if (cast_visible)
+            particles.stream(mana, p->Collider.x + 16.0f, p->Collider.y + 24.0f, dt);
+        particles.update(dt);
+
+        hp.loadFromRenderedText(gFrame.format("Twoje punkty zycia: %d", p->health), white);
+        str.loadFromRenderedText(gFrame.format("Twoja sila: %d", p->strenght), white);
+        str_enemy.loadFromRenderedText(gFrame.format("Sila przeciwnika: %d", npc->strenght), white);
+        hp_enemy.loadFromRenderedText(gFrame.format("Punty zycia przeciwnika: %d", npc->hp), white);
+
+        SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
+
+        SDL_RenderClear(gRenderer);
+
+        back.render(0, 0);
+
+        p->render();
+
+        npc->render();
+
+        //on dark levels the arena is lit by the player's lantern and, for a moment, the fireball bursting on the enemy
+        if (lights != NULL)
+        {
+            lights->begin();
+            lights->add(p->Collider.x + 10.0f, p->Collider.y + 16.0f, 220, 1.0f, 0.95f, 0.85f);
+            if (fireball != 0)
+            {
+                float fade = std::max(0.0f, 1.0f - (getTicks() - fireball) / 800.0f);
+                lights->add(npc->Collider.x + 16.0f, npc->Collider.y + 16.0f, 120 + 300 * fade, 1.6f * fade, 0.8f * fade, 0.25f * fade);
+            }
+            lights->shade(NULL);
+            lights->draw();
+        }
+
+        particles.render();
+
+        ui.render(0, 468);
+
+        hp.render(210, 480);
+        str.render(210, 520);
+        str_enemy.render(210, 700);
+        hp_enemy.render(210, 650);
+        round.render(800, 480);
+
+        buttons[2].render();
+        if (!cast_visible)
+        {
+            buttons[0].render();
+            buttons[1].render();
+        }
+        else
+        {
+            buttons[3].render();
+        }
+
+        present();
+    }
+
+    //cutscenes still waiting point into this fight's locals
+    scheduler.cutscenes.clear();
+
+    if (rewind != NULL)
+        rewind->attach(NULL, NULL);
+
+    if (npc->hp <= 0)
+        return true;
+
+    //a fallen player and an enemy that ran away both end the fight without a win
+    return false;
+}
+const Uint32 script_magic = 0x53475052; //"RPGS"
+
+const Uint32 script_version = 2;
+
+const char* script_calls[CALL_COUNT] = { "spawn", "dialog", "animate", "fight", "touching", "collides", "push", "light", "entered", "inside", "left", "zone" };
+
+//[op:8][a:8][b:8][c:8] or [op:8][a:8][imm:16]
+static Uint32 scriptWord(int op, int a, int b, int c)
+{
+    return (Uint32)op | ((Uint32)(a & 0xFF) << 8) | ((Uint32)(b & 0xFF) << 16) | ((Uint32)(c & 0xFF) << 24);
+}
+
+static Uint32 scriptImmediate(int op, int a, int imm)
+{
+    return (Uint32)op | ((Uint32)(a & 0xFF) << 8) | ((Uint32)(imm & 0xFFFF) << 16);
+}
+
+static bool scriptRegister(std::string& token, int& reg)
+{
+    if (token.size() < 2 || token[0] != 'r')
+        return false;
+    for (size_t i = 1; i < token.size(); i++)
+    {
+        if (token[i] < '0' || token[i] > '9')
+            return false;
+    }
+    reg = atoi(token.c_str() + 1);
+    return reg < 16;
+}
+
+static bool scriptNumber(std::string& token, int& value)
+{
+    if (token.size() == 3 && token[0] == '\'' && token[2] == '\'')
+    {
+        value = token[1];
+        return true;
+    }
+
+    char* end;
+    long number = strtol(token.c_str(), &end, 10);
+    if (token.empty() || *end != 0 || number < -32768 || number > 32767)
+        return false;
+    value = (int)number;
+    return true;
+}
+
+//loads a register or an immediate into reg
+static bool scriptOperand(std::string& token, int reg, std::vector<Uint32>& code)
+{
+    int value;
+    if (scriptRegister(token, value))
+    {
+        code.push_back(scriptWord(OP_MOV, reg, value, 0));
+        return true;
+    }
+    if (scriptNumber(token, value))
+    {
+        code.push_back(scriptImmediate(OP_SET, reg, value));
+        return true;
+    }
+    return false;
+}
+
+bool compileScript(std::string& source, std::vector<Uint32>& code, std::string& error)
+{
+    std::vector<std::vector<std::string>> lines;
+    std::vector<int> numbers;
+    std::vector<std::string> labels;
+    std::vector<int> offsets;
+
+    std::stringstream input(source);
+    std::string line;
+    int number = 0;
+    while (std::getline(input, line))
+    {
+        number++;
+        line = line.substr(0, line.find('#'));
+
+        std::stringstream words(line);
+        std::vector<std::string> tokens;
+        std::string token;
+        while (words >> token)
+            tokens.push_back(token);
+
+        if (!tokens.empty())
+        {
+            lines.push_back(tokens);
+            numbers.push_back(number);
+        }
+    }
+
+    //two passes: the first only measures statements to find label offsets
+    for (int pass = 0; pass < 2; pass++)
+    {
+        code.clear();
+
+        for (size_t l = 0; l < lines.size(); l++)
+        {
+            std::vector<std::string>& t = lines[l];
+            std::string& op = t[0];
+            int a, b, c, value;
+            bool ok = true;
+
+            if (op.back() == ':' && t.size() == 1)
+            {
+                if (pass == 0)
+                {
+                    labels.push_back(op.substr(0, op.size() - 1));
+                    offsets.push_back((int)code.size());
+                }
+                continue;
+            }
+
+            int target = 0;
+            if ((op == "jump" && t.size() == 2) || ((op == "jumpz" || op == "jumpnz") && t.size() == 3))
+            {
+                std::vector<std::string>::iterator found = std::find(labels.begin(), labels.end(), t.back());
+                if (found != labels.end())
+                    target = offsets[found - labels.begin()];
+                else if (pass == 1)
+                {
+                    error = "unknown label " + t.back();
+                    ok = false;
+                }
+            }
+
+            if (!ok)
+            {
+            }
+            else if (op == "end" && t.size() == 1)
+                code.push_back(scriptWord(OP_END, 0, 0, 0));
+            else if (op == "yield" && t.size() == 1)
+                code.push_back(scriptWord(OP_YIELD, 0, 0, 0));
+            else if (op == "set" && t.size() == 3 && scriptRegister(t[1], a))
+                ok = scriptOperand(t[2], a, code);
+            else if ((op == "add" || op == "sub") && t.size() == 3 && scriptRegister(t[1], a))
+            {
+                if (scriptRegister(t[2], b))
+                    code.push_back(scriptWord(op == "add" ? OP_ADD : OP_SUB, a, a, b));
+                else if (scriptNumber(t[2], value))
+                    code.push_back(scriptImmediate(OP_ADDI, a, op == "add" ? value : -value));
+                else
+                    ok = false;
+            }
+            else if ((op == "lt" || op == "eq") && t.size() == 4 && scriptRegister(t[1], a) && scriptRegister(t[2], b) && scriptRegister(t[3], c))
+                code.push_back(scriptWord(op == "lt" ? OP_LT : OP_EQ, a, b, c));
+            else if (op == "jump" && t.size() == 2)
+                code.push_back(scriptImmediate(OP_JMP, 0, target));
+            else if ((op == "jumpz" || op == "jumpnz") && t.size() == 3 && scriptRegister(t[1], a))
+                code.push_back(scriptImmediate(op == "jumpz" ? OP_JZ : OP_JNZ, a, target));
+            else if (op == "call" && t.size() >= 2 && t.size() <= 6)
+            {
+                int id = 0;
+                while (id < CALL_COUNT && t[1] != script_calls[id])
+                    id++;
+
+                if (id == CALL_COUNT)
+                {
+                    error = "unknown host call " + t[1];
+                    ok = false;
+                }
+
+                //arguments go to r12..r15, the result comes back in r0
+                for (size_t i = 2; ok && i < t.size(); i++)
+                    ok = scriptOperand(t[i], 12 + (int)(i - 2), code);
+
+                if (ok)
+                    code.push_back(scriptWord(OP_CALL, id, 12, (int)t.size() - 2));
+            }
+            else
+                ok = false;
+
+            if (!ok)
+            {
+                if (error == "")
+                    error = "cannot parse '" + op + "'";
+                error = "line " + std::to_string(numbers[l]) + ": " + error;
+                return false;
+            }
+        }
+    }
+
+    code.push_back(scriptWord(OP_END, 0, 0, 0));
+    return true;
+}
+
+bool compileScripts(std::string directory)
+{
+    namespace fs = std::filesystem;
+
+    std::vector<std::string> files = listAssets(directory, { ".lvl" });
+    bool ok = true;
+
+    for (std::string& file : files)
+    {
+        std::string source, error;
+        std::vector<Uint32> code;
+
+        if (!readAsset(file, source) || !compileScript(source, code, error))
         {
-            if (lasty == 1)
-            {
-                Collider.y += velocity;
-            }
-            else if (lasty == -1)
+            printf("Cannot compile script %s: %s\n", file.c_str(), error.c_str());
+            ok = false;
+            continue;
+        }
+
+        std::string path = fs::path(file).replace_extension(".lsc").generic_string();
+        std::fstream plik;
+        plik.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!plik.good())
+        {
+            printf("Cannot write script %s\n", path.c_str());
+            ok = false;
+            continue;
+        }
+
+        //the source's hash goes in the header so loadScript can tell when the .lvl was edited after compiling
+        Uint64 hash = hashBytes(source.data(), source.size());
+        Uint32 header[5] = { script_magic, script_version, (Uint32)code.size(), (Uint32)hash, (Uint32)(hash >> 32) };
+        plik.write((const char*)header, sizeof(header));
+        plik.write((const char*)code.data(), code.size() * sizeof(Uint32));
+
+        printf("Compiled %s: %d instructions\n", path.c_str(), (int)code.size());
+    }
+    return ok;
+}
+
+bool loadScript(std::string path, std::vector<Uint32>& code)
+{
+    namespace fs = std::filesystem;
+
+    std::string source, content;
+    std::string source_path = fs::path(path).replace_extension(".lvl").generic_string();
+    bool has_source = readAsset(source_path, source);
+    Uint64 hash = has_source ? hashBytes(source.data(), source.size()) : 0;
+
+    if (readAsset(path, content))
+    {
+        Uint32 header[5];
+        if (content.size() >= sizeof(header))
+        {
+            SDL_memcpy(header, content.data(), sizeof(header));
+            bool current = !has_source || (header[3] == (Uint32)hash && header[4] == (Uint32)(hash >> 32));
+            if (header[0] == script_magic && header[1] == script_version && content.size() == sizeof(header) + header[2] * sizeof(Uint32) && current)
             {
-                Collider.y -= velocity;
+                code.resize(header[2]);
+                SDL_memcpy(code.data(), content.data() + sizeof(header), header[2] * sizeof(Uint32));
+                return true;
             }
         }
-
+        printf("Script %s is damaged or out of date\n", path.c_str());
     }
-    else
+
+    //no compiled script yet or the source changed since, build it from the source next to it
+    std::string error;
+    if (has_source)
     {
+        if (compileScript(source, code, error))
+            return true;
+        printf("Cannot compile script %s: %s\n", source_path.c_str(), error.c_str());
+    }
+    return false;
+}
 
-        if (Collider.x < 0)
+Script::Script(const std::vector<Uint32>* code)
+{
+    this->code = code;
+    pc = 0;
+    done = false;
+    for (int i = 0; i < 16; i++)
+        regs[i] = 0;
+}
+
+int Script::run(ScriptHost* host, int budget)
+{
+    const Uint32* words = code->data();
+    int size = (int)code->size();
+    int executed = 0;
+
+    while (!done && executed < budget)
+    {
+        if (pc < 0 || pc >= size)
         {
-            Collider.x += velocity;
+            done = true;
+            break;
         }
-        else if (Collider.x + Collider.w > 1280)
+
+        Uint32 word = words[pc++];
+        int a = (word >> 8) & 0xFF;
+        int b = (word >> 16) & 0xFF;
+        int c = word >> 24;
+        int imm = (Sint16)(word >> 16);
+        executed++;
+
+        switch (word & 0xFF)
         {
-            Collider.x -= velocity;
+        case OP_END:
+            done = true;
+            break;
+        case OP_YIELD:
+            return executed;
+        case OP_SET:
+            regs[a & 15] = imm;
+            break;
+        case OP_MOV:
+            regs[a & 15] = regs[b & 15];
+            break;
+        case OP_ADD:
+            regs[a & 15] = regs[b & 15] + regs[c & 15];
+            break;
+        case OP_ADDI:
+            regs[a & 15] += imm;
+            break;
+        case OP_SUB:
+            regs[a & 15] = regs[b & 15] - regs[c & 15];
+            break;
+        case OP_LT:
+            regs[a & 15] = regs[b & 15] < regs[c & 15];
+            break;
+        case OP_EQ:
+            regs[a & 15] = regs[b & 15] == regs[c & 15];
+            break;
+        case OP_JMP:
+            pc = imm & 0xFFFF;
+            break;
+        case OP_JZ:
+            if (regs[a & 15] == 0)
+                pc = imm & 0xFFFF;
+            break;
+        case OP_JNZ:
+            if (regs[a & 15] != 0)
+                pc = imm & 0xFFFF;
+            break;
+        case OP_CALL:
+            regs[0] = host->call(a, &regs[b & 15], c < 4 ? c : 4);
+            break;
+        default:
+            printf("Bad script instruction %08x at %d\n", word, pc - 1);
+            done = true;
+            break;
         }
+    }
+    return executed;
+}
 
-        if (Collider.y < 0)
+ScriptHost::ScriptHost(Tilemap* t, Player* p, Dialog* d, Fight* f, SDL_Surface* sprite)
+{
+    tilemap = t;
+    player = p;
+    dialog = d;
+    fight = f;
+    this->sprite = sprite;
+    budget = 256;
+    effects = 0;
+    pipe = NULL;
+    scheduler = &gScheduler;
+    lights = NULL;
+    pushback = true;
+}
+
+ScriptHost::~ScriptHost()
+{
+    for (Start_men* npc : npcs)
+        delete npc;
+}
+
+void ScriptHost::add(const std::vector<Uint32>* code)
+{
+    if (!code->empty())
+        scripts.push_back(Script(code));
+}
+
+void ScriptHost::update()
+{
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    effects = 0;
+
+    //trigger events for this tick, scripts read them back with entered, inside and left
+    tilemap->triggers.begin();
+    tilemap->triggers.move(0, player->Collider, getTicks());
+
+    for (size_t i = 0; i < scripts.size(); i++)
+        scripts[i].run(this, budget);
+
+    gPerf.add(PERF_SCRIPTS, start);
+
+    for (size_t i = 0; pushback && i < npcs.size(); i++)
+    {
+        player->move(npcs[i]->Collider);
+    }
+}
+
+//walks one pixel a tick from wherever the body is for the given time, like the old per-frame animations did
+template<class T> static Cutscene slide(Scheduler* scheduler, T* who, char direction, int ms)
+{
+    int dx = direction == 'e' ? 1 : direction == 'w' ? -1 : 0;
+    int dy = direction == 's' ? 1 : direction == 'n' ? -1 : 0;
+
+    co_await scheduler->walk(who, dx, dy, ms);
+}
+
+struct MainCall
+{
+    ScriptHost* host;
+    int id;
+    int args[4];
+    int result;
+};
+
+static void callOnMain(void* data)
+{
+    MainCall* request = (MainCall*)data;
+    request->result = request->host->call(request->id, request->args, 4);
+}
+
+int ScriptHost::call(int id, int* args, int argc)
+{
+    int arg[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < argc; i++)
+        arg[i] = args[i];
+
+    //npc handles are 1-based, 0 stands for the player
+    Start_men* npc = arg[0] >= 1 && arg[0] <= (int)npcs.size() ? npcs[arg[0] - 1] : NULL;
+
+    if (id != CALL_TOUCHING && id != CALL_COLLIDES && id != CALL_ENTERED && id != CALL_INSIDE && id != CALL_LEFT)
+        effects++;
+
+    //spawning creates textures and fights render, both belong on the thread that owns the renderer
+    if (pipe != NULL && (id == CALL_SPAWN || id == CALL_FIGHT))
+    {
+        MainCall request = { this, id, { arg[0], arg[1], arg[2], arg[3] }, 0 };
+        FramePipe* through = pipe;
+        pipe = NULL;
+        through->call(callOnMain, &request);
+        pipe = through;
+        return request.result;
+    }
+
+    switch (id)
+    {
+    case CALL_SPAWN:
+        npcs.push_back(new Start_men(arg[0], arg[1], sprite));
+        return (int)npcs.size();
+    case CALL_DIALOG:
+        if (dialog != NULL)
+            dialog->start();
+        return 0;
+    case CALL_ANIMATE:
+        if (arg[0] == 0)
+            scheduler->start(slide(scheduler, player, (char)arg[2], arg[1]));
+        else if (npc != NULL)
+            scheduler->start(slide(scheduler, npc, (char)arg[2], arg[1]));
+        return 0;
+    case CALL_FIGHT:
+        if (npc != NULL && fight != NULL)
+            return fight->fight(player, npc, tilemap) ? 1 : 0;
+        return 0;
+    case CALL_TOUCHING:
+    {
+        //only the cells under the player can overlap it
+        SDL_Rect& body = player->Collider;
+        for (int y = std::max(0, body.y / 32); y <= std::min(map_height - 1, (body.y + body.h - 1) / 32); y++)
         {
-            Collider.y += velocity;
+            for (int x = std::max(0, body.x / 32); x <= std::min(map_width - 1, (body.x + body.w - 1) / 32); x++)
+            {
+                if (tilemap->objects.get(x, y) == arg[0] && checkCollision(body, tilemap->collider[x][y]))
+                    return 1;
+            }
         }
-        else if (Collider.y + Collider.h > 768)
+        return 0;
+    }
+    case CALL_COLLIDES:
+        if (npc != NULL)
+            return checkCollision(player->Collider, npc->Collider) ? 1 : 0;
+        return 0;
+    case CALL_PUSH:
+        player->Collider.x += arg[0];
+        player->Collider.y += arg[1];
+        return 0;
+    case CALL_LIGHT:
+        //torches only burn on lit levels, the handle is 1-based like npcs
+        if (lights != NULL)
+            return lights->place((float)arg[0], (float)arg[1], (float)arg[2], 1.0f, 0.72f, 0.42f) + 1;
+        return 0;
+    case CALL_ENTERED:
+        return tilemap->triggers.happened(0, arg[0], TRIGGER_ENTER) ? 1 : 0;
+    case CALL_INSIDE:
+        return tilemap->triggers.happened(0, arg[0], TRIGGER_STAY) ? 1 : 0;
+    case CALL_LEFT:
+        return tilemap->triggers.happened(0, arg[0], TRIGGER_EXIT) ? 1 : 0;
+    case CALL_ZONE:
+    {
+        SDL_Rect area = { arg[0], arg[1], arg[2], arg[3] };
+        return tilemap->triggers.zone(area, 0);
+    }
+    }
+    return 0;
+}
+
+void ScriptHost::render()
+{
+    for (Start_men* npc : npcs)
+        npc->render();
+}
+
+UdpSocket::UdpSocket()
+{
+    handle = -1;
+}
+
+UdpSocket::~UdpSocket()
+{
+    close();
+}
+
+bool UdpSocket::open(Uint16 port)
+{
+    close();
+
+#ifdef _WIN32
+    static bool started = false;
+    if (!started)
+    {
+        WSADATA wsa;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
         {
-            Collider.y -= velocity;
+            printf("Cannot start Winsock\n");
+            return false;
         }
+        started = true;
+    }
+
+    SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s == INVALID_SOCKET)
+    {
+        printf("Cannot create UDP socket\n");
+        return false;
+    }
+    u_long nonblocking = 1;
+    ioctlsocket(s, FIONBIO, &nonblocking);
+#else
+    int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s < 0)
+    {
+        printf("Cannot create UDP socket\n");
+        return false;
+    }
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+    handle = (Sint64)s;
+
+    sockaddr_in address;
+    SDL_memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+
+    if (bind(s, (sockaddr*)&address, sizeof(address)) != 0)
+    {
+        printf("Cannot bind UDP port %d\n", port);
+        close();
+        return false;
     }
+    return true;
 }
 
-void Player::render()
+void UdpSocket::close()
 {
-    SDL_Rect* current;
+    if (handle == -1)
+        return;
+
+#ifdef _WIN32
+    closesocket((SOCKET)handle);
+#else
+    ::close((int)handle);
+#endif
+    handle = -1;
+}
 
-    if (ismoving)
+bool UdpSocket::send(NetAddress& to, const Uint8* data, int size)
+{
+    if (handle == -1)
+        return false;
+
+    sockaddr_in address;
+    SDL_memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = to.host;
+    address.sin_port = htons(to.port);
+
+#ifdef _WIN32
+    return sendto((SOCKET)handle, (const char*)data, size, 0, (sockaddr*)&address, sizeof(address)) == size;
+#else
+    return sendto((int)handle, data, size, 0, (sockaddr*)&address, sizeof(address)) == size;
+#endif
+}
+
+//0 when nothing is waiting, the socket never blocks
+int UdpSocket::receive(Uint8* data, int size, NetAddress& from)
+{
+    if (handle == -1)
+        return 0;
+
+    sockaddr_in address;
+#ifdef _WIN32
+    int length = sizeof(address);
+    int got = recvfrom((SOCKET)handle, (char*)data, size, 0, (sockaddr*)&address, &length);
+#else
+    socklen_t length = sizeof(address);
+    int got = (int)recvfrom((int)handle, data, size, 0, (sockaddr*)&address, &length);
+#endif
+    if (got <= 0)
+        return 0;
+
+    from.host = address.sin_addr.s_addr;
+    from.port = ntohs(address.sin_port);
+    return got;
+}
+
+//"host:port", the host may be a name or a dotted address
+bool UdpSocket::resolve(std::string text, NetAddress& address)
+{
+    size_t colon = text.rfind(':');
+    if (colon == std::string::npos)
+        return false;
+
+    int port = atoi(text.substr(colon + 1).c_str());
+    if (port <= 0 || port > 65535)
+        return false;
+
+#ifdef _WIN32
+    UdpSocket starter;
+    starter.open(0);
+#endif
+
+    addrinfo hints;
+    SDL_memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    addrinfo* found = NULL;
+    if (getaddrinfo(text.substr(0, colon).c_str(), NULL, &hints, &found) != 0 || found == NULL)
+        return false;
+
+    address.host = ((sockaddr_in*)found->ai_addr)->sin_addr.s_addr;
+    address.port = (Uint16)port;
+    freeaddrinfo(found);
+    return true;
+}
+
+static void put32(Uint8* data, Uint32 value)
+{
+    data[0] = (Uint8)value;
+    data[1] = (Uint8)(value >> 8);
+    data[2] = (Uint8)(value >> 16);
+    data[3] = (Uint8)(value >> 24);
+}
+
+static Uint32 get32(const Uint8* data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((Uint32)data[3] << 24);
+}
+
+static int putVarint(Uint8* data, Sint32 value)
+{
+    Uint32 zigzag = ((Uint32)value << 1) ^ (Uint32)(value >> 31);
+    int len = 0;
+    while (zigzag >= 0x80)
     {
+        data[len++] = (Uint8)(zigzag | 0x80);
+        zigzag >>= 7;
+    }
+    data[len++] = (Uint8)zigzag;
+    return len;
+}
 
-        if (frame / 20 >= 3)
+static bool getVarint(const Uint8* data, int size, int& at, Sint32& value)
+{
+    Uint32 zigzag = 0;
+    for (int shift = 0; shift < 35; shift += 7)
+    {
+        if (at >= size)
+            return false;
+        Uint8 byte = data[at++];
+        zigzag |= (Uint32)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
         {
-            frame = 0;
+            value = (Sint32)((zigzag >> 1) ^ (0 - (zigzag & 1)));
+            return true;
         }
-        else
+    }
+    return false;
+}
+
+static void entityFields(const NetEntity& e, Sint32* fields)
+{
+    fields[0] = e.x;
+    fields[1] = e.y;
+    fields[2] = e.lastx;
+    fields[3] = e.lasty;
+    fields[4] = e.moving;
+    fields[5] = e.hp;
+}
+
+//[active][changed] then for every changed entity [field mask][zigzag varint of (current - baseline) per changed field]
+int writeSnapshot(NetSnapshot& current, NetSnapshot* baseline, Uint8* data)
+{
+    static const NetEntity none = { 0, 0, 0, 0, 0, 0 };
+
+    int len = 4;
+    Uint16 changed = 0;
+
+    for (int i = 0; i < net_entities; i++)
+    {
+        if ((current.active & (1 << i)) == 0)
+            continue;
+
+        bool known = baseline != NULL && (baseline->active & (1 << i)) != 0;
+
+        Sint32 now[6], before[6];
+        entityFields(current.entities[i], now);
+        entityFields(known ? baseline->entities[i] : none, before);
+
+        Uint8 mask = 0;
+        for (int k = 0; k < 6; k++)
         {
-            if (lastx == 1)
-            {
-                current = &right[frame / 20];
-            }
-            else if (lastx == -1)
-            {
-                current = &left[frame / 20];
-            }
-            else if (lasty == 1)
-            {
-                current = &up[frame / 20];
-            }
-            else
-            {
-                current = &down[frame / 20];
-            }
+            if (now[k] != before[k])
+                mask |= 1 << k;
+        }
 
-            player_texture.render(Collider.x, Collider.y, current);
+        if (mask == 0 && known)
+            continue;
 
-            frame++;
+        changed |= 1 << i;
+        data[len++] = mask;
+        for (int k = 0; k < 6; k++)
+        {
+            if (mask & (1 << k))
+                len += putVarint(data + len, now[k] - before[k]);
         }
     }
-    else
+
+    data[0] = (Uint8)current.active;
+    data[1] = (Uint8)(current.active >> 8);
+    data[2] = (Uint8)changed;
+    data[3] = (Uint8)(changed >> 8);
+    return len;
+}
+
+//-1 when the packet is cut short, out is then left half written
+int readSnapshot(const Uint8* data, int size, NetSnapshot* baseline, NetSnapshot& out)
+{
+    if (size < 4)
+        return -1;
+
+    Uint16 active = data[0] | (data[1] << 8);
+    Uint16 changed = data[2] | (data[3] << 8);
+    int at = 4;
+
+    for (int i = 0; i < net_entities; i++)
     {
-        if (lastx == 1)
+        bool known = baseline != NULL && (baseline->active & (1 << i)) != 0;
+
+        Sint32 fields[6] = { 0, 0, 0, 0, 0, 0 };
+        if (known)
+            entityFields(baseline->entities[i], fields);
+
+        if (changed & (1 << i))
         {
-            current = &right[1];
+            if (at >= size)
+                return -1;
+
+            Uint8 mask = data[at++];
+            for (int k = 0; k < 6; k++)
+            {
+                Sint32 delta;
+                if ((mask & (1 << k)) == 0)
+                    continue;
+                if (!getVarint(data, size, at, delta))
+                    return -1;
+                fields[k] += delta;
+            }
         }
-        else if (lastx == -1)
+
+        NetEntity& e = out.entities[i];
+        if (active & (1 << i))
         {
-            current = &left[1];
+            e.x = (Sint16)fields[0];
+            e.y = (Sint16)fields[1];
+            e.lastx = (Sint8)fields[2];
+            e.lasty = (Sint8)fields[3];
+            e.moving = (Uint8)fields[4];
+            e.hp = (Sint16)fields[5];
         }
-        else if (lasty == 1)
+        else
         {
-            current = &up[1];
+            e = NetEntity();
         }
-        else
+    }
+
+    out.active = active;
+    return at;
+}
+
+//[buttons and flags][player dx, dy if NET_MOVED][npc, its dx, dy and hp if NET_NPC], the numbers as zigzag varints
+int writeInput(const NetInput& input, Uint8* data)
+{
+    Uint8 flags = input.buttons;
+    if (input.dx != 0 || input.dy != 0)
+        flags |= NET_MOVED;
+    if (input.npc != 0)
+        flags |= NET_NPC;
+
+    int len = 0;
+    data[len++] = flags;
+    if (flags & NET_MOVED)
+    {
+        len += putVarint(data + len, input.dx);
+        len += putVarint(data + len, input.dy);
+    }
+    if (flags & NET_NPC)
+    {
+        data[len++] = input.npc;
+        len += putVarint(data + len, input.npc_dx);
+        len += putVarint(data + len, input.npc_dy);
+        len += putVarint(data + len, input.hp);
+    }
+    return len;
+}
+
+//bytes read, -1 when the input is cut short
+int readInput(const Uint8* data, int size, NetInput& input)
+{
+    if (size < 1)
+        return -1;
+
+    input = NetInput();
+    Uint8 flags = data[0];
+    input.buttons = flags & (NET_LEFT | NET_RIGHT | NET_UP | NET_DOWN);
+
+    int at = 1;
+    Sint32 a, b, hp;
+    if (flags & NET_MOVED)
+    {
+        if (!getVarint(data, size, at, a) || !getVarint(data, size, at, b))
+            return -1;
+        input.dx = (Sint16)a;
+        input.dy = (Sint16)b;
+    }
+    if (flags & NET_NPC)
+    {
+        if (at >= size)
+            return -1;
+        input.npc = data[at++];
+        if (!getVarint(data, size, at, a) || !getVarint(data, size, at, b) || !getVarint(data, size, at, hp))
+            return -1;
+        input.npc_dx = (Sint16)a;
+        input.npc_dy = (Sint16)b;
+        input.hp = (Sint16)hp;
+    }
+    return at;
+}
+
+template<class T> static void toEntity(T* who, int hp, NetEntity& e)
+{
+    e.x = (Sint16)who->Collider.x;
+    e.y = (Sint16)who->Collider.y;
+    e.lastx = (Sint8)who->lastx;
+    e.lasty = (Sint8)who->lasty;
+    e.moving = who->ismoving ? 1 : 0;
+    e.hp = (Sint16)hp;
+}
+
+template<class T> static void fromEntity(const NetEntity& e, T* who)
+{
+    who->Collider.x = e.x;
+    who->Collider.y = e.y;
+    who->lastx = e.lastx;
+    who->lasty = e.lasty;
+    who->ismoving = e.moving != 0;
+}
+
+Uint8 netButtons(const Uint8* keys)
+{
+    Uint8 buttons = 0;
+    if (keys[SDL_SCANCODE_LEFT] || keys[SDL_SCANCODE_A])
+        buttons |= NET_LEFT;
+    if (keys[SDL_SCANCODE_RIGHT] || keys[SDL_SCANCODE_D])
+        buttons |= NET_RIGHT;
+    if (keys[SDL_SCANCODE_UP] || keys[SDL_SCANCODE_W])
+        buttons |= NET_UP;
+    if (keys[SDL_SCANCODE_DOWN] || keys[SDL_SCANCODE_S])
+        buttons |= NET_DOWN;
+    return buttons;
+}
+
+//keys must hold SDL_NUM_SCANCODES entries
+const Uint8* buttonKeys(Uint8 buttons, Uint8* keys)
+{
+    SDL_memset(keys, 0, SDL_NUM_SCANCODES);
+    keys[SDL_SCANCODE_LEFT] = (buttons & NET_LEFT) != 0;
+    keys[SDL_SCANCODE_RIGHT] = (buttons & NET_RIGHT) != 0;
+    keys[SDL_SCANCODE_UP] = (buttons & NET_UP) != 0;
+    keys[SDL_SCANCODE_DOWN] = (buttons & NET_DOWN) != 0;
+    return keys;
+}
+
+//one step of player movement against the tile layer, shared by the game, the server and client prediction
+void walkPlayer(Player* p, const Uint8* keys, Tilemap* t)
+{
+    p->handleKeys(keys);
+
+    for (int y = 0; y < map_height; y++)
+    {
+        for (int r = t->objects.rows[y]; r < t->objects.rows[y + 1]; r++)
         {
-            current = &down[1];
+            const TileRun& run = t->objects.runs[r];
+            for (int k = 0; k < run.length; k++)
+            {
+                if (tileIs(t->objects.tiles[run.first + k], TILE_SOLID))
+                    p->move(t->collider[run.x + k][y]);
+            }
         }
+    }
+}
 
-        player_texture.render(Collider.x, Collider.y, current);
+//how many steps of 1/rate seconds fell due since the last call, a stall of more than four is dropped rather than replayed at once
+int fixedSteps(Uint32 now, Uint64& done, int rate)
+{
+    Uint64 target = (Uint64)now * rate / 1000;
+    if (done == 0 || target < done)
+        done = target;
+
+    int steps = (int)std::min<Uint64>(target - done, 4);
+    done = target;
+    return steps;
+}
 
+//living npcs block the player, the server and client prediction must agree on this exactly
+void pushPlayer(Player* p, std::vector<Start_men*>& npcs)
+{
+    for (size_t n = 0; n < npcs.size(); n++)
+    {
+        if (npcs[n]->hp > 0)
+            p->move(npcs[n]->Collider);
     }
+}
 
+//the script host gets a player of its own far off the map, so npcs spawn but nobody trips the level's single player triggers
+World::World() : ghost(-10000, -10000), host(&tilemap, &ghost, NULL, NULL, NULL)
+{
+    for (int i = 0; i < net_players; i++)
+        players[i] = NULL;
+    host.scheduler = &scheduler;
+    ticks = 0;
+    fights = false;
+    fighter = foe = -1;
+    won = lost = 0;
 }
 
-Player::~Player()
+World::~World()
 {
-    player_texture.free();
+    for (int i = 0; i < net_players; i++)
+        delete players[i];
+}
+
+bool World::load(int level)
+{
+    const LevelInfo* info = Levels::find(level);
 
-    if (save != "0")
+    if (info == NULL || !assets.load(info))
     {
-        std::ofstream plik;
+        printf("Cannot load level %d\n", level);
+        return false;
+    }
 
-        plik.open("Assets/Saves/" + save + ".txt");
+    tilemap.set();
+    tilemap.loadLevel(&assets);
+    host.add(&assets.script);
+    return true;
+}
 
-        plik << nick << std::endl << id << std::endl<<health << std::endl << strenght;
+int World::join()
+{
+    for (int i = 0; i < net_players; i++)
+    {
+        if (players[i] == NULL)
+        {
+            players[i] = new Player(40 + i * 40, 40);
+            players[i]->health = 100;
+            players[i]->strenght = 10;
+            return i;
+        }
     }
-
+    return -1;
 }
 
-Start_men::Start_men(int x, int y)
+void World::leave(int slot)
 {
-    hp = 50;
-    strenght = 1;
-    int w = 32;
-    int h = 32;
-    Collider.x = x;
-    Collider.y = y;
-    Collider.w = w;
-    Collider.h = h;
+    if (fighter == slot)
+        fighter = foe = -1;
 
-    down[0].x = 0;
-    down[0].y = 0;
-    down[0].w = w;
-    down[0].h = h;
+    delete players[slot];
+    players[slot] = NULL;
+}
 
-    down[1].x = 32;
-    down[1].y = 0;
-    down[1].w = w;
-    down[1].h = h;
+void World::step(Uint8* buttons)
+{
+    Uint8 keys[SDL_NUM_SCANCODES];
 
-    down[2].x = 64;
-    down[2].y = 0;
-    down[2].w = w;
-    down[2].h = h;
+    for (int i = 0; i < net_players; i++)
+    {
+        if (players[i] != NULL && !(i == fighter && foe != -1))
+            walkPlayer(players[i], buttonKeys(buttons[i], keys), &tilemap);
+    }
 
-    left[0].x = 0;
-    left[0].y = 32;
-    left[0].w = w;
-    left[0].h = h;
+    if (fights)
+        fight();
 
-    left[1].x = 32;
-    left[1].y = 32;
-    left[1].w = w;
-    left[1].h = h;
+    for (int i = 0; i < net_players; i++)
+    {
+        if (players[i] != NULL)
+            pushPlayer(players[i], host.npcs);
+    }
 
-    left[2].x = 64;
-    left[2].y = 32;
-    left[2].w = w;
-    left[2].h = h;
+    host.update();
 
-    right[0].x = 0;
-    right[0].y = 64;
-    right[0].w = w;
-    right[0].h = h;
+    scheduler.update();
 
-    right[1].x = 32;
-    right[1].y = 64;
-    right[1].w = w;
-    right[1].h = h;
+    ticks++;
+}
 
-    right[2].x = 64;
-    right[2].y = 64;
-    right[2].w = w;
-    right[2].h = h;
+//what a client's level script did to its player and to an npc, applied before the input's walk as the client did
+void World::apply(int slot, const NetInput& input)
+{
+    if (players[slot] != NULL)
+    {
+        players[slot]->Collider.x += input.dx;
+        players[slot]->Collider.y += input.dy;
+    }
 
-    up[0].x = 0;
-    up[0].y = 96;
-    up[0].w = w;
-    up[0].h = h;
+    if (input.npc >= 1 && input.npc <= (int)host.npcs.size())
+    {
+        Start_men* npc = host.npcs[input.npc - 1];
+        npc->Collider.x += input.npc_dx;
+        npc->Collider.y += input.npc_dy;
+        npc->hp = input.hp;
+    }
+}
 
-    up[1].x = 32;
-    up[1].y = 96;
-    up[1].w = w;
-    up[1].h = h;
+//walking into a living npc starts a fight, fought one exchange per tick like the fight screen does
+void World::fight()
+{
+    if (foe == -1)
+    {
+        for (size_t n = 0; n < host.npcs.size(); n++)
+        {
+            Start_men* npc = host.npcs[n];
 
-    up[2].x = 64;
-    up[2].y = 96;
-    up[2].w = w;
-    up[2].h = h;
+            //the fallen come back after ten seconds so the level never runs out of fights
+            if (npc->hp <= 0 && ticks % (10 * net_rate) == 0)
+                npc->hp = 50;
 
-    frame = 0;
+            for (int i = 0; i < net_players && foe == -1 && npc->hp > 0; i++)
+            {
+                if (players[i] != NULL && checkCollision(players[i]->Collider, npc->Collider))
+                {
+                    combat.start(ticks * 2654435761ULL + n, 25);
+                    combat.set(players[i]->health, players[i]->strenght, npc->hp, npc->strenght);
+                    fighter = i;
+                    foe = (int)n;
+                }
+            }
+        }
+        return;
+    }
 
-    ismoving = false;
+    combat.attack();
 
-    lastx = 0;
-    lasty = -1;
+    if (!combat.over())
+        return;
 
-    load();
+    Player* p = players[fighter];
+    host.npcs[foe]->hp = combat.enemy.hp > 0 ? combat.enemy.hp : 0;
+    p->health = combat.player.hp;
 
+    if (combat.won())
+    {
+        won++;
+    }
+    else
+    {
+        lost++;
+        p->health = 100;
+        p->Collider.x = 40 + fighter * 40;
+        p->Collider.y = 40;
+    }
+    fighter = foe = -1;
 }
 
-bool Start_men::load()
+void World::capture(NetSnapshot& snapshot)
 {
-    //mandar.png
-    if (npc_texture.loadFromFile("Assets/oldman/old.png") == false)
+    snapshot.tick = ticks;
+    snapshot.active = 0;
+
+    for (int i = 0; i < net_players; i++)
     {
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search NPC texture file. Please reinstall game :)", NULL);
-        printf("Failed to load old man texture\n");
-        return false;
+        if (players[i] == NULL)
+            continue;
+        snapshot.active |= 1 << i;
+        toEntity(players[i], players[i]->health, snapshot.entities[i]);
     }
-    else
+
+    for (size_t n = 0; n < host.npcs.size() && net_players + (int)n < net_entities; n++)
     {
-        return true;
+        snapshot.active |= 1 << (net_players + n);
+        toEntity(host.npcs[n], host.npcs[n]->hp, snapshot.entities[net_players + n]);
     }
 }
 
-void Start_men::render()
+//what this world holds on the heap besides itself, textures are never created headless
+size_t World::footprint()
 {
+    size_t bytes = sizeof(World);
 
-    SDL_Rect* current;
+    for (int i = 0; i < net_players; i++)
+    {
+        if (players[i] != NULL)
+            bytes += sizeof(Player);
+    }
 
-    if (ismoving)
+    bytes += tilemap.objects.runs.capacity() * sizeof(TileRun) + tilemap.objects.tiles.capacity() * sizeof(Uint16);
+    bytes += host.npcs.capacity() * sizeof(Start_men*) + host.npcs.size() * sizeof(Start_men);
+    bytes += host.scripts.capacity() * sizeof(Script);
+    bytes += assets.script.capacity() * sizeof(Uint32);
+    for (size_t i = 0; i < assets.dialog.size(); i++)
+        bytes += sizeof(std::string) + assets.dialog[i].capacity();
+    if (assets.npc != NULL)
+        bytes += assets.npc->pitch * assets.npc->h;
+
+    bytes += scheduler.waiting.capacity() * sizeof(Until*) + scheduler.movers.capacity() * sizeof(Arrive*);
+    bytes += scheduler.cutscenes.capacity() * sizeof(Cutscene) + scheduler.ready.capacity() * sizeof(std::coroutine_handle<>);
+    return bytes;
+}
+
+NetServer::NetServer()
+{
+    SDL_memset(peers, 0, sizeof(peers));
+    SDL_memset(history, 0, sizeof(history));
+}
+
+bool NetServer::open(Uint16 port, int level)
+{
+    if (!world.load(level) || !socket.open(port))
+        return false;
+
+    //ticks start at 1 so 0 can mean "no snapshot yet"
+    world.ticks = 1;
+    printf("Serving level %d on UDP port %d at %d ticks per second\n", level, port, net_rate);
+    return true;
+}
+
+void NetServer::run(int seconds)
+{
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+    Uint64 next = SDL_GetPerformanceCounter();
+
+    while (seconds == 0 || world.ticks < (Uint32)(seconds * net_rate))
     {
+        tick();
+
+        next += frequency / net_rate;
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (next > now)
+            SDL_Delay((Uint32)((next - now) * 1000 / frequency));
+        else if (now - next > frequency)
+            next = now;
+    }
+}
 
-        if (frame / 20 >= 3)
+void NetServer::tick()
+{
+    receive();
+
+    //one input per client per tick, a client that stalls keeps walking the way it last asked to;
+    //inputs skipped to catch up still apply their script effects, only their walking is dropped
+    Uint8 buttons[net_players];
+    for (int i = 0; i < net_players; i++)
+    {
+        NetPeer& peer = peers[i];
+        while (peer.connected && peer.received - peer.processed > 8)
         {
-            frame = 0;
+            peer.processed++;
+            world.apply(i, peer.inputs[peer.processed % net_inputs]);
         }
-        else
+        if (peer.connected && peer.processed < peer.received)
         {
-            if (lastx == -1)
-            {
-                current = &left[frame / 20];
-            }
-            else if (lasty == 1)
-            {
-                current = &up[frame / 20];
-            }
-            else
-            {
-                current = &down[frame / 20];
-            }
+            peer.processed++;
+            NetInput& input = peer.inputs[peer.processed % net_inputs];
+            peer.held = input.buttons;
+            world.apply(i, input);
+        }
+        buttons[i] = peer.connected ? peer.held : 0;
+    }
 
-            npc_texture.render(Collider.x, Collider.y, current);
+    world.step(buttons);
+    world.capture(history[world.ticks % net_history]);
 
-            frame++;
+    send();
+
+    for (int i = 0; i < net_players; i++)
+    {
+        if (peers[i].connected && world.ticks - peers[i].heard > (Uint32)(5 * net_rate))
+        {
+            printf("Client %d timed out\n", i);
+            peers[i].connected = false;
+            world.leave(i);
         }
     }
-    else
+
+    if (world.ticks % (5 * net_rate) == 0)
+        report();
+}
+
+void NetServer::receive()
+{
+    Uint8 data[1024];
+    NetAddress from;
+    int size;
+
+    while ((size = socket.receive(data, sizeof(data), from)) > 0)
     {
-        if (lastx == -1)
+        int slot = -1;
+        for (int i = 0; i < net_players; i++)
         {
-            current = &left[0];
+            if (peers[i].connected && peers[i].address.host == from.host && peers[i].address.port == from.port)
+                slot = i;
         }
-        else if (lasty == 1)
+
+        if (data[0] == NET_HELLO)
         {
-            current = &up[0];
+            if (slot == -1)
+            {
+                slot = world.join();
+                if (slot == -1)
+                    continue;
+
+                SDL_memset(&peers[slot], 0, sizeof(NetPeer));
+                peers[slot].address = from;
+                peers[slot].connected = true;
+                peers[slot].heard = world.ticks;
+                printf("Client %d joined\n", slot);
+            }
+
+            Uint8 welcome[2] = { NET_WELCOME, (Uint8)slot };
+            socket.send(from, welcome, 2);
+            continue;
         }
-        else
+
+        if (slot == -1)
+            continue;
+
+        NetPeer& peer = peers[slot];
+        peer.bytes_in += size;
+        peer.heard = world.ticks;
+
+        if (data[0] == NET_BYE)
         {
-            current = &down[0];
+            printf("Client %d left\n", slot);
+            peer.connected = false;
+            world.leave(slot);
         }
+        else if (data[0] == NET_INPUT && size >= 16)
+        {
+            //[type][acked snapshot][newest seq][client ms][rtt ms 2 bytes][count][count inputs ending at newest seq]
+            Uint32 acked = get32(data + 1);
+            Uint32 seq = get32(data + 5);
+            int count = data[15];
+
+            NetInput got[net_inputs];
+            int at = 16;
+            for (int k = 0; k < count && at > 0 && count <= net_inputs; k++)
+            {
+                int len = readInput(data + at, size - at, got[k]);
+                at = len < 0 ? -1 : at + len;
+            }
 
-        npc_texture.render(Collider.x, Collider.y, current);
+            if (at < 0 || count > net_inputs)
+                continue;
 
-    }
+            if (acked > peer.acked && acked <= world.ticks)
+                peer.acked = acked;
 
+            if (seq > peer.received)
+            {
+                for (int k = 0; k < count; k++)
+                {
+                    Uint32 s = seq - count + 1 + k;
+                    if (s > peer.received)
+                        peer.inputs[s % net_inputs] = got[k];
+                }
+                peer.received = seq;
+                peer.echo = get32(data + 9);
+                peer.rtt = data[13] | (data[14] << 8);
+            }
+        }
+    }
 }
 
+void NetServer::send()
+{
+    Uint32 tick = world.ticks;
+    NetSnapshot& current = history[tick % net_history];
+
+    for (int i = 0; i < net_players; i++)
+    {
+        NetPeer& peer = peers[i];
+        if (!peer.connected)
+            continue;
+
+        //delta against the newest snapshot the client confirmed, a full one once that has left the history
+        NetSnapshot* baseline = NULL;
+        if (peer.acked != 0 && tick - peer.acked < (Uint32)net_history && history[peer.acked % net_history].tick == peer.acked)
+            baseline = &history[peer.acked % net_history];
+
+        //[type][slot][tick][baseline tick or 0][last input applied][echoed client ms][snapshot]
+        Uint8 data[1024];
+        data[0] = NET_SNAPSHOT;
+        data[1] = (Uint8)i;
+        put32(data + 2, tick);
+        put32(data + 6, baseline != NULL ? peer.acked : 0);
+        put32(data + 10, peer.processed);
+        put32(data + 14, peer.echo);
+        int size = 18 + writeSnapshot(current, baseline, data + 18);
+
+        socket.send(peer.address, data, size);
+        peer.bytes_out += size;
+    }
+}
 
-Animation::Animation(float s, char d)
+void NetServer::report()
 {
-    direction = d;
-    seconds = s;
-    timer.set_seconds(seconds);
-    animation = false;
+    int ticks = 5 * net_rate;
+    for (int i = 0; i < net_players; i++)
+    {
+        NetPeer& peer = peers[i];
+        if (!peer.connected)
+            continue;
+
+        printf("Client %d: %.1f bytes/tick out, %.1f bytes/tick in, rtt %u ms, baseline %u ticks old, %u inputs queued\n", i,
+            peer.bytes_out / (double)ticks, peer.bytes_in / (double)ticks, peer.rtt, world.ticks - peer.acked, peer.received - peer.processed);
+        peer.bytes_out = peer.bytes_in = 0;
+    }
 }
 
-void Animation::start()
+NetClient::NetClient()
 {
-    animation = true;
-    timer.start();
+    SDL_memset(&server, 0, sizeof(server));
+    slot = -1;
+    seq = acked = processed = rtt = ticks = corrections = 0;
+    bytes_in = bytes_out = 0;
+    SDL_memset(&latest, 0, sizeof(latest));
+    SDL_memset(history, 0, sizeof(history));
+    SDL_memset(inputs, 0, sizeof(inputs));
+    pending = NetInput();
+    effects.reserve(16);
+    for (int i = 0; i < net_players; i++)
+        remotes[i] = NULL;
+    stepped = 0;
 }
 
-void Animation::check()
+NetClient::~NetClient()
 {
-    if (timer.morethanseconds())
-    {
-        animation = false;
-    }
+    for (int i = 0; i < net_players; i++)
+        delete remotes[i];
 }
 
-void Animation::anim(NPC* npc)
+//visible clients load a sprite for every other player, bots skip that
+bool NetClient::connect(NetAddress& to, bool visible)
 {
-    if (animation)
+    if (!socket.open(0))
+        return false;
+
+    server = to;
+
+    Uint8 data[64];
+    NetAddress from;
+    Uint32 start = SDL_GetTicks();
+
+    for (int attempt = 0; SDL_GetTicks() - start < 3000; attempt++)
     {
-        npc->ismoving = true;
-        if (direction == 's')
-        {
-            npc->lasty = -1;
-            npc->lastx = 0;
-            npc->Collider.y++;
-        }
-        else if (direction == 'w')
+        Uint8 hello = NET_HELLO;
+        socket.send(server, &hello, 1);
+        SDL_Delay(100);
+
+        int size;
+        while ((size = socket.receive(data, sizeof(data), from)) > 0)
         {
-            npc->lasty = 0;
-            npc->lastx = -1;
-            npc->Collider.x--;
+            if (size >= 2 && data[0] == NET_WELCOME && from.host == server.host && from.port == server.port)
+                slot = data[1];
         }
-        else if (direction == 'n')
+
+        if (slot != -1)
+            break;
+    }
+
+    if (slot == -1)
+    {
+        socket.close();
+        return false;
+    }
+
+    if (visible)
+    {
+        for (int i = 0; i < net_players; i++)
         {
-            npc->lasty = 1;
-            npc->lastx = 0;
-            npc->Collider.y--;
+            remotes[i] = new Player(0, 0);
+            remotes[i]->id = std::to_string(i % 4 + 1);
+            remotes[i]->load();
         }
-        else if (direction == 'e')
+    }
+
+    printf("Joined as player %d\n", slot);
+    return true;
+}
+
+//the client side of World::apply, replayed over the server's snapshot like the walking is
+static void applyEffects(const NetInput& input, Player* p, ScriptHost* host)
+{
+    p->Collider.x += input.dx;
+    p->Collider.y += input.dy;
+
+    if (host != NULL && input.npc >= 1 && input.npc <= (int)host->npcs.size())
+    {
+        Start_men* npc = host->npcs[input.npc - 1];
+        npc->Collider.x += input.npc_dx;
+        npc->Collider.y += input.npc_dy;
+        npc->hp = input.hp;
+    }
+}
+
+//the level script moved the local player, the move goes to the server with the next input
+void NetClient::nudge(int dx, int dy)
+{
+    pending.dx += (Sint16)dx;
+    pending.dy += (Sint16)dy;
+}
+
+//the level script moved or hurt an npc, effects on the same npc are merged until one can be sent
+void NetClient::effect(int npc, int dx, int dy, int hp)
+{
+    for (size_t i = 0; i < effects.size(); i++)
+    {
+        if (effects[i].npc == npc)
         {
-            npc->lasty = 0;
-            npc->lastx = 1;
-            npc->Collider.x++;
+            effects[i].npc_dx += (Sint16)dx;
+            effects[i].npc_dy += (Sint16)dy;
+            effects[i].hp = (Sint16)hp;
+            return;
         }
     }
-    else
+
+    NetInput input = NetInput();
+    input.npc = (Uint8)npc;
+    input.npc_dx = (Sint16)dx;
+    input.npc_dy = (Sint16)dy;
+    input.hp = (Sint16)hp;
+    effects.push_back(input);
+}
+
+//steps at the server's net_rate whatever the frame rate is, so prediction and the server walk the same distance per input
+void NetClient::tick(Player* p, const Uint8* keys, Tilemap* t, ScriptHost* host)
+{
+    if (receive())
+        reconcile(p, t, host);
+
+    for (int steps = fixedSteps(getTicks(), stepped, net_rate); steps > 0; steps--)
+        step(p, keys, t, host);
+}
+
+void NetClient::step(Player* p, const Uint8* keys, Tilemap* t, ScriptHost* host)
+{
+    //predict right away instead of waiting a round trip for the server to move us
+    //the script effects already happened here, they only ride along so the server can repeat them
+    Uint8 held[SDL_NUM_SCANCODES];
+    seq++;
+    NetInput& input = inputs[seq % net_inputs];
+    input = pending;
+    input.buttons = p->keyboard_active ? netButtons(keys) : 0;
+    pending = NetInput();
+    if (!effects.empty())
     {
-        npc->ismoving = false;
+        input.npc = effects[0].npc;
+        input.npc_dx = effects[0].npc_dx;
+        input.npc_dy = effects[0].npc_dy;
+        input.hp = effects[0].hp;
+        effects.erase(effects.begin());
     }
+    walkPlayer(p, buttonKeys(input.buttons, held), t);
+    if (host != NULL)
+        pushPlayer(p, host->npcs);
+
+    //the last few inputs ride along so a lost packet does not lose a step
+    int count = seq < 8 ? (int)seq : 8;
+    Uint8 data[256];
+    data[0] = NET_INPUT;
+    put32(data + 1, acked);
+    put32(data + 5, seq);
+    put32(data + 9, SDL_GetTicks());
+    data[13] = (Uint8)rtt;
+    data[14] = (Uint8)(rtt >> 8);
+    data[15] = (Uint8)count;
+    int size = 16;
+    for (int k = 0; k < count; k++)
+        size += writeInput(inputs[(seq - count + 1 + k) % net_inputs], data + size);
+
+    socket.send(server, data, size);
+    bytes_out += size;
+
+    ticks++;
+    if (ticks % (5 * net_rate) == 0)
+        report();
 }
 
-void Animation::anim(Player* player)
+//true when a newer snapshot arrived
+bool NetClient::receive()
 {
-    if (animation)
+    Uint8 data[1024];
+    NetAddress from;
+    int size;
+    bool newer = false;
+
+    while ((size = socket.receive(data, sizeof(data), from)) > 0)
     {
-        player->keyboard_active = false;
-        if (direction == 's')
-        {
-            player->lasty = -1;
-            player->lastx = 0;
-            player->Collider.y++;
-        }
-        else if (direction == 'w')
-        {
-            player->lasty = 0;
-            player->lastx = -1;
-            player->Collider.x--;
-        }
-        else if (direction == 'n')
-        {
-            player->lasty = 1;
-            player->lastx = 0;
-            player->Collider.y--;
-        }
-        else if (direction == 'e')
+        bytes_in += size;
+
+        if (from.host != server.host || from.port != server.port || size < 18 || data[0] != NET_SNAPSHOT)
+            continue;
+
+        Uint32 tick = get32(data + 2);
+        Uint32 baseline = get32(data + 6);
+        if (tick <= latest.tick)
+            continue;
+
+        NetSnapshot* base = NULL;
+        if (baseline != 0)
         {
-            player->lasty = 0;
-            player->lastx = 1;
-            player->Collider.x++;
+            base = &history[baseline % net_history];
+            if (base->tick != baseline)
+                continue;
         }
+
+        NetSnapshot& into = history[tick % net_history];
+        into.tick = 0;
+        if (readSnapshot(data + 18, size - 18, base, into) < 0)
+            continue;
+        into.tick = tick;
+
+        latest = into;
+        acked = tick;
+        processed = get32(data + 10);
+        rtt = SDL_GetTicks() - get32(data + 14);
+        newer = true;
     }
-    else
-    {
-        player->keyboard_active = true;
-        player->ismoving = false;
-    }
+    return newer;
 }
 
-Dialog::Dialog(std::string path)
+//take the server's word for everything, then replay the inputs it has not seen yet
+void NetClient::reconcile(Player* p, Tilemap* t, ScriptHost* host)
 {
-    next.set_seconds(5.0f);
-    page = 0;
-    back.loadFromFile("Assets/Gui/dialog.png");
-    view = false;
-    to_hide = false;
-    i = 0;
-    std::fstream plik;
-    plik.open("Assets/dialog/" + path, std::ios::in);
-    if (!plik.good())
+    for (int i = 0; i < net_players; i++)
     {
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search dialog file. Please reinstall game :)", NULL);
-        printf("Dialog isn't working");
+        if (remotes[i] != NULL && i != slot && (latest.active & (1 << i)))
+        {
+            fromEntity(latest.entities[i], remotes[i]);
+            remotes[i]->health = latest.entities[i].hp;
+        }
     }
-    else
+
+    if (host != NULL)
     {
-        std::string linia;
-        while (std::getline(plik, linia))
+        for (size_t n = 0; n < host->npcs.size() && net_players + (int)n < net_entities; n++)
         {
-            texts[i] = linia;
-            i++;
+            if (latest.active & (1 << (net_players + n)))
+            {
+                fromEntity(latest.entities[net_players + n], host->npcs[n]);
+                host->npcs[n]->hp = latest.entities[net_players + n].hp;
+            }
         }
+    }
+
+    if ((latest.active & (1 << slot)) == 0)
+        return;
+
+    int predicted_x = p->Collider.x;
+    int predicted_y = p->Collider.y;
+    bool active = p->keyboard_active;
+
+    fromEntity(latest.entities[slot], p);
 
+    Uint8 held[SDL_NUM_SCANCODES];
+    p->keyboard_active = true;
+    for (Uint32 s = processed + 1; s <= seq && seq - s < (Uint32)net_inputs; s++)
+    {
+        NetInput& input = inputs[s % net_inputs];
+        applyEffects(input, p, host);
+        walkPlayer(p, buttonKeys(input.buttons, held), t);
+        if (host != NULL)
+            pushPlayer(p, host->npcs);
     }
-    max_pages = ceil(i / 5);
-    pixels[0] = 600;
-    pixels[1] = 630;
-    pixels[2] = 660;
-    pixels[3] = 690;
-    pixels[4] = 720;
+    p->keyboard_active = active;
+
+    //effects still waiting to be sent happened after the last input
+    applyEffects(pending, p, host);
+    for (size_t i = 0; i < effects.size(); i++)
+        applyEffects(effects[i], p, host);
+
+    if (p->Collider.x != predicted_x || p->Collider.y != predicted_y)
+        corrections++;
 }
 
-void Dialog::next_page(SDL_Event& e)
+void NetClient::render()
 {
-    if (e.type == SDL_KEYDOWN)
+    for (int i = 0; i < net_players; i++)
     {
-        if (e.key.keysym.sym == SDLK_RETURN)
-        {
-            if (page + 1 <= max_pages)
-                page++;
-            else
-                view = false;
-        }
+        if (remotes[i] != NULL && i != slot && (latest.active & (1 << i)))
+            remotes[i]->render();
     }
-    if (next.morethanseconds())
-    {
-        if (to_hide)
-            view = false;
+}
 
-        if (page + 1 <= max_pages && !to_hide)
-        {
-            page++;
-            next.start();
-        }
-        else if (page + 1 > max_pages && !to_hide)
-        {
-            next.start();
-            to_hide = true;
-        }
+void NetClient::disconnect()
+{
+    if (slot == -1)
+        return;
 
-    }
+    Uint8 bye = NET_BYE;
+    socket.send(server, &bye, 1);
+    socket.close();
+    slot = -1;
 }
 
-void Dialog::start()
+void NetClient::report()
 {
-    view = true;
-    next.start();
+    double per_tick = ticks > 0 ? 1.0 / ticks : 0;
+    printf("Player %d: %.1f bytes/tick in, %.1f bytes/tick out, rtt %u ms, %u predictions corrected in %u ticks\n", slot,
+        bytes_in * per_tick, bytes_out * per_tick, rtt, corrections, ticks);
 }
 
+void runServer(Uint16 port, int seconds)
+{
+    gPack.open("Assets.pack");
 
-void Dialog::draw()
+    NetServer* server = new NetServer;
+    if (server->open(port, 1))
+        server->run(seconds);
+    delete server;
+
+    gPack.close();
+}
+
+//headless clients that wander at random, for load testing a server without opening windows
+void runBots(NetAddress& server, int count, int seconds)
 {
-    if (view)
+    gPack.open("Assets.pack");
+
+    World* map = new World;
+    if (!map->load(1))
     {
-        back.render(0, 600);
-        int ile = (page + 1) * 5;
-        if (ile > i)
+        delete map;
+        gPack.close();
+        return;
+    }
+
+    std::vector<NetClient*> bots;
+    std::vector<Player*> players;
+    for (int i = 0; i < count; i++)
+    {
+        NetClient* bot = new NetClient;
+        if (!bot->connect(server, false))
         {
-            int r = ile - i;
-            ile -= r;
+            printf("Bot %d cannot reach the server\n", i);
+            delete bot;
+            continue;
         }
-        int k = 0;
-        for (int j = page * 5; j < ile; j++)
+        bots.push_back(bot);
+        players.push_back(new Player(40, 40));
+    }
+
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+    Uint64 next = SDL_GetPerformanceCounter();
+    Uint64 random = 1;
+    std::vector<Uint8> buttons(bots.size(), 0);
+    Uint8 keys[SDL_NUM_SCANCODES];
+    static const Uint8 walks[5] = { 0, NET_LEFT, NET_RIGHT, NET_UP, NET_DOWN };
+
+    for (Uint32 tick = 0; !bots.empty() && (seconds == 0 || tick < (Uint32)(seconds * net_rate)); tick++)
+    {
+        for (size_t i = 0; i < bots.size(); i++)
         {
-            text.loadFromRenderedText(texts[j], white);
-            text.render(0, pixels[k]);
-            k++;
+            if (tick % 30 == i % 30)
+            {
+                random = random * 6364136223846793005ULL + 1442695040888963407ULL;
+                buttons[i] = walks[(random >> 33) % 5];
+            }
+            bots[i]->tick(players[i], buttonKeys(buttons[i], keys), &map->tilemap, NULL);
         }
+
+        next += frequency / net_rate;
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (next > now)
+            SDL_Delay((Uint32)((next - now) * 1000 / frequency));
+    }
+
+    for (size_t i = 0; i < bots.size(); i++)
+    {
+        bots[i]->report();
+        bots[i]->disconnect();
+        delete bots[i];
+        delete players[i];
     }
+    delete map;
+    gPack.close();
 }
 
-bool Dialog::active_dialog()
+InstanceServer::InstanceServer()
 {
-    return view;
+    players = 0;
+    SDL_AtomicSet(&quit, 0);
 }
 
-Input::Input(int x, int y)
+InstanceServer::~InstanceServer()
 {
-    Collider.x = x;
-    Collider.y = y;
-    write = false;
-    renderText = false;
-    text = "some text";
-    Collider.w = 100;
-    Collider.h = 50;
-    mPosition.x = 0;
-    mPosition.y = 0;
+    stop();
+
+    for (World* world : worlds)
+        delete world;
 }
 
-void Input::inputtext(SDL_Event& e)
+bool InstanceServer::start(int instances, int workers, int players)
 {
+    this->players = players;
 
-    if (e.type == SDL_TEXTINPUT && write == true)
+    for (int i = 0; i < instances; i++)
     {
-        text += e.text.text;
+        World* world = new World;
+        if (!world->load(1))
+        {
+            delete world;
+            return false;
+        }
 
+        world->fights = true;
+        for (int p = 0; p < players && p < net_players; p++)
+            world->join();
+        worlds.push_back(world);
     }
-    if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_BACKSPACE && text.length() > 0 && write == true)
+
+    //value initialised, so every counter starts at 0
+    stats.resize(worlds.size());
+
+    if (workers <= 0)
+        workers = SDL_GetCPUCount();
+    if (workers > instances)
+        workers = instances;
+
+    shards.resize(workers);
+    for (int i = 0; i < workers; i++)
     {
-        text = text.substr(0, text.length() - 1);
+        shards[i].server = this;
+        shards[i].first = i * instances / workers;
+        shards[i].count = (i + 1) * instances / workers - shards[i].first;
+        shards[i].thread = NULL;
+        SDL_AtomicSet(&shards[i].late, 0);
+    }
 
+    for (int i = 0; i < workers; i++)
+    {
+        shards[i].thread = SDL_CreateThread(worker, "instances", &shards[i]);
+        if (shards[i].thread == NULL)
+        {
+            printf("Cannot start instance worker! SDL Error: %s\n", SDL_GetError());
+            stop();
+            return false;
+        }
     }
 
+    printf("Running %d instances of level 1 with %d players each on %d workers at %d ticks per second\n", instances, players, workers, net_rate);
+    return true;
 }
 
-void Input::inside(int x, int y, SDL_Event& e)
+int InstanceServer::worker(void* data)
 {
-    mPosition.x = x;
-    mPosition.y = y;
-    bool yes = true;
-    if (e.type == SDL_MOUSEMOTION || e.type == SDL_MOUSEBUTTONDOWN || e.type == SDL_MOUSEBUTTONUP)
+    InstanceShard* shard = (InstanceShard*)data;
+    InstanceServer* server = shard->server;
+
+    static const Uint8 walks[5] = { 0, NET_LEFT, NET_RIGHT, NET_UP, NET_DOWN };
+    Uint8 buttons[net_players];
+
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+    Uint64 next = SDL_GetPerformanceCounter();
+
+    while (SDL_AtomicGet(&server->quit) == 0)
     {
-        if (Collider.x > mPosition.x)
-        {
-            yes = false;
-        }
-        else if (Collider.x + Collider.w < mPosition.x)
-        {
-            yes = false;
-        }
-        else if (Collider.y > mPosition.y)
+        for (int w = shard->first; w < shard->first + shard->count; w++)
         {
-            yes = false;
-        }
-        else if (Collider.y + Collider.h < mPosition.y)
-        {
-            yes = false;
-        }
+            World* world = server->worlds[w];
+            InstanceStats& stats = server->stats[w];
 
-        if (yes)
-        {
-            switch (e.type)
+            //players wander, picking a new direction every half second
+            for (int i = 0; i < net_players; i++)
             {
-            case SDL_MOUSEBUTTONDOWN:
-                write = true;
-                break;
-            default:
-                break;
+                Uint32 h = (Uint32)w * 73856093u ^ (Uint32)i * 19349663u ^ (world->ticks / 30) * 83492791u;
+                h ^= h >> 13;
+                h *= 0x5BD1E995u;
+                h ^= h >> 15;
+                buttons[i] = walks[h % 5];
             }
+
+            Uint64 start = SDL_GetPerformanceCounter();
+            world->step(buttons);
+            int us = (int)((SDL_GetPerformanceCounter() - start) * 1000000 / frequency);
+
+            SDL_AtomicAdd(&stats.tick_us, us);
+            SDL_AtomicAdd(&stats.ticks, 1);
+            if (us > SDL_AtomicGet(&stats.peak_us))
+                SDL_AtomicSet(&stats.peak_us, us);
+            if (world->ticks % net_rate == 1)
+                SDL_AtomicSet(&stats.bytes, (int)world->footprint());
+        }
+
+        next += frequency / net_rate;
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (next > now)
+        {
+            SDL_Delay((Uint32)((next - now) * 1000 / frequency));
         }
         else
         {
-            switch (e.type)
-            {
-            case SDL_MOUSEBUTTONDOWN:
-                write = false;
-                break;
-            default:
-                break;
-            }
+            //the whole shard overran its slot, catch up but never spiral
+            SDL_AtomicAdd(&shard->late, 1);
+            if (now - next > frequency)
+                next = now;
         }
-
     }
-
+    return 0;
 }
 
-void Input::render()
+void InstanceServer::run(int seconds)
 {
+    Uint32 start = SDL_GetTicks();
+    Uint32 reported = start;
 
-    texttexture.to_input(Collider);
-
-    if (text != "")
+    while (seconds == 0 || SDL_GetTicks() - start < (Uint32)seconds * 1000)
     {
-        texttexture.loadFromRenderedText(text.c_str(), white);
-    }
-    else
-    {
-        texttexture.loadFromRenderedText(" ", white);
-    }
+        SDL_Delay(100);
 
-    texttexture.render(Collider.x + 10, Collider.y + 10);
+        if (SDL_GetTicks() - reported >= 5000)
+        {
+            report();
+            reported = SDL_GetTicks();
+        }
+    }
 
-    Collider.w += 20;
-    Collider.h += 20;
+    stop();
 
-    if (write)
+    //the full table only once, at the end
+    for (size_t w = 0; w < worlds.size(); w++)
     {
-        SDL_SetRenderDrawColor(gRenderer, 232, 28, 255, 255);
+        printf("Instance %d: %u ticks, %.1f us peak tick, %.1f KB, %u fights won, %u lost\n", (int)w, worlds[w]->ticks,
+            (double)SDL_AtomicGet(&stats[w].peak_us), SDL_AtomicGet(&stats[w].bytes) / 1024.0, worlds[w]->won, worlds[w]->lost);
     }
-    else
+}
+
+void InstanceServer::report()
+{
+    Uint64 time = 0, ticks = 0, bytes = 0;
+    int worst = 0, worst_us = -1;
+
+    for (size_t w = 0; w < worlds.size(); w++)
     {
+        time += SDL_AtomicSet(&stats[w].tick_us, 0);
+        ticks += SDL_AtomicSet(&stats[w].ticks, 0);
+        bytes += SDL_AtomicGet(&stats[w].bytes);
 
-        SDL_SetRenderDrawColor(gRenderer, 227, 117, 240, 255);
+        int peak = SDL_AtomicSet(&stats[w].peak_us, 0);
+        if (peak > worst_us)
+        {
+            worst_us = peak;
+            worst = (int)w;
+        }
     }
 
-    SDL_RenderDrawRect(gRenderer, &Collider);
+    int late = 0;
+    for (size_t i = 0; i < shards.size(); i++)
+        late += SDL_AtomicSet(&shards[i].late, 0);
 
+    printf("%d instances on %d workers: %.1f ticks/s each, %.1f us per tick, instance %d peaked at %d us, %d late shard ticks, %.1f KB per instance\n",
+        (int)worlds.size(), (int)shards.size(), ticks / 5.0 / worlds.size(), ticks > 0 ? (double)time / ticks : 0.0, worst, worst_us, late,
+        bytes / 1024.0 / worlds.size());
 }
 
-
-Button::Button(std::string pathin, std::string pathout)
+void InstanceServer::stop()
 {
-    mPosition.x = 0;
-    mPosition.y = 0;
-    BUTTON_WIDTH = 200;
-    BUTTON_HEIGHT = 100;
-    if (mousein.loadFromFile(pathin) == false || mouseuot.loadFromFile(pathout) == false)
+    SDL_AtomicSet(&quit, 1);
+
+    for (size_t i = 0; i < shards.size(); i++)
     {
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search someone of button texture. Please reinstall game :)", NULL);
-        exit(0);
+        if (shards[i].thread != NULL)
+            SDL_WaitThread(shards[i].thread, NULL);
+        shards[i].thread = NULL;
     }
-
-    inside = false;
 }
 
-void Button::setPosistion(int x, int y)
+void runInstances(int instances, int workers, int players, int seconds)
 {
-    mPosition.x = x;
-    mPosition.y = y;
+    gPack.open("Assets.pack");
+
+    InstanceServer* server = new InstanceServer;
+    if (server->start(instances, workers, players))
+        server->run(seconds);
+    delete server;
+
+    gPack.close();
 }
 
-int Button::handleEvent(SDL_Event* e)
+//level 1 drawn once through SDL's software renderer and once through SoftRaster, no window and no GPU involved
+bool runRaster(std::string output, std::string golden, int frames, int threads)
 {
-    int klik = 0;
+    if (SDL_Init(0) < 0 || !(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG) || TTF_Init() == -1)
+    {
+        printf("Cannot initialise SDL for rasterising! SDL Error: %s\n", SDL_GetError());
+        return false;
+    }
+
+    SDL_Surface* target = SDL_CreateRGBSurfaceWithFormat(0, screen_width, screen_height, 32, SDL_PIXELFORMAT_ARGB8888);
+    gRenderer = target != NULL ? SDL_CreateSoftwareRenderer(target) : NULL;
+    if (gRenderer == NULL)
+    {
+        printf("Software renderer could not be created! SDL Error: %s\n", SDL_GetError());
+        return false;
+    }
+
+    if (threads <= 0)
+        threads = SDL_GetCPUCount();
+    if (frames < 1)
+        frames = 1;
+
+    bool match = true;
+    SoftRaster* raster = new SoftRaster(screen_width, screen_height, threads);
+    gRaster = raster;
 
-    if (e->type == SDL_MOUSEMOTION || e->type == SDL_MOUSEBUTTONDOWN || e->type == SDL_MOUSEBUTTONUP)
     {
-        int x, y;
-        SDL_GetMouseState(&x, &y);
-        inside = true;
-        if (x < mPosition.x)
+        Tilemap* t = new Tilemap;
+        Player p(600, 400);
+        p.id = "1";
+
+        LevelAssets level;
+        if (!loadMedia(t) || !p.load() || !level.load(Levels::find(1)))
         {
-            inside = false;
+            printf("Cannot load level 1 for rasterising\n");
+            match = false;
         }
-        else if (x > mPosition.x + BUTTON_WIDTH)
+
+        t->set();
+        t->loadLevel(&level);
+        Start_men npc(1000, 250, level.npc);
+
+        //text is left out, font hinting differs between SDL_ttf builds and would break the golden image
+        DrawList list;
+        DrawList::record(&list);
+        list.clear(0xFF, 0xFF, 0xFF, 0xFF);
+        t->show(0);
+        t->show(1);
+        p.render();
+        npc.render();
+        DrawList::record(NULL);
+
+        Uint64 frequency = SDL_GetPerformanceFrequency();
+        Uint64 start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < frames; i++)
         {
-            inside = false;
+            list.execute();
+            SDL_RenderFlush(gRenderer);
         }
-        else if (y < mPosition.y)
+        double sdl_us = (SDL_GetPerformanceCounter() - start) * 1000000.0 / frequency / frames;
+
+        start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < frames; i++)
+            raster->draw(&list);
+        double raster_us = (SDL_GetPerformanceCounter() - start) * 1000000.0 / frequency / frames;
+
+        int differ = 0;
+        for (int i = 0; i < screen_width * screen_height; i++)
         {
-            inside = false;
+            Uint32 sdl = ((Uint32*)target->pixels)[(i / screen_width) * target->pitch / 4 + i % screen_width];
+            if ((sdl | 0xFF000000) != raster->pixels[i])
+                differ++;
         }
-        else if (y > mPosition.y + BUTTON_HEIGHT)
+
+        printf("%d draw commands: SDL software renderer %.1f us/frame, SoftRaster on %d threads %.1f us/frame, %d pixels differ from SDL's rounding\n",
+            (int)list.commands.size(), sdl_us, threads, raster_us, differ);
+
+        SDL_Surface* frame = SDL_CreateRGBSurfaceWithFormatFrom(raster->pixels, screen_width, screen_height, 32, screen_width * 4, SDL_PIXELFORMAT_ARGB8888);
+        if (frame == NULL || IMG_SavePNG(frame, output.c_str()) != 0)
         {
-            inside = false;
+            printf("Cannot write %s! SDL_image Error: %s\n", output.c_str(), IMG_GetError());
+            match = false;
         }
+        SDL_FreeSurface(frame);
 
-        if (inside)
+        if (golden != "")
         {
+            SDL_Surface* loaded = IMG_Load(golden.c_str());
+            SDL_Surface* reference = loaded != NULL ? SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_ARGB8888, 0) : NULL;
+            SDL_FreeSurface(loaded);
 
-            switch (e->type)
+            int wrong = -1;
+            if (reference != NULL && reference->w == screen_width && reference->h == screen_height)
             {
-            case SDL_MOUSEBUTTONDOWN:
-                klik = 1;
-                break;
-            default:
-                break;
+                wrong = 0;
+                for (int y = 0; y < screen_height; y++)
+                {
+                    Uint32* row = (Uint32*)((Uint8*)reference->pixels + y * reference->pitch);
+                    for (int x = 0; x < screen_width; x++)
+                    {
+                        if (row[x] != raster->pixels[y * screen_width + x])
+                            wrong++;
+                    }
+                }
             }
-        }
-
-    }
-    return klik;
-}
-
-void Button::render()
-{
-    if (inside)
-    {
-        mouseuot.render(mPosition.x, mPosition.y);
-    }
-    else
-    {
-        mousein.render(mPosition.x, mPosition.y);
-    }
-}
+            SDL_FreeSurface(reference);
 
-Button::~Button()
-{
-    mousein.free();
-    mouseuot.free();
-}
+            if (wrong != 0)
+            {
+                printf(wrong < 0 ? "Golden image %s is missing or not %dx%d\n" : "%s: %d pixels differ from the golden image\n", golden.c_str(), wrong < 0 ? screen_width : wrong, screen_height);
+                match = false;
+            }
+            else
+            {
+                printf("%s: bit exact\n", golden.c_str());
+            }
+        }
 
-Eq::Eq(Player *p)
-{
-    show = false;
-    if (!eq.loadFromFile("Assets/Gui/UIEQ.png"))
-    {
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search UI image file. Please reinstall game :)", NULL);
-        printf("EQ UI graphics load failed");
+        t->free();
+        delete t;
     }
-        
 
-    nickname.loadFromRenderedText("Nazwa: "+p->nick, white);
-    hp.loadFromRenderedText("Punkty zycia: "+std::to_string(p->health), white);
-    power.loadFromRenderedText("Sila: "+std::to_string(p->strenght), white);
-}
+    gRaster = NULL;
+    delete raster;
 
-Eq::~Eq()
-{
-    eq.free();
-    nickname.free();
-    hp.free();
-    power.free();
+    TTF_CloseFont(gFont);
+    gFont = NULL;
+    gTextureCache.close();
+    gPack.close();
+    SDL_DestroyRenderer(gRenderer);
+    gRenderer = NULL;
+    SDL_FreeSurface(target);
+    TTF_Quit();
+    IMG_Quit();
+    SDL_Quit();
+    return match;
 }
 
-void Eq::draw()
+//count particles kept alive for frames steps of 1/60 s, integrated with and without SSE and drawn through SDL's software renderer
+void runParticles(int count, int frames)
 {
-    if (show)
+    if (SDL_Init(0) < 0)
     {
-        eq.render(0, 0);
-        nickname.render(5, 5);
-        hp.render(5, 45);
-        power.render(5, 85);
+        printf("Cannot initialise SDL for particles! SDL Error: %s\n", SDL_GetError());
+        return;
     }
-}
 
-void Eq::check_show(SDL_Event e)
-{
-  
-    if (e.type == SDL_KEYDOWN)
+    SDL_Surface* target = SDL_CreateRGBSurfaceWithFormat(0, screen_width, screen_height, 32, SDL_PIXELFORMAT_ARGB8888);
+    gRenderer = target != NULL ? SDL_CreateSoftwareRenderer(target) : NULL;
+    if (gRenderer == NULL)
+    {
+        printf("Software renderer could not be created! SDL Error: %s\n", SDL_GetError());
+        return;
+    }
+
+    if (frames < 1)
+        frames = 1;
+
+    Emitter e = { "bench", 0, 0.0f, 1000.0f, 0.0f, 60.0f, 60.0f, 0.0f, 360.0f, 0.0f, 0.0f, 2.0f, 255, 255, 255, 255, 255, 255, false };
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+
+    for (int pass = 0; pass < 2; pass++)
     {
-        if (e.key.keysym.sym == SDLK_e)
+        Particles* particles = new Particles;
+        particles->simd = particles->simd && pass == 0;
+        particles->emitters.push_back(e);
+        particles->emit(0, screen_width / 2.0f, screen_height / 2.0f, count);
+
+        //the first frame is left out, it is the one that touches the vertex buffers
+        particles->update(1.0f / 60.0f);
+        particles->render();
+        takeAllocations();
+
+        Uint64 update = 0, render = 0;
+        for (int i = 0; i < frames; i++)
         {
-            if (show)
-                show = false;
-            else if (!show)
-                show = true;
+            Uint64 start = SDL_GetPerformanceCounter();
+            particles->update(1.0f / 60.0f);
+            update += SDL_GetPerformanceCounter() - start;
+
+            start = SDL_GetPerformanceCounter();
+            particles->render();
+            SDL_RenderFlush(gRenderer);
+            render += SDL_GetPerformanceCounter() - start;
         }
+
+        printf("%d particles, %s: update %.1f us/frame, render %.1f us/frame, %d heap allocations over %d frames\n", particles->count,
+            particles->simd ? "SSE" : "scalar", update * 1000000.0 / frequency / frames, render * 1000000.0 / frequency / frames, takeAllocations(), frames);
+        delete particles;
     }
-        
+
+    SDL_DestroyRenderer(gRenderer);
+    gRenderer = NULL;
+    SDL_FreeSurface(target);
+    SDL_Quit();
 }
 
-Fight::Fight(Tilemap* t, Player* p)
+//--memory-check: the hooks must be in and must see SDL's and C++ allocations, reallocations and frees under the current tag
+bool checkMemory()
 {
-    if (!back.loadFromFile("Assets/fight/fight_back.png"))
-    {
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search fight window background texture file. Please reinstall game :)", NULL);
-        close(t, p);
-    }
-    if (!ui.loadFromFile("Assets/fight/fight_ui.png"))
+    if (!gMemory.hooked)
     {
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search fight window background texture file. Please reinstall game :)", NULL);
-        close(t, p);
+        printf("Memory check: allocation hooks are not installed\n");
+        return false;
     }
-}
-
-bool Fight::fight(Player* p, NPC* npc, Tilemap* t)
-{
-    SDL_Event e;
-
-    Texture bg;
-
-    bg.loadFromFile("Assets/fight/fight_back.png");
 
-    Texture ui;
+    MemoryScope scope(MEMORY_UI);
+    int before = SDL_AtomicGet(&gMemory.live[MEMORY_UI]);
 
-    ui.loadFromFile("Assets/fight/fight_ui.png");
+    void* block = SDL_malloc(1000);
+    bool grew = SDL_AtomicGet(&gMemory.live[MEMORY_UI]) == before + 1000;
+    block = SDL_realloc(block, 3000);
+    bool moved = SDL_AtomicGet(&gMemory.live[MEMORY_UI]) == before + 3000;
+    SDL_free(block);
+    bool freed = SDL_AtomicGet(&gMemory.live[MEMORY_UI]) == before;
 
-    Texture hp, str, hp_enemy, str_enemy, round;
-    hp.loadFromRenderedText("Twoje punkty zycia: " + std::to_string(p->health), white);
-    str.loadFromRenderedText("Twoja sila: " + std::to_string(p->strenght), white);
-    str_enemy.loadFromRenderedText("Sila przeciwnika: " + std::to_string(npc->strenght), white);
-    hp_enemy.loadFromRenderedText("Twoja sila: " + std::to_string(npc->hp), white);
-    round.loadFromRenderedText("Twoj ruch",white);
+    void* object = ::operator new(1000);
+    bool created = SDL_AtomicGet(&gMemory.live[MEMORY_UI]) == before + 1000;
+    ::operator delete(object);
+    bool deleted = SDL_AtomicGet(&gMemory.live[MEMORY_UI]) == before;
 
-    p->Collider.x = 600;
-    p->Collider.y = 400;
-    p->ismoving = false;
-    p->lastx = 0;
-    p->lasty = 1;
-    
-    npc->Collider.x = 600;
-    npc->Collider.y = 200;
+    printf("Memory check: malloc %s, realloc %s, free %s, new %s, delete %s\n", grew ? "ok" : "missed", moved ? "ok" : "missed", freed ? "ok" : "missed",
+        created ? "ok" : "missed", deleted ? "ok" : "missed");
+    return grew && moved && freed && created && deleted;
+}
 
-    Button buttons[4] =
-    { 
-     Button("Assets/fight/fight_attack_out.png","Assets/fight/fight_attack_in.png"),
-     Button("Assets/fight/fight_cast_out.png","Assets/fight/fight_cast_in.png"),
-     Button("Assets/fight/fight_back_out.png","Assets/fight/fight_back_in.png"),
-     Button("Assets/fight/fight_fireball_out.png","Assets/fight/fight_fireball_in.png")
-    };
+void first(Tilemap* t, Player* p, Levels* l)
+{
+    LevelAssets* level = l->take(1);
 
-    buttons[0].setPosistion(0, 468);
-    buttons[1].setPosistion(0, 568);
-    buttons[2].setPosistion(0, 668);
-    buttons[3].setPosistion(0, 468);
+    if (level == NULL || !level->loaded)
+    {
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search map level file. Please reinstall game :)", NULL);
+        close(t, p, l);
+        exit(0);
+    }
 
-    bool cast_visible = false;
+    p->Collider.x = p->Collider.y = 40;
+    //the overworld and the arena keep separate rings, a fight must not erase the level's history
+    Rewind rewind, arena_rewind;
+    Fight f(t, p, l, &arena_rewind);
 
-    bool run = true;
+    Dialog xd(level->dialog);
 
-    Timer ani;
-    ani.set_seconds(1.0f);
+    t->set();
 
-    bool your_round_active = true;
+    t->loadLevel(level);
 
-    while (run && npc->hp>0 && p->health>0)
-    {
-        while (SDL_PollEvent(&e) != 0)
-        {
-            if (e.type == SDL_QUIT)
-            {
-                run = false;
-                close(t, p);
-                exit(0);
-            }
-            buttons[2].handleEvent(&e);
-            if (!cast_visible)
-            {
-                if (buttons[0].handleEvent(&e) == 1)
-                {
-                    your_round_active = false;
-                    npc->hp -= p->strenght;
-                    round.loadFromRenderedText("Przeciwnik uderza za: " + std::to_string(npc->strenght),white);
-                    npc->Collider.y = 250;
-                    ani.start();
-                    p->health -= npc->strenght;
-                }
-                    
-                if (buttons[1].handleEvent(&e) == 1)
-                    cast_visible = true;
-            }
-            else
-            {
-                if (buttons[3].handleEvent(&e) == 1)
-                    cast_visible = false;
-            }
-        }
-        if (ani.morethanseconds())
-        {
-            round.loadFromRenderedText("Twoj ruch", white);
-            your_round_active = true;
-        }
+    gAudio.playMusic(Levels::find(1)->music);
 
-        if (your_round_active)
-            npc->Collider.y=200 ;
-            
-        hp.loadFromRenderedText("Twoje punkty zycia: " + std::to_string(p->health), white);
-        str.loadFromRenderedText("Twoja sila: " + std::to_string(p->strenght), white);
-        str_enemy.loadFromRenderedText("Sila przeciwnika: " + std::to_string(npc->strenght), white);
-        hp_enemy.loadFromRenderedText("Punty zycia przeciwnika: " + std::to_string(npc->hp), white);
+    l->preload(2);
 
-        SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
+    Eq eq(p);
 
-        SDL_RenderClear(gRenderer);
+    //spawning, dialog, traps and fights are driven by the level script
+    ScriptHost host(t, p, &xd, &f, level->npc);
+    host.add(&level->script);
 
-        bg.render(0, 0);
+    //the arena has its own map, so the level's torches and explored tiles stay out of the fight
+    LightMap lights, arena;
+    if (Levels::find(1)->dark || gLighting)
+    {
+        host.lights = &lights;
+        f.lights = &arena;
+    }
 
-        ui.render(0, 468);
+    host.update();
 
-        hp.render(210, 480);
-        str.render(210, 520);
-        str_enemy.render(210, 700);
-        hp_enemy.render(210, 650);
-        round.render(800, 480);
+    //from here the level simulates on its own thread and this one only draws what it produced
+    LevelLoop loop(t, p, &xd, &eq, &host, &rewind);
+    host.pipe = &loop.pipe;
+    loop.lights = host.lights;
 
-        buttons[2].render();
-        if (!cast_visible)
+    NetClient net;
+    if (gConnect.port != 0)
+    {
+        if (net.connect(gConnect, true))
         {
-            buttons[0].render();
-            buttons[1].render();
+            //the net step pushes the player out of npcs at the server's rate, the host must not do it again
+            loop.net = &net;
+            host.pushback = false;
         }
         else
-        {
-            buttons[3].render();
-        }
-
-        p->render();
+            printf("Cannot reach the server, playing alone\n");
+    }
 
-        npc->render();
+    if (!loop.pipe.start(LevelLoop::simulate, &loop))
+    {
+        printf("Cannot start simulation thread! SDL Error: %s\n", SDL_GetError());
+    }
 
-        SDL_RenderPresent(gRenderer);
+    while (loop.pipe.frame())
+    {
     }
 
-    if (npc->hp <= 0)
-        return true;
-    else if (p->health <= 0)
-        return false;
+    loop.pipe.stop();
+    if (loop.net != NULL)
+    {
+        net.report();
+        net.disconnect();
+    }
+    rewind.report();
+    arena_rewind.report();
+    lights.free();
+    arena.free();
+    close(t, p, l);
+    exit(0);
 }
-void first(Tilemap* t, Player* p)
-{
-    p->Collider.x = p->Collider.y = 40;
-    NPC* npc = new Start_men(1000, 250);
-    Fight f(t, p);
-    SDL_Event e;
 
-    Dialog xd("prolog.txt");
+LevelLoop::LevelLoop(Tilemap* t, Player* p, Dialog* d, Eq* eq, ScriptHost* host, Rewind* rewind)
+{
+    tilemap = t;
+    player = p;
+    dialog = d;
+    this->eq = eq;
+    this->host = host;
+    this->rewind = rewind;
+    net = NULL;
+    lights = NULL;
+    frames = 0;
+    step_cell = -1;
+    quiet = false;
+    stepped = 0;
+}
 
-    xd.start();
+int LevelLoop::simulate(void* data)
+{
+    LevelLoop* loop = (LevelLoop*)data;
 
-    bool run = true;
+    InputBatch* input;
+    while ((input = loop->pipe.next()) != NULL)
+    {
+        useKeyboard(input->keys);
+        loop->tick(input);
+
+        DrawList* list = loop->pipe.list();
+        list->reset();
+
+        //the list carries the input of the batch it was built from, the main thread marks it when it presents this list;
+        //a held key that moves the player counts from when the keyboard was sampled
+        list->input = input->arrival;
+        if (list->input == 0 && loop->player->ismoving)
+            list->input = input->sampled;
+        DrawList::record(list);
+        loop->draw();
+        DrawList::record(NULL);
+
+        loop->pipe.publish();
+    }
+    return 0;
+}
 
-    t->set();
+void LevelLoop::tick(InputBatch* input)
+{
+    Player* p = player;
+    Tilemap* t = tilemap;
+    NPC* npc = host->npcs.empty() ? NULL : host->npcs[0];
 
-    t->loadFromfile("Assets/m1.txt",0);
-    t->loadFromfile("Assets/m1_coll.txt",1);
+    p->keyboard_active = !dialog->active_dialog() && !gScheduler.moving(&p->Collider);
 
-    Animation a(1.5f, 's');
-    Animation b(1.0f, 'w');
+    //a settled tick with no input and no script side effects must not touch the heap
+    int allocations = takeAllocations();
+    SDL_assert(!quiet || allocations == 0);
+    quiet = ++frames > 120 && input->events.empty();
 
-    Eq eq(p);
+    for (size_t i = 0; i < input->events.size(); i++)
+    {
+        dialog->next_page(input->events[i]);
 
-    f.fight(p, npc, t);
+        eq->handleEvent(&input->events[i]);
+    }
 
-    while (run)
+    //the server owns the past in co-op, so there is nothing local to rewind
+    if (net == NULL && rewind->held() && npc != NULL)
+    {
+        rewind->step_back(p, npc);
+    }
+    else
     {
-        if (xd.active_dialog())
-            p->keyboard_active = false;
-        while (SDL_PollEvent(&e) != 0)
+        if (net != NULL)
         {
-            if (e.type == SDL_QUIT)
-            {
-                run = false;
-                close(t,p);
-                exit(0);
-            }
-            p->handleEvents(e);
-
-            xd.next_page(e);
-
-            eq.check_show(e);
+            net->tick(p, getKeyboardState(), t, host);
+        }
+        else
+        {
+            for (int steps = fixedSteps(getTicks(), stepped, net_rate); steps > 0; steps--)
+                walkPlayer(p, getKeyboardState(), t);
+        }
 
+        //a footstep each time the player's feet enter another ground tile
+        int cx = (p->Collider.x + p->Collider.w / 2) / 32;
+        int cy = (p->Collider.y + p->Collider.h - 1) / 32;
+        int cell = cx >= 0 && cx < map_width && cy >= 0 && cy < map_height ? cy * map_width + cx : -1;
+        if (cell != step_cell && cell >= 0 && tileFootstep(t->ground.cells[cell]) != SOUND_COUNT)
+            gAudio.play(tileFootstep(t->ground.cells[cell]), 0);
+        step_cell = cell;
+
+        //the server runs no script for this player, so whatever the script and its slides did is sent as an effect
+        SDL_Rect before = p->Collider;
+        SDL_Rect npc_before[net_entities - net_players];
+        int npc_hp[net_entities - net_players];
+        int watched = std::min((int)host->npcs.size(), net_entities - net_players);
+        for (int n = 0; n < watched; n++)
+        {
+            npc_before[n] = host->npcs[n]->Collider;
+            npc_hp[n] = host->npcs[n]->hp;
         }
 
-        if(checkCollision(p->Collider, npc->Collider))
-            f.fight(p, npc, t);
+        host->update();
+
+        gScheduler.update();
 
-        for (int i = 0; i < 40; i++)
+        if (net != NULL)
         {
-            for (int j = 0; j < 24; j++)
+            if (p->Collider.x != before.x || p->Collider.y != before.y)
+                net->nudge(p->Collider.x - before.x, p->Collider.y - before.y);
+            for (int n = 0; n < watched; n++)
             {
-                if (t->objects[i][j] != 0 && t->objects[i][j] != 6)
-                    p->move(t->collider[i][j]);
-                else if (t->objects[i][j] == 6 && checkCollision(p->Collider, t->collider[i][j]))
-                {
-                    a.start();
-                    b.start();
-                    p->Collider.x -= 32;
-                }
+                Start_men* moved = host->npcs[n];
+                if (moved->Collider.x != npc_before[n].x || moved->Collider.y != npc_before[n].y || moved->hp != npc_hp[n])
+                    net->effect(n + 1, moved->Collider.x - npc_before[n].x, moved->Collider.y - npc_before[n].y, moved->hp);
             }
         }
 
-        p->move(npc->Collider);
+        if (host->effects != 0)
+            quiet = false;
 
-        b.check();
-        b.anim(npc);
-
-        a.check();
-        a.anim(p);
+        if (npc != NULL && net == NULL)
+            rewind->record(p, npc);
+    }
+}
 
-        SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
+void LevelLoop::draw()
+{
+    DrawList::recording()->clear(0xFF, 0xFF, 0xFF, 0xFF);
 
-        SDL_RenderClear(gRenderer);
-        
-        t->show(0);
-        t->show(1);
+    tilemap->show(0);
+    tilemap->show(1);
 
-        p->render();
+    player->render();
 
-        npc->render();
+    if (net != NULL)
+        net->render();
 
-        xd.draw();
+    host->render();
 
-        eq.draw();
+    //the player carries a lantern, dialog and equipment stay unlit on top
+    if (lights != NULL)
+    {
+        lights->begin();
+        lights->add(player->Collider.x + player->Collider.w / 2.0f, player->Collider.y + player->Collider.h / 2.0f, 160, 1.0f, 0.95f, 0.85f);
+        lights->shade(tilemap);
+        lights->draw();
+    }
 
-        SDL_RenderPresent(gRenderer);
+    dialog->draw();
 
-    }
+    eq->render();
 }
 
-void play_menu(Tilemap* t, Player* p)
+void play_menu(Tilemap* t, Player* p, Levels* l)
 {
+    MemoryScope scope(MEMORY_UI);
+
     Texture background;
 
     background.loadFromFile("Assets/Gui/blink_bg.png");
 
     Button new_game("Assets/Gui/new_game_out.png", "Assets/Gui/new_game_in.png");
 
-    new_game.setPosistion(540, 100);
-
     Button load_game("Assets/Gui/load_game_out.png", "Assets/Gui/load_game_in.png");
 
-    load_game.setPosistion(540, 250);
-
     Button ret("Assets/Gui/return_out.png", "Assets/Gui/return_in.png");
 
     ret.setPosistion(540, 500);
 
+    Ui ui(&background);
+
+    ui.add(&new_game);
+
+    ui.add(&load_game);
+
+    ui.add(&ret);
+
+    ui.column(100, 50);
+
     bool run = true;
 
     SDL_Event e;
 
     while (run)
     {
-        while (SDL_PollEvent(&e) != 0)
+        if (!ui.dirty())
+        {
+            waitForEvent(250);
+        }
+
+        while (pollEvent(&e) != 0)
         {
             if (e.type == SDL_QUIT)
             {
                 run = false;
-                close(t, p);
+                close(t, p, l);
                 exit(0);
             }
 
-            if (new_game.handleEvent(&e) == 1)
+            Widget* clicked = ui.route(&e);
+
+            if (clicked == &new_game)
             {
                 run = false;
-                new_game_menu(t,p);
+                new_game_menu(t,p,l);
             }
 
-            if (load_game.handleEvent(&e) == 1)
+            if (clicked == &load_game)
             {
                 run = false;
-                load_game_menu(t,p);
+                load_game_menu(t,p,l);
             }
 
-            if (ret.handleEvent(&e) == 1)
+            if (clicked == &ret)
             {
                 run = false;
-                menu(t,p);
+                menu(t,p,l);
             }
 
         }
 
-        SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
-
-        SDL_RenderClear(gRenderer);
-
-        background.render(0, 0);
-
-        new_game.render();
-
-        load_game.render();
-
-        ret.render();
-
-        SDL_RenderPresent(gRenderer);
+        ui.draw();
 
     }
 }
 
 
-void menu(Tilemap* t, Player* p)
+void menu(Tilemap* t, Player* p, Levels* l)
 {
+    MemoryScope scope(MEMORY_UI);
+
     bool run = true;
 
     SDL_Event e;
@@ -1615,56 +9563,55 @@ void menu(Tilemap* t, Player* p)
 
     Button quit("Assets/Gui/quit_out.png", "Assets/Gui/quit_in.png");
 
-    play.setPosistion(540, 200);
+    Ui ui(&background);
 
-    about.setPosistion(540, 350);
+    ui.add(&play);
 
-    quit.setPosistion(540, 500);
+    ui.add(&about);
+
+    ui.add(&quit);
+
+    ui.column(200, 50);
 
     while (run)
     {
-        while (SDL_PollEvent(&e) != 0)
+        if (!ui.dirty())
+        {
+            waitForEvent(250);
+        }
+
+        while (pollEvent(&e) != 0)
         {
             if (e.type == SDL_QUIT)
             {
                 run = false;
-                close(t, p);
+                close(t, p, l);
                 exit(0);
             }
 
-            if (play.handleEvent(&e) == 1)
+            Widget* clicked = ui.route(&e);
+
+            if (clicked == &play)
             {
                 run = false;
-                play_menu(t,p);
+                play_menu(t,p,l);
             }
 
-            if (about.handleEvent(&e) == 1)
+            if (clicked == &about)
             {
                 run = false;
-                about_menu(t,p);
+                about_menu(t,p,l);
             }
 
-            if (quit.handleEvent(&e) == 1)
+            if (clicked == &quit)
             {
                 run = false;
-                close(t, p);
+                close(t, p, l);
                 exit(0);
             }
         }
 
-        SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
-
-        SDL_RenderClear(gRenderer);
-
-        background.render(0, 0);
-
-        play.render();
-
-        about.render();
-
-        quit.render();
-
-        SDL_RenderPresent(gRenderer);
+        ui.draw();
 
     }
 
@@ -1672,8 +9619,10 @@ void menu(Tilemap* t, Player* p)
 
 }
 
-void new_game_menu(Tilemap* t, Player* p)
+void new_game_menu(Tilemap* t, Player* p, Levels* l)
 {
+    MemoryScope scope(MEMORY_UI);
+
     int anim = 1;
 
     std::string save_choose = "0";
@@ -1742,66 +9691,69 @@ void new_game_menu(Tilemap* t, Player* p)
 
     Input nick(550, 450);
 
+    Ui ui(&background);
+
+    for (int i = 0; i < 9; i++)
+        ui.add(&buttons[i]);
+
+    ui.add(&nick);
+
     while (run)
     {
-        while (SDL_PollEvent(&e) != 0)
+        while (pollEvent(&e) != 0)
         {
 
             if (e.type == SDL_QUIT)
             {
                 run = false;
-                close(t, p);
+                close(t, p, l);
                 exit(0);
             }
 
-            if (buttons[0].handleEvent(&e) == 1)
+            Widget* clicked = ui.route(&e);
+
+            if (clicked == &buttons[0])
             {
                 outfit_choose = "1";
                 outfit.loadFromRenderedText("Wybrales  " + outfit_choose + "  wyglad", white);
             }
 
-            if (buttons[1].handleEvent(&e) == 1)
+            if (clicked == &buttons[1])
             {
                 outfit_choose = "2";
                 outfit.loadFromRenderedText("Wybrales  " + outfit_choose + "  wyglad", white);
             }
 
-            if (buttons[2].handleEvent(&e) == 1)
+            if (clicked == &buttons[2])
             {
                 outfit_choose = "3";
                 outfit.loadFromRenderedText("Wybrales  " + outfit_choose + "  wyglad", white);
             }
 
-            if (buttons[3].handleEvent(&e) == 1)
+            if (clicked == &buttons[3])
             {
                 outfit_choose = "4";
                 outfit.loadFromRenderedText("Wybrales  " + outfit_choose + "  wyglad", white);
             }
 
-            if (buttons[4].handleEvent(&e) == 1)
+            if (clicked == &buttons[4])
             {
                 save_choose = "1";
                 save.loadFromRenderedText("Wybrales  " + save_choose + "  zapis", white);
             }
 
-            if (buttons[5].handleEvent(&e) == 1)
+            if (clicked == &buttons[5])
             {
                 save_choose = "2";
                 save.loadFromRenderedText("Wybrales  " + save_choose + "  zapis", white);
             }
 
-            if (buttons[6].handleEvent(&e) == 1)
+            if (clicked == &buttons[6])
             {
                 save_choose = "3";
                 save.loadFromRenderedText("Wybrales  " + save_choose + "  zapis", white);
             }
 
-            int x, y;
-
-            SDL_GetMouseState(&x, &y);
-
-            nick.inside(x, y, e);
-
             if (nick.write)
             {
                 SDL_StartTextInput();
@@ -1811,9 +9763,7 @@ void new_game_menu(Tilemap* t, Player* p)
                 SDL_StopTextInput();
             }
 
-            nick.inputtext(e);
-
-            if (buttons[7].handleEvent(&e) == 1)
+            if (clicked == &buttons[7])
             {
                 if (outfit_choose == "0" && save_choose == "0" && (nick.text == "some text" || nick.text.length() == 0))
                 {
@@ -1852,10 +9802,10 @@ void new_game_menu(Tilemap* t, Player* p)
                 }
             }
 
-            if (buttons[8].handleEvent(&e) == 1)
+            if (clicked == &buttons[8])
             {
                 run = false;
-                play_menu(t,p);
+                play_menu(t,p,l);
             }
 
         }
@@ -1921,15 +9871,15 @@ void new_game_menu(Tilemap* t, Player* p)
 
         info.render(300, 500);
 
-        SDL_RenderPresent(gRenderer);
+        present();
 
     }
 
 }
 
-void load_game_menu(Tilemap* t, Player* p)
+void load_game_menu(Tilemap* t, Player* p, Levels* l)
 {
-    std::fstream plik;
+    MemoryScope scope(MEMORY_UI);
 
     std::string file_number = "0";
 
@@ -1963,66 +9913,87 @@ void load_game_menu(Tilemap* t, Player* p)
 
     ret.setPosistion(540, 500);
 
-    Texture info;
+    Label info("Wybrales  " + file_number, 560, 50);
+
+    Ui ui(&background);
+
+    ui.add(&one);
+
+    ui.add(&two);
 
-    info.loadFromRenderedText("Wybrales  " + file_number, white);
+    ui.add(&three);
+
+    ui.add(&confirm);
+
+    ui.add(&ret);
+
+    ui.add(&info);
 
     while (run)
     {
-        while (SDL_PollEvent(&e) != 0)
+        if (!ui.dirty())
+        {
+            waitForEvent(250);
+        }
+
+        while (pollEvent(&e) != 0)
         {
             if (e.type == SDL_QUIT)
             {
                 run = false;
-                close(t, p);
+                close(t, p, l);
                 exit(0);
             }
 
-            if (one.handleEvent(&e) == 1)
+            Widget* clicked = ui.route(&e);
+
+            if (clicked == &one)
             {
                 file_number = "1";
-                info.loadFromRenderedText("Wybrales  " + file_number, white);
+                info.setText("Wybrales  " + file_number);
             }
 
-            if (two.handleEvent(&e) == 1)
+            if (clicked == &two)
             {
                 file_number = "2";
-                info.loadFromRenderedText("Wybrales  " + file_number, white);
+                info.setText("Wybrales  " + file_number);
             }
 
-            if (three.handleEvent(&e) == 1)
+            if (clicked == &three)
             {
                 file_number = "3";
-                info.loadFromRenderedText("Wybrales  " + file_number, white);
+                info.setText("Wybrales  " + file_number);
             }
 
-            if (ret.handleEvent(&e) == 1)
+            if (clicked == &ret)
             {
                 run = false;
-                play_menu(t,p);
+                play_menu(t,p,l);
             }
 
-            if (confirm.handleEvent(&e) == 1)
+            if (clicked == &confirm)
             {
                 if (file_number == "0")
                 {
-                    info.loadFromRenderedText("Nie wybrales zadnego pliku", white);
+                    info.setText("Nie wybrales zadnego pliku");
                 }
                 else
                 {
 
-                    plik.open("Assets/Saves/" + file_number + ".txt", std::ios::in);
+                    std::string content;
 
                     int i = 1;
 
-                    if (plik.good() == false)
+                    if (gReplay.read_save(file_number, content) == false)
                     {
                         SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing file", "Cannot search save file. Please reinstall game :)", NULL);
-                        close(t, p);
+                        close(t, p, l);
                         exit(0);
 
                     }
 
+                    std::istringstream plik(content);
+
                     while (std::getline(plik, dane))
                     {
                         switch (i)
@@ -2053,31 +10024,15 @@ void load_game_menu(Tilemap* t, Player* p)
 
         }
 
-        SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
-
-        SDL_RenderClear(gRenderer);
-
-        background.render(0, 0);
-
-        one.render();
-
-        two.render();
-
-        three.render();
-
-        confirm.render();
-
-        ret.render();
-
-        info.render(560, 50);
-
-        SDL_RenderPresent(gRenderer);
+        ui.draw();
 
     }
 }
 
-void about_menu(Tilemap* t, Player* p)
+void about_menu(Tilemap* t, Player* p, Levels* l)
 {
+    MemoryScope scope(MEMORY_UI);
+
     bool run = true;
 
     SDL_Event e;
@@ -2088,41 +10043,40 @@ void about_menu(Tilemap* t, Player* p)
 
     Button ret("Assets/Gui/return_out.png", "Assets/Gui/return_in.png");
 
-    Texture text;
-
-    text.loadFromRenderedText("To fakt nie opinia", white);
+    Label text("To fakt nie opinia", 200, 100);
 
     ret.setPosistion(540, 650);
 
+    Ui ui(&background);
+
+    ui.add(&ret);
+
+    ui.add(&text);
+
     while (run)
     {
-        while (SDL_PollEvent(&e) != 0)
+        if (!ui.dirty())
+        {
+            waitForEvent(250);
+        }
+
+        while (pollEvent(&e) != 0)
         {
             if (e.type == SDL_QUIT)
             {
                 run = false;
-                close(t, p);
+                close(t, p, l);
                 exit(0);
             }
 
-            if (ret.handleEvent(&e) == 1)
+            if (ui.route(&e) == &ret)
             {
                 run = false;
-                menu(t,p);
+                menu(t,p,l);
             }
         }
 
-        SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
-
-        SDL_RenderClear(gRenderer);
-
-        background.render(0, 0);
-
-        ret.render();
-
-        text.render(200, 100);
-
-        SDL_RenderPresent(gRenderer);
+        ui.draw();
     }
 
     background.free();
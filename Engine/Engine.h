@@ -8,268 +8,1938 @@
 #include <vector>
 #include <math.h>
 #include <iostream>
+#include <sstream>
+#include <unordered_map>
+#include <coroutine>
+#include <array>
 
-class Timer
+enum PerfCounter
+{
+    PERF_MIXER,
+    PERF_INPUT_LATENCY,
+    PERF_SCRIPTS,
+    PERF_LIGHTING,
+    PERF_PARTICLES,
+    PERF_COUNTERS
+};
+
+class Perf
+{
+public:
+    Perf();
+
+    void add(PerfCounter counter, Uint64 start);
+
+    void record(PerfCounter counter, Uint64 us);
+
+    double average(PerfCounter counter);
+
+    void report();
+
+private:
+    SDL_SpinLock lock;
+
+    Uint64 time[PERF_COUNTERS];
+
+    Uint64 samples[PERF_COUNTERS];
+
+    Uint64 peak[PERF_COUNTERS];
+};
+
+enum MemoryTag
+{
+    MEMORY_OTHER,
+    MEMORY_TILEMAP,
+    MEMORY_UI,
+    MEMORY_DIALOG,
+    MEMORY_FIGHT,
+    MEMORY_AUDIO,
+    MEMORY_TAGS
+};
+
+class Memory
+{
+public:
+    void add(int tag, int bytes);
+
+    void remove(int tag, int bytes);
+
+    void addTexture(int tag, int bytes);
+
+    void removeTexture(int tag, int bytes);
+
+    void hook();
+
+    void frame();
+
+    void report();
+
+    static int tag();
+
+    SDL_atomic_t live[MEMORY_TAGS];
+
+    SDL_atomic_t peak[MEMORY_TAGS];
+
+    SDL_atomic_t allocs[MEMORY_TAGS];
+
+    SDL_atomic_t frame_allocs[MEMORY_TAGS];
+
+    SDL_atomic_t textures[MEMORY_TAGS];
+
+    int per_frame[MEMORY_TAGS];
+
+    bool hooked;
+};
+
+class MemoryScope
+{
+public:
+    MemoryScope(MemoryTag tag);
+    ~MemoryScope();
+
+private:
+    int previous;
+};
+
+class FrameArena
+{
+public:
+    FrameArena(size_t bytes = 65536);
+    ~FrameArena();
+
+    void* alloc(size_t size, size_t align = 16);
+
+    const char* format(const char* fmt, ...);
+
+    void reset();
+
+    Uint8* memory;
+
+    size_t capacity, used, peak;
+
+    Uint32 overflows;
+};
+
+enum Sound
+{
+    SOUND_CLICK,
+    SOUND_HIT,
+    SOUND_BLIP,
+    SOUND_COUNT
+};
+
+class Audio
+{
+public:
+    Audio();
+
+    bool open();
+
+    void play(Sound sound, int priority);
+
+    void playMusic(std::string path);
+
+    void stopMusic();
+
+    void close();
+
+    int frequency, buffer, voices;
+
+private:
+    static void mix_end(void* data, Uint8*, int);
+
+    Mix_Chunk* sounds[SOUND_COUNT];
+
+    Mix_Music* music;
+
+    std::vector<int> priorities;
+
+    std::vector<Uint32> started;
+
+    Uint64 mixing;
+
+    double mix_rate;
+
+    bool opened;
+};
+
+class MappedFile
+{
+public:
+    MappedFile();
+
+    bool open(std::string path);
+
+    void close();
+
+    const Uint8* data();
+
+    size_t size();
+
+    ~MappedFile();
+
+private:
+    const Uint8* mData;
+
+    size_t mSize;
+
+    void* mFile;
+
+    void* mMapping;
+};
+
+struct PackEntry
+{
+    Uint64 path_hash, content_hash, offset, size, stamp;
+
+    Uint32 name_offset, name_length;
+};
+
+class AssetPack
+{
+public:
+    AssetPack();
+
+    bool open(std::string path);
+
+    void close();
+
+    const PackEntry* find(std::string path);
+
+    const Uint8* data(const PackEntry* entry);
+
+    std::string name(const PackEntry* entry);
+
+    int count();
+
+    const PackEntry* entry(int i);
+
+    bool loaded();
+
+private:
+    MappedFile file;
+
+    const PackEntry* entries;
+
+    const char* names;
+
+    int entries_count;
+};
+
+struct CookedTexture
+{
+    Uint32 format;
+
+    Sint32 width, height, pitch;
+
+    Uint32 blend, reserved[3];
+};
+
+class TextureCache
+{
+public:
+    TextureCache();
+
+    bool open(std::string path);
+
+    SDL_Texture* load(std::string path, int& w, int& h);
+
+    bool cook(std::string directory, std::string path);
+
+    void close();
+
+private:
+    AssetPack cooked;
+
+    bool usable;
+
+    int hits, misses;
+};
+
+class Replay
+{
+public:
+    Replay();
+
+    bool record(std::string path);
+
+    bool play(std::string path);
+
+    int poll(SDL_Event* e);
+
+    void wait(int timeout);
+
+    Uint32 ticks();
+
+    const Uint8* keyboard();
+
+    bool read_save(std::string number, std::string& content);
+
+    void close();
+
+    bool recording, playing, headless;
+
+private:
+    void track(SDL_Event* e);
+
+    void put(Uint32 value);
+
+    bool get(Uint32& value);
+
+    std::fstream file;
+
+    std::string saves[3];
+
+    Uint32 now;
+
+    Uint8 keys[SDL_NUM_SCANCODES];
+};
+
+class Texture
+{
+public:
+    Texture();
+
+    ~Texture();
+
+    bool loadFromFile(std::string path);
+
+    bool loadFromSurface(SDL_Surface* surface);
+
+    bool loadFromRenderedText(const char* textureText, SDL_Color textColor);
+
+    bool loadFromRenderedText(const std::string& textureText, SDL_Color textColor);
+
+    void SetColor(Uint8 red, Uint8 green, Uint8 blue);
+
+    void setBlendMode(SDL_BlendMode blending);
+
+    void setAlpha(Uint8 alpha);
+
+    void free();
+
+    void render(int x, int y, SDL_Rect* clip = NULL);
+
+    int getWidth();
+
+    int getHeight();
+
+    void to_input(SDL_Rect& col);
+
+private:
+    void track();
+
+    SDL_Texture* mTexture;
+    int mWidth;
+    int mHeight;
+    int mBytes;
+    int mTag;
+
+};
+
+struct InputBatch
+{
+    std::vector<SDL_Event> events;
+
+    Uint8 keys[SDL_NUM_SCANCODES];
+
+    //performance counter of the earliest event in the batch and of the keyboard sample, 0 when there were no events
+    Uint64 arrival, sampled;
+};
+
+enum DrawType
+{
+    DRAW_CLEAR,
+    DRAW_COPY,
+    DRAW_TEXT,
+    DRAW_LIGHT
+};
+
+class LightMap;
+
+struct DrawCommand
+{
+    int type;
+    SDL_Texture* texture;
+    SDL_Rect src, dst;
+    bool clipped;
+    SDL_Color color;
+    int text;
+    LightMap* light;
+};
+
+class DrawList
+{
+public:
+    DrawList();
+
+    void reset();
+
+    void clear(Uint8 r, Uint8 g, Uint8 b, Uint8 a);
+
+    void copy(SDL_Texture* texture, SDL_Rect* src, SDL_Rect* dst);
+
+    void text(const char* text, int x, int y);
+
+    void light(LightMap* map, int buffer);
+
+    void execute();
+
+    static DrawList* recording();
+
+    static void record(DrawList* list);
+
+    std::vector<DrawCommand> commands;
+
+    std::vector<char> strings;
+
+    Texture scratch;
+
+    Uint64 input;
+};
+
+//one draw command resolved to CPU pixels, ready for any strip to blend
+struct RasterOp
+{
+    int type;
+    const Uint32* pixels;
+    int pitch;
+    SDL_Rect src, dst;
+    SDL_BlendMode blend;
+    Uint8 alpha, r, g, b;
+};
+
+class SoftRaster;
+
+struct RasterStrip
+{
+    SoftRaster* raster;
+    int top, bottom;
+    SDL_Thread* thread;
+    SDL_sem* go;
+    std::vector<Uint32> row;
+};
+
+//draws a DrawList into a plain ARGB framebuffer on the CPU, horizontal strips on separate threads; the result does not depend on the thread count
+class SoftRaster
+{
+public:
+    SoftRaster(int width, int height, int threads);
+
+    ~SoftRaster();
+
+    void keep(SDL_Texture* texture, SDL_Surface* surface);
+
+    void forget(SDL_Texture* texture);
+
+    void draw(DrawList* list);
+
+    Uint32* pixels;
+
+    int width, height;
+
+private:
+    static int worker(void* data);
+
+    void strip(RasterStrip& strip);
+
+    std::unordered_map<SDL_Texture*, SDL_Surface*> images;
+
+    std::vector<SDL_Surface*> texts;
+
+    std::vector<RasterOp> ops;
+
+    std::vector<RasterStrip> strips;
+
+    SDL_sem* done;
+
+    bool quit;
+};
+
+class FramePipe
+{
+public:
+    FramePipe();
+    ~FramePipe();
+
+    bool start(int (*simulate)(void* data), void* data);
+
+    bool frame();
+
+    InputBatch* next();
+
+    DrawList* list();
+
+    void publish();
+
+    void call(void (*function)(void* data), void* data);
+
+    void stop();
+
+    InputBatch inputs[2];
+
+    DrawList lists[2];
+
+private:
+    SDL_mutex* lock;
+    SDL_cond* changed;
+    SDL_Thread* thread;
+    int submitted, produced, ticks;
+    bool quit, finished;
+    void (*request)(void* data);
+    void* request_data;
+};
+
+struct CaptureFrame
+{
+    std::vector<Uint32> pixels;
+    int width, height;
+    Uint32 number;
+    bool png;
+};
+
+//F12 saves a PNG, F11 toggles a QOI frame sequence; frames are read back into a fixed set of buffers and encoded on worker threads
+class Capture
+{
+public:
+    Capture();
+
+    void screenshot();
+
+    void toggle();
+
+    void grab();
+
+    void stop();
+
+    std::string directory;
+
+    int workers, buffers;
+
+    bool recording, pending;
+
+    Uint32 taken, dropped, written;
+
+    Uint64 readback_us, encode_us;
+
+private:
+    bool start();
+
+    static int worker(void* data);
+
+    std::vector<CaptureFrame> frames;
+
+    std::vector<int> idle, queued;
+
+    std::vector<SDL_Thread*> threads;
+
+    SDL_mutex* lock;
+
+    SDL_cond* changed;
+
+    bool quit, started;
+
+    Uint32 session, shots, sequence;
+};
+
+const int tile_count = 1064;
+
+enum TileFlag
+{
+    TILE_SOLID = 1,
+    TILE_TRIGGER = 2,
+    TILE_ANIMATED = 4,
+    TILE_OPAQUE = 8
+};
+
+//flags apply to a tile on the objects layer, the footstep to one on the ground layer; an animated tile cycles through frames consecutive ids
+struct TileInfo
+{
+    int first, last;
+    int flags;
+    int frames;
+    Sound footstep;
+    int cooldown;
+};
+
+//later rows override earlier ones, so new behaviour is one more line here
+constexpr TileInfo tile_info[] =
+{
+    { 1, tile_count, TILE_SOLID | TILE_OPAQUE, 1, SOUND_COUNT, 0 },
+    { 6, 6, TILE_TRIGGER, 1, SOUND_COUNT, 1500 },
+};
+
+//[frames - 1:4][footstep:4][flags:8] per tile id, 0 is the empty tile
+constexpr std::array<Uint16, tile_count + 1> packTiles()
+{
+    std::array<Uint16, tile_count + 1> packed = {};
+    for (int id = 0; id <= tile_count; id++)
+        packed[id] = SOUND_COUNT << 8;
+    for (const TileInfo& info : tile_info)
+    {
+        for (int id = info.first; id <= info.last; id++)
+            packed[id] = (Uint16)(((info.frames - 1) << 12) | (info.footstep << 8) | info.flags);
+    }
+    return packed;
+}
+
+constexpr std::array<Uint16, tile_count + 1> tile_table = packTiles();
+
+static_assert(SOUND_COUNT < 16, "footstep sounds are packed in four bits");
+static_assert((tile_table[6] & TILE_SOLID) == 0 && (tile_table[8] & TILE_SOLID) != 0, "trap tiles are walkable, walls are not");
+
+constexpr bool tileIs(Uint16 id, int flag)
+{
+    return id <= tile_count && (tile_table[id] & flag) != 0;
+}
+
+constexpr Sound tileFootstep(Uint16 id)
+{
+    return id <= tile_count ? (Sound)((tile_table[id] >> 8) & 15) : SOUND_COUNT;
+}
+
+constexpr int tileFrames(Uint16 id)
+{
+    return id <= tile_count ? (tile_table[id] >> 12) + 1 : 1;
+}
+
+//milliseconds before a trigger tile can fire again, only looked up when the map is indexed
+constexpr int tileCooldown(Uint16 id)
+{
+    for (int i = (int)(sizeof(tile_info) / sizeof(tile_info[0])) - 1; i >= 0; i--)
+    {
+        if (id >= tile_info[i].first && id <= tile_info[i].last)
+            return tile_info[i].cooldown;
+    }
+    return 0;
+}
+
+const int map_width = 40;
+const int map_height = 24;
+const int map_cells = map_width * map_height;
+
+//one tile id per cell, row-major so a pass over the layer follows screen scan order
+class TileLayer
+{
+public:
+    TileLayer();
+
+    Uint16 get(int x, int y) const;
+
+    void set(int x, int y, Uint16 id);
+
+    void fill(Uint16 id);
+
+    Uint16 cells[map_cells];
+};
+
+struct TileRun
+{
+    Uint8 x, length;
+    Uint16 first;
+};
+
+//only the non-zero runs of each row, runs[rows[y]] to runs[rows[y + 1]] belong to row y and point into tiles
+class SparseLayer
+{
+public:
+    SparseLayer();
+
+    void build(const TileLayer& dense);
+
+    void clear();
+
+    Uint16 get(int x, int y) const;
+
+    Uint16 rows[map_height + 1];
+
+    std::vector<TileRun> runs;
+
+    std::vector<Uint16> tiles;
+};
+
+enum TriggerPhase
+{
+    TRIGGER_ENTER,
+    TRIGGER_STAY,
+    TRIGGER_EXIT
+};
+
+const int trigger_movers = 8;
+
+//tile triggers are tagged with their tile id, script zones with ids past tile_count
+struct Trigger
+{
+    SDL_Rect area;
+    int tag;
+    Uint32 cooldown;
+    Uint32 ready;
+    Uint32 seen;
+    Uint8 inside;
+};
+
+struct TriggerEvent
+{
+    int tag;
+    Uint8 mover;
+    Uint8 phase;
+};
+
+//triggers bucketed by the 32x32 cells they cover, a mover only tests the buckets under its own rect
+class TriggerGrid
+{
+public:
+    TriggerGrid();
+
+    void build(const SparseLayer& objects);
+
+    int zone(SDL_Rect area, Uint32 cooldown);
+
+    void begin();
+
+    void move(int mover, const SDL_Rect& body, Uint32 now);
+
+    bool happened(int mover, int tag, int phase);
+
+    std::vector<Trigger> triggers;
+
+    std::vector<TriggerEvent> events;
+
+private:
+    void index();
+
+    std::vector<Uint16> cells;
+
+    std::vector<Uint16> members;
+
+    std::vector<int> inside[trigger_movers];
+
+    std::vector<int> current;
+
+    Uint32 pass;
+
+    int zones;
+};
+
+struct LevelInfo
+{
+    int id;
+
+    std::string ground, objects, dialog, npc, music, script;
+
+    bool dark;
+};
+
+class LevelAssets
+{
+public:
+    LevelAssets();
+
+    bool load(const LevelInfo* info);
+
+    ~LevelAssets();
+
+    int id;
+
+    TileLayer ground;
+
+    TileLayer objects;
+
+    std::vector<std::string> dialog;
+
+    SDL_Surface* npc;
+
+    std::vector<Uint32> script;
+
+    bool loaded;
+};
+
+class Levels
+{
+public:
+    Levels();
+
+    static const LevelInfo* find(int id);
+
+    void preload(int id);
+
+    LevelAssets* take(int id);
+
+    void wait();
+
+    ~Levels();
+
+private:
+    static int worker(void* data);
+
+    LevelAssets* next;
+
+    LevelAssets* current;
+
+    SDL_Thread* thread;
+};
+
+class Tilemap
+{
+public:
+
+    Texture elements[tile_count];
+
+    TileLayer ground;
+
+    SparseLayer objects;
+
+    TriggerGrid triggers;
+
+    SDL_Rect collider[40][24];
+
+    Tilemap();
+
+    bool load();
+
+    void set();
+
+    void show(int id);
+
+    void free();
+
+    bool loadFromfile(std::string path, int l);
+
+    void loadLevel(LevelAssets* level);
+
+};
+
+struct Light
+{
+    float x, y, radius;
+    float r, g, b;
+};
+
+const int light_cell = 8;
+const int light_columns = 1280 / light_cell;
+const int light_rows = 768 / light_cell;
+const int max_lights = 32;
+
+//computed on the CPU one 8x8 cell at a time and multiplied over the level, the objects layer casts the shadows
+class LightMap
+{
+public:
+    LightMap();
+
+    ~LightMap();
+
+    void begin();
+
+    int place(float x, float y, float radius, float r, float g, float b);
+
+    void add(float x, float y, float radius, float r, float g, float b);
+
+    void shade(Tilemap* t);
+
+    void draw();
+
+    void upload(int buffer);
+
+    const Uint32* buffer(int index);
+
+    void free();
+
+    //placed lights like torches stay for the whole level, lights are added again every frame
+    Light placed_lights[max_lights], lights[max_lights];
+
+    int placed, count;
+
+    float ambient, fog;
+
+    bool explored[40][24];
+
+    int front;
+
+private:
+    void visibility(Light& light, Tilemap* t);
+
+    float visible[40][24];
+
+    float* red;
+    float* green;
+    float* blue;
+
+    Uint32* pixels[2];
+
+    SDL_Texture* texture;
+
+    bool avx;
+};
+
+//one line of Assets/fight/effects.txt, a burst of count particles or a stream of rate particles a second
+struct Emitter
+{
+    std::string name;
+    int count;
+    float rate;
+    float life, life_spread;
+    float speed, speed_spread;
+    float angle, spread;
+    float gravity, drag;
+    float size;
+    Uint8 r, g, b, r2, g2, b2;
+    bool additive;
+};
+
+const int max_particles = 131072;
+const int particle_shades = 8;
+
+//struct of arrays sized once on first use, bursts past capacity are cut short instead of allocating
+class Particles
+{
+public:
+    Particles();
+
+    ~Particles();
+
+    bool load(std::string path);
+
+    int find(std::string name);
+
+    int emit(int emitter, float x, float y, int count = 0);
+
+    void stream(int emitter, float x, float y, float dt);
+
+    void update(float dt);
+
+    void render();
+
+    void clear();
+
+    std::vector<Emitter> emitters;
+
+    int count;
+
+    bool simd;
+
+private:
+    bool reserve();
+
+    float* x;
+    float* y;
+    float* vx;
+    float* vy;
+    float* gravity;
+    float* drag;
+    float* life;
+    float* fade;
+    Uint8* kind;
+
+    std::vector<float> carry;
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    SDL_Vertex* vertices;
+
+    int* indices;
+#else
+    SDL_FRect* rects;
+
+    int* buckets;
+#endif
+
+    Uint32 seed;
+};
+class Player
+{
+public:
+    SDL_Rect up[3], down[3], left[3], right[3], Collider;
+
+    Texture player_texture;
+
+    int frame, lastx, lasty, velocity, map;
+
+    int health, strenght;
+
+    bool ismoving, keyboard_active;
+
+    std::string nick, id, save;
+
+    Player(int pozx, int pozy);
+
+    bool load();
+
+    void handleKeys(const Uint8* keys);
+
+    void move(SDL_Rect& wall);
+
+    void render();
+
+    ~Player();
+
+};
+
+class NPC
+{
+public:
+    virtual ~NPC() {}
+    virtual bool load() = 0;
+    virtual void render() = 0;
+    bool ismoving;
+    int lastx, lasty;
+    SDL_Rect Collider, up[3], down[3], left[3], right[3];
+    Texture npc_texture;
+    int frame;
+    int hp;
+    int strenght;
+};
+
+class Start_men : public NPC
+{
+public:
+    Start_men(int x, int y, SDL_Surface* sprite = NULL);
+
+    bool load();
+
+    void render();
+
+private:
+    Texture npc_texture;
+
+    int frame;
+};
+struct WheelTimer
+{
+    WheelTimer* next;
+    WheelTimer* prev;
+    Uint32 due;
+    void (*fire)(WheelTimer* timer);
+    void* data;
+    bool linked;
+    int level, slot;
+};
+
+class TimerWheel
+{
+public:
+    TimerWheel();
+
+    void add(WheelTimer* timer, Uint32 due);
+
+    void cancel(WheelTimer* timer);
+
+    int advance(Uint32 now);
+
+    Uint32 current;
+
+    int count;
+
+private:
+    void place(WheelTimer* timer, Uint32 earliest);
+
+    void cascade(int level);
+
+    //4 levels of 64 slots at 1 ms, one occupancy bit per slot
+    WheelTimer* slots[4][64];
+
+    Uint64 occupied[4];
+};
+
+void* cutsceneAlloc(size_t size);
+void cutsceneFree(void* frame, size_t size);
+
+class Cutscene
+{
+public:
+    struct promise_type
+    {
+        Cutscene get_return_object() { return Cutscene(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { throw; }
+
+        void* operator new(size_t size) { return cutsceneAlloc(size); }
+        void operator delete(void* frame, size_t size) { cutsceneFree(frame, size); }
+    };
+
+    Cutscene(std::coroutine_handle<promise_type> h = nullptr);
+    Cutscene(Cutscene&& other) noexcept;
+    Cutscene& operator=(Cutscene&& other) noexcept;
+    ~Cutscene();
+
+    bool done();
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+class Scheduler;
+
+//awaiters remember which scheduler queued them, each server instance runs its own
+class Sleep
+{
+public:
+    Sleep(Scheduler* owner, Uint32 due);
+    ~Sleep();
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<> h);
+    void await_resume() {}
+
+    WheelTimer timer;
+    Scheduler* owner;
+};
+
+class Until
+{
+public:
+    Until(Scheduler* owner, bool (*done)(void* data), void* data);
+    ~Until();
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<> h);
+    void await_resume() {}
+
+    bool (*done)(void* data);
+    void* data;
+    std::coroutine_handle<> waiting;
+    bool queued;
+    Scheduler* owner;
+};
+
+//walks a body one step a tick in a direction until the time is up or a wall pushes it back
+class Arrive
+{
+public:
+    Arrive(Scheduler* owner, SDL_Rect* body, int* lastx, int* lasty, bool* ismoving, int dx, int dy, int ms, int speed);
+    ~Arrive();
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<> h);
+    void await_resume() {}
+
+    bool step();
+
+    SDL_Rect* body;
+    int* lastx;
+    int* lasty;
+    bool* ismoving;
+    int dx, dy, speed;
+    int reached;
+    Uint32 due;
+    std::coroutine_handle<> waiting;
+    bool queued;
+    Scheduler* owner;
+};
+
+class Dialog;
+
+class Scheduler
+{
+public:
+    Scheduler();
+    ~Scheduler();
+
+    void update();
+
+    void start(Cutscene cutscene);
+
+    Sleep sleep(int ms);
+
+    Until until(Dialog* dialog);
+
+    template<class T> Arrive walk(T* who, int dx, int dy, int ms, int speed = 1)
+    {
+        return Arrive(this, &who->Collider, &who->lastx, &who->lasty, &who->ismoving, dx, dy, ms, speed);
+    }
+
+    bool moving(SDL_Rect* body);
+
+    TimerWheel wheel;
+
+    std::vector<Until*> waiting;
+
+    std::vector<Arrive*> movers;
+
+    std::vector<Cutscene> cutscenes;
+
+    std::vector<std::coroutine_handle<>> ready;
+};
+
+class Dialog
+{
+    Texture back;
+    std::string texts[100];
+    Texture text;
+    int i;
+    int page, max_pages;
+    int pixels[5];
+    bool view;
+    Cutscene autoplay;
+    void set(std::vector<std::string>& lines);
+    Cutscene play();
+public:
+    Dialog(std::string path);
+
+    Dialog(std::vector<std::string>& lines);
+
+    void next_page(SDL_Event& e);
+
+    void start();
+
+    void draw();
+
+    bool active_dialog();
+
+};
+class Widget
+{
+public:
+    Widget();
+
+    virtual int handleEvent(SDL_Event* e);
+
+    virtual void render() = 0;
+
+    void setPosistion(int x, int y);
+
+    void setVisible(bool v);
+
+    bool contains(int x, int y);
+
+    void invalidate();
+
+    bool changed();
+
+    virtual ~Widget();
+
+    SDL_Rect Collider, drawn;
+
+    bool visible, placed, dirty;
+};
+
+class Label : public Widget
+{
+public:
+    Label(std::string t, int x, int y);
+
+    void setText(std::string t);
+
+    void render();
+
+private:
+    Texture texture;
+
+    std::string text;
+};
+
+class Input : public Widget
+{
+public:
+    Input(int x, int y);
+
+    int handleEvent(SDL_Event* e);
+
+    void render();
+
+    Texture texttexture;
+
+    bool write;
+
+    std::string text;
+
+private:
+    void update();
+};
+
+class Button : public Widget
+{
+public:
+    Button(std::string pathin, std::string pathout);
+
+    int handleEvent(SDL_Event* e);
+
+    void render();
+
+    ~Button();
+
+private:
+    Texture mousein, mouseuot;
+
+    bool inside;
+
+};
+
+class Eq : public Widget
+{
+    Texture eq;
+    Texture nickname;
+    Texture hp;
+    Texture power;
+public:
+    Eq(Player *p);
+    int handleEvent(SDL_Event* e);
+    void render();
+    ~Eq();
+};
+
+class Ui
 {
 public:
+    Ui(Texture* bg = NULL);
 
-    Timer();
+    void add(Widget* w);
 
-    Timer(float s);
+    void column(int top, int gap);
 
-    void set_seconds(float s);
+    Widget* route(SDL_Event* e);
 
-    void start();
+    Widget* hit(int x, int y);
 
-    bool morethanseconds();
+    bool dirty();
+
+    bool draw();
+
+    ~Ui();
 
 private:
+    void index();
+
+    std::vector<Widget*> widgets;
+
+    std::vector<int> edges;
 
-    Uint32 startedticks, ticks;
+    std::vector<std::vector<Widget*> > bands;
 
-    float seconds;
+    Widget* hovered;
 
-    bool started;
+    Widget* focused;
+
+    Texture* background;
+
+    SDL_Texture* canvas;
+
+    bool full, stale;
 };
 
-class Texture
+class Combat;
+
+//a snapshot is at most [len][mask][mask], a 5 byte varint for each of the 16 fields and the trailing len
+const int rewind_frame_max = 3 + 16 * 5 + 1;
+
+const int rewind_seconds = 30;
+
+class Rewind
 {
 public:
-    Texture();
+    //sized for the worst case frame, so rewind_seconds of history at 60 fps always fit
+    Rewind(int bytes = rewind_seconds * 60 * rewind_frame_max);
 
-    ~Texture();
+    void attach(Combat* c, bool* turn);
 
-    bool loadFromFile(std::string path);
+    void record(Player* p, NPC* npc);
 
-    bool loadFromRenderedText(std::string textureText, SDL_Color textColor);
+    bool step_back(Player* p, NPC* npc);
 
-    void SetColor(Uint8 red, Uint8 green, Uint8 blue);
+    bool held();
 
-    void setBlendMode(SDL_BlendMode blending);
+    bool empty();
 
-    void setAlpha(Uint8 alpha);
+    void report();
 
-    void free();
+    ~Rewind();
 
-    void render(int x, int y, SDL_Rect* clip = NULL);
+private:
+    void capture(Player* p, NPC* npc, int* values);
 
-    int getWidth();
+    void apply(Player* p, NPC* npc);
 
-    int getHeight();
+    void push(Uint8* data, int len);
 
-    void to_input(SDL_Rect& col);
+    int pop(Uint8* data);
 
-private:
-    SDL_Texture* mTexture;
-    int mWidth;
-    int mHeight;
+    Uint8* buffer;
+
+    int capacity, head, tail, used, frames, peak, largest, dropped;
 
+    int last[16];
+
+    bool has_last;
+
+    Combat* combat;
+
+    bool* turn;
+
+    Uint64 record_time;
+
+    Uint32 records;
 };
 
-class Tilemap
+enum CombatAction
+{
+    ACTION_ATTACK,
+    ACTION_CAST,
+    ACTION_RETREAT,
+    ACTION_COUNT
+};
+
+struct Combatant
+{
+    int hp;
+    int strength;
+    int casts;
+};
+
+class Combat
 {
 public:
+    Combat();
 
-    Texture elements[1064];
+    void start(Uint64 seed = 0, int spread = 0);
 
-    int ground[40][24];
+    void set(int player_hp, int player_strength, int enemy_hp, int enemy_strength);
 
-    int objects[40][24];
+    void attack();
 
-    SDL_Rect collider[40][24];
+    void playerAct(int action);
 
-    Tilemap();
+    void enemyAct(int action);
 
-    bool load();
+    bool legal(const Combatant& side, int action);
 
-    void set();
+    void reseed(Uint64 seed);
 
-    void show(int id);
+    bool over();
 
-    void free();
+    bool won();
 
-    bool loadFromfile(std::string path, int l);
+    int roll(int strength);
+
+    Combatant player, enemy;
+
+    int turns;
+
+    int spread;
+
+    int player_hit, enemy_hit;
 
+    bool fled;
+
+private:
+    int act(Combatant& from, Combatant& to, int action);
+
+    Uint64 state;
 };
-class Player
+
+struct CombatNode
+{
+    int child[ACTION_COUNT];
+    Uint32 visits;
+    float value;
+};
+
+class CombatAI;
+
+struct CombatSearch
+{
+    CombatAI* ai;
+    Combat root;
+    std::vector<CombatNode> nodes;
+    int used;
+    Uint64 seed;
+    Uint64 deadline;
+    Uint64 playouts, limit;
+    SDL_Thread* thread;
+    SDL_sem* go;
+};
+
+class CombatAI
 {
 public:
-    SDL_Rect up[3], down[3], left[3], right[3], Collider;
+    CombatAI();
+    ~CombatAI();
 
-    Texture player_texture;
+    void think(Combat& combat, int budget);
 
-    int frame, lastx, lasty, velocity, map;
+    bool ready();
 
-    int health, strenght;
+    int decide();
 
-    bool ismoving, keyboard_active;
+    int workers;
 
-    std::string nick, id, save;
+    bool thinking;
 
-    Player(int pozx, int pozy);
+    Uint64 playouts;
 
-    bool load();
+private:
+    static int worker(void* data);
 
-    void handleEvents(SDL_Event& e);
+    static void search(CombatSearch* s);
 
-    void move(SDL_Rect& wall);
+    std::vector<CombatSearch> searches;
 
-    void render();
+    //searches started by the last think, a replay always grows a single tree
+    int trees;
 
-    ~Player();
+    //replay only: the getTicks() time the decision is due, so it lands on the same frame every run
+    Uint32 due;
 
+    SDL_atomic_t finished, stop;
+
+    SDL_sem* done;
+
+    bool quit;
 };
 
-class NPC
+class Fight
 {
 public:
-    virtual bool load() = 0;
-    virtual void render() = 0;
-    bool ismoving;
-    int lastx, lasty;
-    SDL_Rect Collider, up[3], down[3], left[3], right[3];
-    Texture npc_texture;
-    int frame;
-    int hp;
-    int strenght;
+    Fight(Tilemap* t, Player* p, Levels* l, Rewind* r = NULL);
+    bool fight(Player* p, NPC* npc, Tilemap* t);
+
+    LightMap* lights;
+
+private:
+    Texture back;
+    Texture ui;
+    Rewind* rewind;
+    Levels* levels;
+
+    Combat combat;
+
+    CombatAI ai;
+
+    Particles particles;
+
+    Scheduler scheduler;
 };
 
-class Start_men : public NPC
+enum ScriptOp
+{
+    OP_END,
+    OP_YIELD,
+    OP_SET,
+    OP_MOV,
+    OP_ADD,
+    OP_ADDI,
+    OP_SUB,
+    OP_LT,
+    OP_EQ,
+    OP_JMP,
+    OP_JZ,
+    OP_JNZ,
+    OP_CALL
+};
+
+enum ScriptCall
+{
+    CALL_SPAWN,
+    CALL_DIALOG,
+    CALL_ANIMATE,
+    CALL_FIGHT,
+    CALL_TOUCHING,
+    CALL_COLLIDES,
+    CALL_PUSH,
+    CALL_LIGHT,
+    CALL_ENTERED,
+    CALL_INSIDE,
+    CALL_LEFT,
+    CALL_ZONE,
+    CALL_COUNT
+};
+
+class ScriptHost;
+
+class Script
 {
 public:
-    Start_men(int x, int y);
+    Script(const std::vector<Uint32>* code);
 
-    bool load();
+    int run(ScriptHost* host, int budget);
+
+    const std::vector<Uint32>* code;
+
+    int pc;
+
+    int regs[16];
+
+    bool done;
+};
+
+class ScriptHost
+{
+public:
+    ScriptHost(Tilemap* t, Player* p, Dialog* d, Fight* f, SDL_Surface* sprite);
+    ~ScriptHost();
+
+    void add(const std::vector<Uint32>* code);
+
+    void update();
+
+    int call(int id, int* args, int argc);
 
     void render();
 
+    std::vector<Script> scripts;
+
+    std::vector<Start_men*> npcs;
+
+    int budget;
+
+    int effects;
+
+    FramePipe* pipe;
+
+    Scheduler* scheduler;
+
+    LightMap* lights;
+
+    bool pushback;
+
 private:
-    Texture npc_texture;
+    Tilemap* tilemap;
+    Player* player;
+    Dialog* dialog;
+    Fight* fight;
+    SDL_Surface* sprite;
+};
 
-    int frame;
+const int net_players = 8;
+const int net_entities = 16;
+const int net_history = 32;
+const int net_inputs = 64;
+const int net_rate = 60;
+
+enum NetMessage
+{
+    NET_HELLO,
+    NET_WELCOME,
+    NET_INPUT,
+    NET_SNAPSHOT,
+    NET_BYE
 };
-class Animation
+
+enum NetButton
+{
+    NET_LEFT = 1,
+    NET_RIGHT = 2,
+    NET_UP = 4,
+    NET_DOWN = 8,
+    //on the wire only, an input that carries script effects
+    NET_MOVED = 16,
+    NET_NPC = 32
+};
+
+struct NetAddress
 {
+    Uint32 host;
+    Uint16 port;
+};
+
+class UdpSocket
+{
+public:
+    UdpSocket();
+
+    bool open(Uint16 port);
+
+    void close();
+
+    bool send(NetAddress& to, const Uint8* data, int size);
+
+    int receive(Uint8* data, int size, NetAddress& from);
+
+    static bool resolve(std::string text, NetAddress& address);
+
+    ~UdpSocket();
+
 private:
-    Timer timer;
-    char direction;
-    bool animation;
-    float seconds;
+    Sint64 handle;
+};
+
+//players take slots 0-7 and npcs 8-15, positions are whole pixels
+struct NetEntity
+{
+    Sint16 x, y;
+    Sint8 lastx, lasty;
+    Uint8 moving;
+    Sint16 hp;
+};
+
+//one tick of a client: the buttons it held and what its level script did since the previous input,
+//the server runs no script for real players so the client reports the effects; npc is 1-based like script handles, 0 for none
+struct NetInput
+{
+    Uint8 buttons;
+    Sint16 dx, dy;
+    Uint8 npc;
+    Sint16 npc_dx, npc_dy, hp;
+};
+
+struct NetSnapshot
+{
+    Uint32 tick;
+    Uint16 active;
+    NetEntity entities[net_entities];
+};
+
+//authoritative copy of one level, no renderer needed
+class World
+{
 public:
-    Animation(float s, char d = 's');
+    World();
 
-    void start();
+    bool load(int level);
+
+    int join();
+
+    void leave(int slot);
+
+    void step(Uint8* buttons);
+
+    void apply(int slot, const NetInput& input);
+
+    void capture(NetSnapshot& snapshot);
+
+    size_t footprint();
+
+    ~World();
+
+    Tilemap tilemap;
+
+    LevelAssets assets;
+
+    Player ghost;
+
+    ScriptHost host;
+
+    Scheduler scheduler;
 
-    void check();
+    Player* players[net_players];
 
-    void anim(NPC* npc);
+    Uint32 ticks;
 
-    void anim(Player* player);
+    //co-op leaves fights to the clients' fight screen, instances resolve them here
+    bool fights;
+
+    Combat combat;
+
+    int fighter, foe;
+
+    Uint32 won, lost;
+
+private:
+    void fight();
 };
 
-class Dialog
+struct InstanceStats
+{
+    SDL_atomic_t tick_us, peak_us, ticks, bytes;
+};
+
+class InstanceServer;
+
+struct InstanceShard
+{
+    InstanceServer* server;
+    int first, count;
+    SDL_Thread* thread;
+    SDL_atomic_t late;
+};
+
+//many independent worlds, each shard of them ticked by its own thread at the same fixed rate
+class InstanceServer
 {
-    Texture back;
-    std::string texts[100];
-    Texture text;
-    int i;
-    int page, max_pages;
-    int pixels[5];
-    Timer next;
-    bool view;
-    bool to_hide;
 public:
-    Dialog(std::string path);
+    InstanceServer();
 
-    void next_page(SDL_Event& e);
+    bool start(int instances, int workers, int players);
 
-    void start();
+    void run(int seconds);
 
-    void draw();
+    void report();
 
-    bool active_dialog();
+    void stop();
+
+    ~InstanceServer();
+
+    std::vector<World*> worlds;
+
+    std::vector<InstanceStats> stats;
+
+    std::vector<InstanceShard> shards;
+
+    int players;
+
+    SDL_atomic_t quit;
+
+private:
+    static int worker(void* data);
+};
 
+struct NetPeer
+{
+    NetAddress address;
+    bool connected;
+    Uint32 acked, received, processed, echo, heard, rtt;
+    NetInput inputs[net_inputs];
+    Uint8 held;
+    Uint64 bytes_in, bytes_out;
 };
-class Input
+
+class NetServer
 {
 public:
-    Input(int x, int y);
+    NetServer();
 
-    void inputtext(SDL_Event& e);
+    bool open(Uint16 port, int level);
 
-    void inside(int x, int y, SDL_Event& e);
+    void run(int seconds);
 
-    void render();
+    void tick();
 
-    SDL_Rect Collider;
+    World world;
 
-    Texture texttexture;
+    UdpSocket socket;
 
-    bool write, renderText;
+    NetPeer peers[net_players];
 
-    std::string text;
+    NetSnapshot history[net_history];
 
-    SDL_Point mPosition;
+private:
+    void receive();
+
+    void send();
 
+    void report();
 };
 
-class Button
+class NetClient
 {
 public:
-    Button(std::string pathin, std::string pathout);
+    NetClient();
 
-    void setPosistion(int x, int y);
+    bool connect(NetAddress& to, bool visible);
 
-    int handleEvent(SDL_Event* e);
+    void tick(Player* p, const Uint8* keys, Tilemap* t, ScriptHost* host);
+
+    void nudge(int dx, int dy);
+
+    void effect(int npc, int dx, int dy, int hp);
 
     void render();
 
-    ~Button();
+    void disconnect();
+
+    void report();
+
+    ~NetClient();
+
+    UdpSocket socket;
+
+    NetAddress server;
+
+    int slot;
+
+    Uint32 seq, acked, processed, rtt, ticks, corrections;
+
+    Uint64 bytes_in, bytes_out;
+
+    NetSnapshot latest;
+
+    NetSnapshot history[net_history];
+
+    Player* remotes[net_players];
 
 private:
-    SDL_Point mPosition;
+    bool receive();
 
-    Texture mousein, mouseuot;
+    void reconcile(Player* p, Tilemap* t, ScriptHost* host);
 
-    int BUTTON_HEIGHT, BUTTON_WIDTH;
+    void step(Player* p, const Uint8* keys, Tilemap* t, ScriptHost* host);
 
-    bool inside;
+    NetInput inputs[net_inputs];
 
+    //script effects not sent yet, the player's go into the next input and npcs' one per input
+    NetInput pending;
+
+    std::vector<NetInput> effects;
+
+    Uint64 stepped;
 };
 
-class Eq
+class LevelLoop
 {
-    Texture eq;
-    Texture nickname;
-    Texture hp;
-    Texture power;
-    bool show;
 public:
-    Eq(Player *p);
+    LevelLoop(Tilemap* t, Player* p, Dialog* d, Eq* eq, ScriptHost* host, Rewind* rewind);
+
+    void tick(InputBatch* input);
+
     void draw();
-    void check_show(SDL_Event e);
-    ~Eq();
-};
 
-class Fight
-{
-public:
-    Fight(Tilemap* t, Player* p);
-    bool fight(Player* p, NPC* npc, Tilemap* t);
+    static int simulate(void* data);
+
+    FramePipe pipe;
+
+    NetClient* net;
+
+    LightMap* lights;
 
 private:
-    Texture back;
-    Texture ui;
+    Tilemap* tilemap;
+    Player* player;
+    Dialog* dialog;
+    Eq* eq;
+    ScriptHost* host;
+    Rewind* rewind;
+    int frames;
+    int step_cell;
+    bool quiet;
+    Uint64 stepped;
 };
 
 bool checkCollision(SDL_Rect& a, SDL_Rect& b);
+Uint64 hashBytes(const void* data, size_t size, Uint64 hash = 14695981039346656037ULL);
+SDL_RWops* openAsset(std::string path);
+bool readAsset(std::string path, std::string& content);
+bool buildPack(std::string directory, std::string path);
+bool readDialog(std::string path, std::vector<std::string>& lines);
+bool parseLayer(std::string& content, TileLayer& layer);
+bool compileScript(std::string& source, std::vector<Uint32>& code, std::string& error);
+bool compileScripts(std::string directory);
+bool loadScript(std::string path, std::vector<Uint32>& code);
+Uint64 assetStamp(std::string path);
+bool parseOptions(int argc, char* argv[]);
+void simulateCombat(int battles, Uint64 seed, int spread);
+int writeSnapshot(NetSnapshot& current, NetSnapshot* baseline, Uint8* data);
+int readSnapshot(const Uint8* data, int size, NetSnapshot* baseline, NetSnapshot& out);
+int writeInput(const NetInput& input, Uint8* data);
+int readInput(const Uint8* data, int size, NetInput& input);
+Uint8 netButtons(const Uint8* keys);
+const Uint8* buttonKeys(Uint8 buttons, Uint8* keys);
+void walkPlayer(Player* p, const Uint8* keys, Tilemap* t);
+int fixedSteps(Uint32 now, Uint64& done, int rate);
+void pushPlayer(Player* p, std::vector<Start_men*>& npcs);
+void runServer(Uint16 port, int seconds);
+void runBots(NetAddress& server, int count, int seconds);
+void runInstances(int instances, int workers, int players, int seconds);
+bool runRaster(std::string output, std::string golden, int frames, int threads);
+void runParticles(int count, int frames);
+bool checkMemory();
+bool checkBlend();
+bool checkLayers();
+int pollEvent(SDL_Event* e);
+void waitForEvent(int timeout);
+void markInput(Uint64 when);
+
+Uint64 takeInput();
+void present();
+int takeAllocations();
+void drawHud();
+Uint32 getTicks();
+const Uint8* getKeyboardState();
+void useKeyboard(const Uint8* keys);
 bool init();
-void close(Tilemap* t, Player* p);
+void close(Tilemap* t, Player* p, Levels* l);
 bool checkCollision(SDL_Rect& a, SDL_Rect& b);
 int loadMedia(Tilemap* t);
-void first(Tilemap* t, Player* p);
-void menu(Tilemap* t, Player* p);
-void play_menu(Tilemap* t, Player* p);
-void new_game_menu(Tilemap* t, Player* p);
-void load_game_menu(Tilemap* t, Player* p);
-void about_menu(Tilemap* t, Player* p);
\ No newline at end of file
+void first(Tilemap* t, Player* p, Levels* l);
+void menu(Tilemap* t, Player* p, Levels* l);
+void play_menu(Tilemap* t, Player* p, Levels* l);
+void new_game_menu(Tilemap* t, Player* p, Levels* l);
+void load_game_menu(Tilemap* t, Player* p, Levels* l);
+void about_menu(Tilemap* t, Player* p, Levels* l);
\ No newline at end of file
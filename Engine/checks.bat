@@ -0,0 +1,32 @@
+@echo off
+rem Headless checks of the engine, run after a build: checks.bat [path to Engine.exe]
+setlocal
+set ENGINE=%~1
+if "%ENGINE%"=="" set ENGINE=%~dp0..\x64\Release\Engine.exe
+cd /d "%~dp0"
+set FAILED=0
+
+echo --memory-check
+"%ENGINE%" --memory-check || set FAILED=1
+
+echo --blend-check
+"%ENGINE%" --blend-check || set FAILED=1
+
+echo --layer-check
+"%ENGINE%" --layer-check || set FAILED=1
+
+rem the reference must come from the engine itself: the first run on a good build writes it, commit it from there;
+rem after an intended change to the level 1 scene, delete it and run again
+if not exist Golden\level1.png (
+    echo Golden\level1.png is missing, writing it from this build
+    if not exist Golden mkdir Golden
+    "%ENGINE%" --raster Golden\level1.png --raster-frames 1 || set FAILED=1
+)
+echo --raster
+"%ENGINE%" --raster "%TEMP%\engine_raster.png" --golden Golden\level1.png --raster-frames 1 || set FAILED=1
+
+if %FAILED%==1 (
+    echo Some checks failed
+    exit /b 1
+)
+echo All checks passed
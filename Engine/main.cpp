@@ -2,8 +2,14 @@
 #include "Engine.h"
 Tilemap tilemap;
 Player player(5000, 5000);
+Levels levels;
 int main(int argc, char* argv[])
 {
+    if (!parseOptions(argc, argv))
+    {
+        return 0;
+    }
+
     if (!init())
     {
         printf("Falied to initialize\n");
@@ -18,24 +24,25 @@ int main(int argc, char* argv[])
         }
         else
         {
+            levels.preload(player.map);
 
-            menu(&tilemap, &player);
+            menu(&tilemap, &player, &levels);
             if (player.load() == false)
             {
-                close(&tilemap, &player);
+                close(&tilemap, &player, &levels);
                 exit(0);
             }
             switch (player.map)
             {
             case 1:
-                first(&tilemap, &player);
+                first(&tilemap, &player, &levels);
                 break;
             default:
-                close(&tilemap, &player);
+                close(&tilemap, &player, &levels);
             }
             
         }
     }
-    close(&tilemap, &player);
+    close(&tilemap, &player, &levels);
     return 0;
 }